@@ -0,0 +1,253 @@
+#define _GNU_SOURCE    // fopencookie()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "machine.h"
+#include "code.h"
+#include "pool.h"
+
+// Output is compared in chunks of this size, so a run that has diverged stops
+// within this many bytes of output
+#define BATCH_COMPARE_BYTES (16 << 10)
+
+#define MANIFEST_LINE_BYTES 4096
+
+#define JOB_pass        0
+#define JOB_diverged    1   // Output differs from the golden log
+#define JOB_unloadable  2   // The code or the golden log could not be read
+
+/*
+ * One program to run and the log it must reproduce.
+ */
+struct job_t {
+    char *code_filepath;
+    uint64_t pc;
+    uint64_t sp;
+    char *log_filepath;
+    int status;             // JOB_* constants above
+    uint64_t steps;         // Instructions executed
+    uint64_t divergence;    // Step at which the output first differs; 0 is the initial state
+};
+
+/*
+ * Where a job's output is checked as it is written: the golden log, and how
+ * far into it the output matches.
+ */
+struct compare_t {
+    char *expected;
+    uint64_t length;
+    uint64_t matched;       // Bytes of output that matched
+    int diverged;
+};
+
+/*
+ * Compare the next chunk of output with the golden log, noting where they
+ * first differ.
+ */
+static ssize_t compare_write(void *cookie, const char *buffer, size_t size) {
+    struct compare_t *compare = cookie;
+    if (compare->diverged) {
+        return size;
+    }
+    uint64_t left = compare->length - compare->matched;
+    uint64_t same = 0;
+    while (same < size && same < left && buffer[same] == compare->expected[compare->matched + same]) {
+        same++;
+    }
+    compare->matched += same;
+    compare->diverged = same < size;
+    return size;
+}
+
+/*
+ * Read a whole file into memory; return NULL if it cannot be read.
+ */
+static char *read_file(char *filepath, uint64_t *length) {
+    FILE *file = fopen(filepath, "rb");
+    if (file == NULL) {
+        perror("Failed to load log");
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    rewind(file);
+    char *contents = malloc(*length + 1);
+    if (fread(contents, 1, *length, file) != *length) {
+        free(contents);
+        contents = NULL;
+    }
+    fclose(file);
+    return contents;
+}
+
+/*
+ * Run one job, writing the state after every step exactly as the simulator
+ * prints it, and stop as soon as the output stops matching the golden log.
+ */
+static void run_job(void *context, uint64_t item) {
+    struct job_t *job = &((struct job_t *)context)[item];
+    struct compare_t compare = {NULL, 0, 0, 0};
+    compare.expected = read_file(job->log_filepath, &compare.length);
+    struct machine_t *m = machine_create();
+    if (compare.expected == NULL || !machine_load(m, job->code_filepath, job->pc, job->sp)) {
+        job->status = JOB_unloadable;
+        free(compare.expected);
+        machine_destroy(m);
+        return;
+    }
+
+    cookie_io_functions_t functions = {NULL, compare_write, NULL, NULL};
+    FILE *out = fopencookie(&compare, "w", functions);
+    setvbuf(out, NULL, _IOFBF, BATCH_COMPARE_BYTES);
+    machine_print_memory(m, out);
+    fprintf(out, "\n\n");
+    while (!compare.diverged) {
+        uint64_t index = machine_slot(m, m->pc);
+        if (!machine_step(m)) {
+            if (m->memory->fault.kind != FAULT_none) {
+                // The faulting instruction did not complete; stop at it
+                if (m->memory->fault.kind != FAULT_code) {
+                    fprint_instruction(out, unpack_instruction(m->code[index]));
+                }
+                machine_print_fault(m, out);
+                machine_print_memory(m, out);
+                fprintf(out, "\n\n");
+            }
+            break;
+        }
+        job->steps++;
+        fprint_instruction(out, unpack_instruction(m->code[index]));
+        machine_print_memory(m, out);
+        fprintf(out, "\n\n");
+    }
+    fclose(out);
+
+    // A log that goes on after the output ends diverges where the output ends
+    if (compare.diverged || compare.matched < compare.length) {
+        // Every state the simulator prints ends with a blank line after the
+        // bottom of the stack, so count those before the first difference
+        job->status = JOB_diverged;
+        for (uint64_t i = 2; i < compare.matched; i++) {
+            if (compare.expected[i] == '\n' && compare.expected[i - 1] == '\n' && compare.expected[i - 2] == '\n') {
+                job->divergence++;
+            }
+        }
+    }
+    free(compare.expected);
+    machine_destroy(m);
+}
+
+/*
+ * Read a manifest with one job per line: the code file, pc, sp and golden
+ * log, separated by spaces. Blank lines and lines starting with # are
+ * skipped. Return the jobs, or NULL if the manifest cannot be read.
+ */
+static struct job_t *read_manifest(char *filepath, uint64_t *count) {
+    FILE *manifest = fopen(filepath, "r");
+    if (manifest == NULL) {
+        perror("Failed to load manifest");
+        return NULL;
+    }
+
+    uint64_t capacity = 64;
+    struct job_t *jobs = malloc(capacity * sizeof(struct job_t));
+    *count = 0;
+    char line[MANIFEST_LINE_BYTES];
+    char code_filepath[MANIFEST_LINE_BYTES];
+    char log_filepath[MANIFEST_LINE_BYTES];
+    char pc[MANIFEST_LINE_BYTES];
+    char sp[MANIFEST_LINE_BYTES];
+    for (int number = 1; fgets(line, sizeof(line), manifest) != NULL; number++) {
+        char first;
+        if (sscanf(line, " %c", &first) != 1 || first == '#') {
+            continue;
+        }
+        if (sscanf(line, "%s %s %s %s", code_filepath, pc, sp, log_filepath) != 4) {
+            fprintf(stderr, "%s:%d: expected CODE_FILEPATH PC SP LOG_FILEPATH\n", filepath, number);
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity *= 2;
+            jobs = realloc(jobs, capacity * sizeof(struct job_t));
+        }
+        struct job_t *job = &jobs[(*count)++];
+        memset(job, 0, sizeof(struct job_t));
+        job->code_filepath = strdup(code_filepath);
+        job->pc = strtol(pc, NULL, 0);
+        job->sp = strtol(sp, NULL, 0);
+        job->log_filepath = strdup(log_filepath);
+    }
+    fclose(manifest);
+    return jobs;
+}
+
+/*
+ * Seconds since an arbitrary point, for timing the whole batch.
+ */
+static double seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    // Check for valid command line arguments
+    int workers = pool_default_workers();
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        default:
+            printf("Usage: %s [-j WORKERS] MANIFEST_FILEPATH\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || workers < 1) {
+        printf("Usage: %s [-j WORKERS] MANIFEST_FILEPATH\n", argv[0]);
+        exit(1);
+    }
+
+    uint64_t count;
+    struct job_t *jobs = read_manifest(argv[optind], &count);
+    if (jobs == NULL) {
+        exit(1);
+    }
+
+    // Run every job, then report on them in the order of the manifest
+    double start = seconds();
+    pool_run(workers, count, run_job, jobs);
+    double elapsed = seconds() - start;
+
+    uint64_t passed = 0;
+    uint64_t steps = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        struct job_t *job = &jobs[i];
+        switch (job->status) {
+        case JOB_pass:
+            printf("PASS %s (%lu steps)\n", job->code_filepath, job->steps);
+            passed++;
+            break;
+        case JOB_diverged:
+            printf("FAIL %s: differs from %s at step %lu\n", job->code_filepath, job->log_filepath, job->divergence);
+            break;
+        default:
+            printf("FAIL %s: could not be loaded\n", job->code_filepath);
+        }
+        steps += job->steps;
+        free(job->code_filepath);
+        free(job->log_filepath);
+    }
+    printf("%lu of %lu passed; %lu instructions in %.3f s (%.0f instructions/s) on %d workers\n",
+            passed, count, steps, elapsed, elapsed > 0 ? steps / elapsed : 0.0, workers);
+
+    // Clean-up
+    free(jobs);
+    program_cache_clear();
+    return passed != count;
+}
@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "breakpoint.h"
+#include "engine.h"
+#include "jit.h"
+
+/*
+ * Where a condition is being read, and what it has compiled to so far.
+ */
+struct parser_t {
+    char *next;
+    struct breakpoint_t *breakpoint;
+    int valid;
+};
+
+static void parse_or(struct parser_t *parser);
+
+/*
+ * Skip past a token if it comes next; return whether it did.
+ */
+static int accept(struct parser_t *parser, char *token) {
+    while (isspace((unsigned char)*parser->next)) {
+        parser->next++;
+    }
+    size_t length = strlen(token);
+    if (strncmp(parser->next, token, length) != 0) {
+        return 0;
+    }
+    parser->next += length;
+    return 1;
+}
+
+/*
+ * Append an operation to the compiled condition.
+ */
+static void emit(struct parser_t *parser, uint8_t op, uint64_t value) {
+    struct breakpoint_t *breakpoint = parser->breakpoint;
+    if (breakpoint->num_ops == BREAKPOINT_MAX_OPS) {
+        parser->valid = 0;
+        return;
+    }
+    breakpoint->ops[breakpoint->num_ops++] = (struct break_op_t){op, value};
+}
+
+/*
+ * Read a number, a register, sp, pc, steps, a word of memory as [address],
+ * or a parenthesized condition.
+ */
+static void parse_value(struct parser_t *parser) {
+    if (accept(parser, "(")) {
+        parse_or(parser);
+        parser->valid &= accept(parser, ")");
+        return;
+    }
+    if (accept(parser, "[")) {
+        parse_or(parser);
+        parser->valid &= accept(parser, "]");
+        emit(parser, BREAK_load, 0);
+        return;
+    }
+    char *start = parser->next;
+    if (isdigit((unsigned char)*start) || (*start == '-' && isdigit((unsigned char)start[1]))) {
+        emit(parser, BREAK_constant, *start == '-' ? -strtoull(start + 1, &parser->next, 0) : strtoull(start, &parser->next, 0));
+        return;
+    }
+    char *end = start;
+    while (isalnum((unsigned char)*end)) {
+        end++;
+    }
+    parser->next = end;
+    if (end - start == 2 && strncmp(start, "sp", 2) == 0) {
+        emit(parser, BREAK_sp, 0);
+    }
+    else if (end - start == 2 && strncmp(start, "pc", 2) == 0) {
+        emit(parser, BREAK_pc, 0);
+    }
+    else if (end - start == 5 && strncmp(start, "steps", 5) == 0) {
+        emit(parser, BREAK_steps, 0);
+    }
+    else if ((*start == 'x' || *start == 'w') && end - start > 1 && end - start <= 3
+            && strspn(start + 1, "0123456789") == (size_t)(end - start - 1) && strtoul(start + 1, NULL, 10) <= 30) {
+        emit(parser, *start == 'x' ? BREAK_x : BREAK_w, strtoul(start + 1, NULL, 10));
+    }
+    else {
+        parser->valid = 0;
+    }
+}
+
+/*
+ * Read values added to and subtracted from each other.
+ */
+static void parse_sum(struct parser_t *parser) {
+    parse_value(parser);
+    while (parser->valid) {
+        if (accept(parser, "+")) {
+            parse_value(parser);
+            emit(parser, BREAK_add, 0);
+        }
+        else if (accept(parser, "-")) {
+            parse_value(parser);
+            emit(parser, BREAK_sub, 0);
+        }
+        else {
+            break;
+        }
+    }
+}
+
+/*
+ * Read a sum, or a comparison of two.
+ */
+static void parse_comparison(struct parser_t *parser) {
+    static char *tokens[] = {"==", "!=", "<=", ">=", "<", ">"};
+    static uint8_t ops[] = {BREAK_eq, BREAK_ne, BREAK_le, BREAK_ge, BREAK_lt, BREAK_gt};
+    parse_sum(parser);
+    for (int i = 0; i < 6; i++) {
+        if (accept(parser, tokens[i])) {
+            parse_sum(parser);
+            emit(parser, ops[i], 0);
+            break;
+        }
+    }
+}
+
+/*
+ * Read comparisons joined by && and ||, && binding tighter.
+ */
+static void parse_and(struct parser_t *parser) {
+    parse_comparison(parser);
+    while (parser->valid && accept(parser, "&&")) {
+        parse_comparison(parser);
+        emit(parser, BREAK_and, 0);
+    }
+}
+
+static void parse_or(struct parser_t *parser) {
+    parse_and(parser);
+    while (parser->valid && accept(parser, "||")) {
+        parse_and(parser);
+        emit(parser, BREAK_or, 0);
+    }
+}
+
+/*
+ * Create a breakpoint from text: a number of steps, as in "5000", or a
+ * condition, as in "pc == 0x7c4" or "x0 > 3 && [sp + 8] != 0". Return NULL
+ * if the text is neither.
+ */
+struct breakpoint_t *breakpoint_create(char *text) {
+    struct breakpoint_t *breakpoint = calloc(1, sizeof(struct breakpoint_t));
+    char *end;
+    breakpoint->target = strtoull(text, &end, 0);
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (end != text && *end == '\0' && *text != '-') {
+        breakpoint->kind = BREAKPOINT_steps;
+        return breakpoint;
+    }
+
+    struct parser_t parser = {text, breakpoint, 1};
+    parse_or(&parser);
+    accept(&parser, "");
+    if (!parser.valid || *parser.next != '\0') {
+        fprintf(stderr, "Invalid breakpoint: %s\n", text);
+        free(breakpoint);
+        return NULL;
+    }
+
+    // Waiting for the pc needs no stack machine
+    struct break_op_t *ops = breakpoint->ops;
+    breakpoint->kind = BREAKPOINT_condition;
+    if (breakpoint->num_ops == 3 && ops[2].op == BREAK_eq
+            && ((ops[0].op == BREAK_pc && ops[1].op == BREAK_constant) || (ops[0].op == BREAK_constant && ops[1].op == BREAK_pc))) {
+        breakpoint->kind = BREAKPOINT_pc;
+        breakpoint->target = ops[0].op == BREAK_constant ? ops[0].value : ops[1].value;
+    }
+    return breakpoint;
+}
+
+/*
+ * Check whether a breakpoint's condition holds for a machine that has run
+ * some steps.
+ */
+int breakpoint_holds(struct breakpoint_t *breakpoint, struct machine_t *m, uint64_t steps) {
+    switch (breakpoint->kind) {
+    case BREAKPOINT_steps:
+        return steps == breakpoint->target;
+    case BREAKPOINT_pc:
+        return m->pc == breakpoint->target;
+    }
+
+    uint64_t stack[BREAKPOINT_MAX_OPS];
+    int depth = 0;
+    for (int i = 0; i < breakpoint->num_ops; i++) {
+        struct break_op_t *op = &breakpoint->ops[i];
+        int64_t a = depth >= 2 ? (int64_t)stack[depth - 2] : 0;
+        int64_t b = depth >= 1 ? (int64_t)stack[depth - 1] : 0;
+        switch (op->op) {
+        case BREAK_constant:
+            stack[depth++] = op->value;
+            continue;
+        case BREAK_x:
+            stack[depth++] = m->registers[op->value];
+            continue;
+        case BREAK_w:
+            stack[depth++] = (uint32_t)m->registers[op->value];
+            continue;
+        case BREAK_sp:
+            stack[depth++] = m->sp;
+            continue;
+        case BREAK_pc:
+            stack[depth++] = m->pc;
+            continue;
+        case BREAK_steps:
+            stack[depth++] = steps;
+            continue;
+        case BREAK_load:
+            stack[depth - 1] = memory_peek(m->memory, stack[depth - 1]);
+            continue;
+        case BREAK_add:
+            stack[depth - 2] = (uint64_t)a + (uint64_t)b;
+            break;
+        case BREAK_sub:
+            stack[depth - 2] = (uint64_t)a - (uint64_t)b;
+            break;
+        case BREAK_eq:
+            stack[depth - 2] = a == b;
+            break;
+        case BREAK_ne:
+            stack[depth - 2] = a != b;
+            break;
+        case BREAK_lt:
+            stack[depth - 2] = a < b;
+            break;
+        case BREAK_gt:
+            stack[depth - 2] = a > b;
+            break;
+        case BREAK_le:
+            stack[depth - 2] = a <= b;
+            break;
+        case BREAK_ge:
+            stack[depth - 2] = a >= b;
+            break;
+        case BREAK_and:
+            stack[depth - 2] = a != 0 && b != 0;
+            break;
+        case BREAK_or:
+            stack[depth - 2] = a != 0 || b != 0;
+            break;
+        }
+        depth--;
+    }
+    return stack[0] != 0;
+}
+
+/*
+ * Keep the range shown as the stack covering sp, as a trace and the engine
+ * do.
+ */
+static void grow_stack_to_sp(struct machine_t *m) {
+    if (m->sp < m->stack_top || m->sp > m->stack_bot) {
+        machine_grow_stack(m, m->sp);
+    }
+}
+
+/*
+ * Run a machine without showing its steps to anything until a breakpoint
+ * holds or the machine stops; return the steps run. A number of steps is
+ * run by the engine, and anything else by stepping the machine and checking
+ * the breakpoint before every step.
+ */
+uint64_t breakpoint_run(struct breakpoint_t *breakpoint, struct machine_t *m) {
+    breakpoint->executed = 0;
+    if (breakpoint->kind == BREAKPOINT_steps) {
+        struct engine_t *engine = engine_create(m);
+        engine_enable_jit(engine, JIT_THRESHOLD);
+        breakpoint->executed = engine_run(engine, breakpoint->target);
+        engine_destroy(engine);
+        breakpoint->reached = breakpoint->executed == breakpoint->target;
+    }
+    else if (breakpoint->kind == BREAKPOINT_pc) {
+        while (m->pc != breakpoint->target && machine_step(m)) {
+            breakpoint->executed++;
+            grow_stack_to_sp(m);
+        }
+        breakpoint->reached = m->pc == breakpoint->target && m->memory->fault.kind == FAULT_none;
+    }
+    else {
+        while (!(breakpoint->reached = breakpoint_holds(breakpoint, m, breakpoint->executed)) && machine_step(m)) {
+            breakpoint->executed++;
+            grow_stack_to_sp(m);
+        }
+    }
+    return breakpoint->executed;
+}
+
+/*
+ * Free a breakpoint.
+ */
+void breakpoint_destroy(struct breakpoint_t *breakpoint) {
+    free(breakpoint);
+}
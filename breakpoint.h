@@ -0,0 +1,59 @@
+#ifndef __BREAKPOINT_H__
+#define __BREAKPOINT_H__
+
+#include <stdint.h>
+#include "machine.h"
+
+// What a breakpoint waits for
+#define BREAKPOINT_steps        0   // A number of steps
+#define BREAKPOINT_pc           1   // The pc reaching an address
+#define BREAKPOINT_condition    2   // Any other condition
+
+// Operations of a compiled condition, each pushing onto or popping from a
+// stack of values
+#define BREAK_constant  0   // Push value
+#define BREAK_x         1   // Push x register number value
+#define BREAK_w         2   // Push w register number value
+#define BREAK_sp        3
+#define BREAK_pc        4
+#define BREAK_steps     5   // Push the steps run so far
+#define BREAK_load      6   // Replace an address with the 8 bytes at it
+#define BREAK_add       7   // Replace the top two values with the result
+#define BREAK_sub       8
+#define BREAK_eq        9   // Comparisons are signed and push 1 or 0
+#define BREAK_ne        10
+#define BREAK_lt        11
+#define BREAK_gt        12
+#define BREAK_le        13
+#define BREAK_ge        14
+#define BREAK_and       15
+#define BREAK_or        16
+
+// Most operations a condition compiles to
+#define BREAKPOINT_MAX_OPS      64
+
+struct break_op_t {
+    uint8_t op;             // BREAK_* constants above
+    uint64_t value;
+};
+
+/*
+ * A point of a run to skip ahead to: a step count, a pc, or a condition on
+ * the registers and memory, compiled once into operations for a stack
+ * machine so that checking it before each step is cheap.
+ */
+struct breakpoint_t {
+    uint8_t kind;           // BREAKPOINT_* constants above
+    uint64_t target;        // BREAKPOINT_steps: steps to run; BREAKPOINT_pc: the address
+    struct break_op_t ops[BREAKPOINT_MAX_OPS];
+    int num_ops;
+    uint64_t executed;      // Steps the last breakpoint_run() ran
+    uint8_t reached;        // Set if the last breakpoint_run() stopped at the breakpoint
+};
+
+struct breakpoint_t *breakpoint_create(char *text);
+int breakpoint_holds(struct breakpoint_t *breakpoint, struct machine_t *m, uint64_t steps);
+uint64_t breakpoint_run(struct breakpoint_t *breakpoint, struct machine_t *m);
+void breakpoint_destroy(struct breakpoint_t *breakpoint);
+
+#endif // __BREAKPOINT_H__
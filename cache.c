@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+/*
+ * Check whether a number is a power of two.
+ */
+static int is_power_of_two(uint64_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+/*
+ * Read a size in bytes, with an optional k or m suffix; return 0 if it is
+ * not one.
+ */
+static uint64_t parse_size(char *text, char **end) {
+    uint64_t size = strtoull(text, end, 0);
+    if (**end == 'k' || **end == 'K') {
+        size <<= 10;
+        (*end)++;
+    }
+    else if (**end == 'm' || **end == 'M') {
+        size <<= 20;
+        (*end)++;
+    }
+    return *end == text ? 0 : size;
+}
+
+/*
+ * Parse the shape of a cache from SIZE:WAYS:LINE[:POLICY[:CYCLES]], as in
+ * "32k:8:64:plru:4", leaving the policy and cycles in config as they were
+ * if they are not given. Return 0 if the text is not a valid shape.
+ */
+int cache_parse_config(char *text, struct cache_config_t *config) {
+    char *end;
+    config->size_bytes = parse_size(text, &end);
+    if (*end != ':') {
+        return 0;
+    }
+    config->ways = strtoul(end + 1, &end, 0);
+    if (*end != ':') {
+        return 0;
+    }
+    config->line_bytes = strtoul(end + 1, &end, 0);
+    if (*end == ':') {
+        char *policy = end + 1;
+        end = policy + strcspn(policy, ":");
+        if (end - policy == 3 && strncmp(policy, "lru", 3) == 0) {
+            config->policy = CACHE_lru;
+        }
+        else if (end - policy == 4 && strncmp(policy, "plru", 4) == 0) {
+            config->policy = CACHE_plru;
+        }
+        else {
+            return 0;
+        }
+    }
+    if (*end == ':') {
+        char *cycles = end + 1;
+        config->cycles = strtoul(cycles, &end, 0);
+        if (end == cycles) {
+            return 0;
+        }
+    }
+    if (*end != '\0' || config->ways == 0 || config->ways > CACHE_MAX_WAYS
+            || !is_power_of_two(config->line_bytes)
+            || config->size_bytes % ((uint64_t)config->ways * config->line_bytes) != 0
+            || !is_power_of_two(config->size_bytes / config->ways / config->line_bytes)) {
+        return 0;
+    }
+    return config->policy != CACHE_plru || is_power_of_two(config->ways);
+}
+
+/*
+ * Create an empty cache of a shape cache_parse_config() accepts.
+ */
+struct cache_t *cache_create(struct cache_config_t config) {
+    struct cache_t *cache = calloc(1, sizeof(struct cache_t));
+    cache->config = config;
+    cache->sets = config.size_bytes / config.ways / config.line_bytes;
+    while (((uint64_t)1 << cache->line_bits) < config.line_bytes) {
+        cache->line_bits++;
+    }
+    cache->tags = malloc(cache->sets * config.ways * sizeof(uint64_t));
+    for (uint64_t i = 0; i < cache->sets * config.ways; i++) {
+        cache->tags[i] = CACHE_INVALID;
+    }
+    if (config.policy == CACHE_lru) {
+        cache->used = calloc(cache->sets * config.ways, sizeof(uint64_t));
+    }
+    else {
+        cache->tree = calloc(cache->sets, sizeof(uint64_t));
+    }
+    return cache;
+}
+
+/*
+ * Point the tree of a set away from a way that was just used: each node on
+ * the path to it is set to the other half.
+ */
+static void touch_tree(uint64_t *tree, uint32_t ways, uint32_t way) {
+    uint64_t node = 1;
+    for (uint32_t half = ways / 2; half > 0; half /= 2) {
+        uint64_t right = (way & half) != 0;
+        if (right) {
+            *tree &= ~((uint64_t)1 << node);
+        }
+        else {
+            *tree |= (uint64_t)1 << node;
+        }
+        node = 2 * node + right;
+    }
+}
+
+/*
+ * Follow the tree of a set to the way it points at.
+ */
+static uint32_t tree_victim(uint64_t tree, uint32_t ways) {
+    uint64_t node = 1;
+    uint32_t way = 0;
+    for (uint32_t half = ways / 2; half > 0; half /= 2) {
+        uint64_t right = (tree >> node) & 1;
+        if (right) {
+            way |= half;
+        }
+        node = 2 * node + right;
+    }
+    return way;
+}
+
+/*
+ * Access the line holding an address; return 1 if the cache held it, or 0
+ * if it missed and the line has replaced another.
+ */
+int cache_access(struct cache_t *cache, uint64_t address) {
+    uint64_t line = address >> cache->line_bits;
+    uint64_t set = line & (cache->sets - 1);
+    uint32_t ways = cache->config.ways;
+    uint64_t *tags = &cache->tags[set * ways];
+    uint32_t way = 0;
+    while (way < ways && tags[way] != line) {
+        way++;
+    }
+    int hit = way < ways;
+    if (hit) {
+        cache->hits++;
+    }
+    else {
+        cache->misses++;
+        // Fill an empty way first, or else evict
+        way = 0;
+        while (way < ways && tags[way] != CACHE_INVALID) {
+            way++;
+        }
+        if (way == ways && cache->config.policy == CACHE_lru) {
+            way = 0;
+            for (uint32_t i = 1; i < ways; i++) {
+                if (cache->used[set * ways + i] < cache->used[set * ways + way]) {
+                    way = i;
+                }
+            }
+        }
+        else if (way == ways) {
+            way = tree_victim(cache->tree[set], ways);
+        }
+        tags[way] = line;
+    }
+
+    if (cache->config.policy == CACHE_lru) {
+        cache->used[set * ways + way] = ++cache->clock;
+    }
+    else {
+        touch_tree(&cache->tree[set], ways, way);
+    }
+    return hit;
+}
+
+/*
+ * Free a cache.
+ */
+void cache_destroy(struct cache_t *cache) {
+    free(cache->tags);
+    free(cache->used);
+    free(cache->tree);
+    free(cache);
+}
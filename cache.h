@@ -0,0 +1,51 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+
+// How a set chooses the line to evict
+#define CACHE_lru       0   // The line used least recently
+#define CACHE_plru      1   // The line a binary tree of bits points at, as hardware does
+
+// Tag of a line that holds nothing
+#define CACHE_INVALID   UINT64_MAX
+
+// Most ways a set can have
+#define CACHE_MAX_WAYS  64
+
+/*
+ * The shape of a cache: size_bytes = sets * ways * line_bytes, with the
+ * number of sets and line_bytes powers of two, and ways a power of two for
+ * CACHE_plru. cycles is what a hit in it costs.
+ */
+struct cache_config_t {
+    uint64_t size_bytes;
+    uint32_t ways;
+    uint32_t line_bytes;
+    uint8_t policy;         // CACHE_* constants above
+    uint32_t cycles;
+};
+
+/*
+ * A set-associative cache that only tracks which lines it holds, not their
+ * data. Every access that misses allocates the line, whether it is a load or
+ * a store.
+ */
+struct cache_t {
+    struct cache_config_t config;
+    uint64_t sets;
+    int line_bits;
+    uint64_t *tags;         // Line number held by each way of each set
+    uint64_t *used;         // CACHE_lru: when each way was last used
+    uint64_t *tree;         // CACHE_plru: a set's tree, node i at bit i, from 1
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+int cache_parse_config(char *text, struct cache_config_t *config);
+struct cache_t *cache_create(struct cache_config_t config);
+int cache_access(struct cache_t *cache, uint64_t address);
+void cache_destroy(struct cache_t *cache);
+
+#endif // __CACHE_H__
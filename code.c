@@ -2,9 +2,51 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "machine.h"
 #include "code.h"
+#include "decode.h"
+#include "pool.h"
+
+// Large files are parsed on several threads, in chunks of about this size
+#define PARSE_CHUNK_BYTES (1 << 20)
+
+/*
+ * A range of lines of a file being parsed, the sections starting in it, and
+ * the instructions found in it
+ */
+struct parse_chunk_t {
+    char *start;
+    char *end;
+    uint64_t lines;         // Lines parsed so far
+    uint8_t found;          // Set once an instruction has been found
+    uint64_t low;           // Address of the first instruction
+    uint64_t low_line;
+    uint64_t high;          // Address of the last instruction
+    uint64_t error_line;    // Line of an instruction out of order; 0 if there is none
+    uint64_t error_address;
+    uint64_t error_previous;    // Address of the instruction before it
+    struct section_t *sections; // Sections starting in the chunk, the first maybe earlier
+    uint64_t num_sections;
+    uint64_t first_section; // Index in the file's sections of the chunk's first one
+    struct symbol_table_t symbols;  // Symbols named in the chunk
+};
+
+/*
+ * A file being parsed, once the addresses of its first and last
+ * instructions are known
+ */
+struct parse_t {
+    char *text;
+    struct code_map_t map;
+    struct packed_t *instructions;
+    uint64_t *offsets;      // Where each instruction's line is, when only indexing
+    struct parse_chunk_t *chunks;
+    int filling;            // Set once the sections are known, to fill in the slots
+};
 
 /*
  * Parse a string containing an ARM operand
@@ -107,50 +149,50 @@ struct operand_t parse_operand(char *str) {
 }
 
 /*
- * Print a register operand in human-readable form
+ * Print a register operand in human-readable form to a stream
  */
-void print_register_operand(struct operand_t operand) {
+static void fprint_register_operand(FILE *out, struct operand_t operand) {
     switch(operand.reg_type) {
     case REGISTER_w:
     case REGISTER_x:
         // Special case w/xzr
         if (operand.reg_num == 31) {
-            printf("%czr", operand.reg_type);
+            fprintf(out, "%czr", operand.reg_type);
         }
         else {
-            printf("%c%d", operand.reg_type, operand.reg_num);
+            fprintf(out, "%c%d", operand.reg_type, operand.reg_num);
         }
         break;
     case REGISTER_sp:
-        printf("sp");
+        fprintf(out, "sp");
         break;
     case REGISTER_pc:
-        printf("pc");
+        fprintf(out, "pc");
         break;
     }
 }
 
 /*
- * Print an operand in a human-readable form
+ * Print an operand in a human-readable form to a stream
  */
-void print_operand(struct operand_t operand) {
+void fprint_operand(FILE *out, struct operand_t operand) {
     switch(operand.type) {
     case OPERAND_register:
-        print_register_operand(operand);
+        fprint_register_operand(out, operand);
         break;
     case OPERAND_constant:
-        printf("#%d", operand.constant);
+        fprintf(out, "#%d", operand.constant);
         break;
     case OPERAND_memory: 
-        printf("[");
-        print_register_operand(operand);
+        fprintf(out, "[");
+        fprint_register_operand(out, operand);
         if (operand.constant != 0) {
-            printf(", #%d", operand.constant);
+            fprintf(out, ", #%d", operand.constant);
         }
-        printf("]");
+        fprintf(out, "]");
         break;
     case OPERAND_address:
-        printf("%x", operand.constant);
+        fprintf(out, "%x", operand.constant);
         break;
     case OPERAND_NULL:
         break;
@@ -159,6 +201,13 @@ void print_operand(struct operand_t operand) {
     }
 }
 
+/*
+ * Print an operand in a human-readable form
+ */
+void print_operand(struct operand_t operand) {
+    fprint_operand(stdout, operand);
+}
+
 /*
  * Parse a string containing an ARM assembly instruction.
  */
@@ -170,28 +219,32 @@ struct instruction_t parse_instruction(char *str) {
     while (str[i] != '\0' && !isspace(str[i])) {
         i++;
     }
-    str[i++] = '\0';
+    if (str[i] != '\0') {
+        str[i++] = '\0';
+    }
     strncpy((char *)&instruction.operation, str, 4);
 
     int num_operands = 0;
 
-    // Locate and store the operands; the delimeter between operands is a whitespace character
+    // Locate and store the operands; the delimeter between operands is a whitespace character,
+    // and the end of the string ends the last one
     int sqbkt = 0;
     int j = i;
     int comment = 0;
-    while (str[i] != '\0' && num_operands < MAX_OPERANDS && comment < 2) {
-        if ('[' == str[i]) {
+    while (num_operands < MAX_OPERANDS && comment < 2) {
+        char c = str[i];
+        if ('[' == c) {
             sqbkt = 1;
         }
-        else if (']' == str[i]) {
+        else if (']' == c) {
             sqbkt = 0;
         }
-        else if ('/' == str[i]) {
+        else if ('/' == c) {
             comment++;
         }
-        else if (isspace(str[i]) && !sqbkt) {
+        else if ((isspace(c) && !sqbkt) || '\0' == c) {
             str[i] = '\0';
-            if (str[i-1] == ',') {
+            if (i > j && str[i-1] == ',') {
                 str[i-1] = '\0';
             }
             if (i != j) {
@@ -199,6 +252,9 @@ struct instruction_t parse_instruction(char *str) {
                 num_operands++;
             }
             j = i+1;
+            if ('\0' == c) {
+                break;
+            }
         }
         i++;
     }
@@ -213,121 +269,694 @@ struct instruction_t parse_instruction(char *str) {
 }
 
 /*
- * Print an instruction in a human-readable form
+ * Print an instruction in a human-readable form to a stream
  */
-void print_instruction(struct instruction_t instruction) {
+void fprint_instruction(FILE *out, struct instruction_t instruction) {
     // Print operation
     char name[5];
     strncpy(name, (char *)&instruction.operation, 4); // Operation code is based on name
     name[4] = '\0';
-    printf("%s ", name);
+    fprintf(out, "%s ", name);
 
     // Print operands
-    print_operand(instruction.operands[0]);
+    fprint_operand(out, instruction.operands[0]);
     if (instruction.operands[1].type != OPERAND_NULL) {
-        printf(", ");
-        print_operand(instruction.operands[1]);
+        fprintf(out, ", ");
+        fprint_operand(out, instruction.operands[1]);
     }
     if (instruction.operands[2].type != OPERAND_NULL) {
-        printf(", ");
-        print_operand(instruction.operands[2]);
+        fprintf(out, ", ");
+        fprint_operand(out, instruction.operands[2]);
     }
-    printf("\n");
+    fprintf(out, "\n");
+}
+
+/*
+ * Print an instruction in a human-readable form
+ */
+void print_instruction(struct instruction_t instruction) {
+    fprint_instruction(stdout, instruction);
 }
 
+// The type and register type of an operand of each PACKED_* kind
+static const struct operand_t packed_kinds[] = {
+    [PACKED_null] = {OPERAND_NULL, '\0'},
+    [PACKED_constant] = {OPERAND_constant, '\0'},
+    [PACKED_address] = {OPERAND_address, '\0'},
+    [PACKED_w] = {OPERAND_register, REGISTER_w},
+    [PACKED_x] = {OPERAND_register, REGISTER_x},
+    [PACKED_sp] = {OPERAND_register, REGISTER_sp},
+    [PACKED_pc] = {OPERAND_register, REGISTER_pc},
+    [PACKED_memory] = {OPERAND_memory, '\0'},
+    [PACKED_memory_w] = {OPERAND_memory, REGISTER_w},
+    [PACKED_memory_x] = {OPERAND_memory, REGISTER_x},
+    [PACKED_memory_sp] = {OPERAND_memory, REGISTER_sp},
+    [PACKED_memory_pc] = {OPERAND_memory, REGISTER_pc},
+};
+
 /*
- * Parse a file containing the output from objdump; return an array of instructions
+ * Return the PACKED_* kind of an operand, or -1 if its type is unknown.
  */
-struct instruction_t *parse_file(char *filepath, uint64_t *code_start, uint64_t *code_end) {
-    // Open source code
+static int packed_kind(struct operand_t operand) {
+    switch (operand.type) {
+    case OPERAND_NULL:
+    case OPERAND_constant:
+    case OPERAND_address:
+        operand.reg_type = '\0';
+        break;
+    case OPERAND_memory:
+        if (operand.reg_type != REGISTER_w && operand.reg_type != REGISTER_x
+                && operand.reg_type != REGISTER_sp && operand.reg_type != REGISTER_pc) {
+            operand.reg_type = '\0';
+        }
+        break;
+    }
+    for (int kind = 0; kind <= PACKED_memory_pc; kind++) {
+        if (packed_kinds[kind].type == operand.type && packed_kinds[kind].reg_type == operand.reg_type) {
+            return kind;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Pack an instruction into the form programs hold. Return 0, with a
+ * warning, if some operand cannot be packed; it is left out.
+ */
+int pack_instruction(struct instruction_t instruction, struct packed_t *packed) {
+    memset(packed, 0, sizeof(struct packed_t));
+    packed->operation = instruction.operation;
+    int constants = 0;
+    int complete = 1;
+    for (int i = 0; i < MAX_OPERANDS; i++) {
+        struct operand_t operand = instruction.operands[i];
+        int kind = packed_kind(operand);
+        int has_register = operand.type == OPERAND_register || operand.type == OPERAND_memory;
+        int has_constant = operand.type == OPERAND_constant || operand.type == OPERAND_address
+            || operand.type == OPERAND_memory;
+        int numbered = has_register && (operand.reg_type == REGISTER_w || operand.reg_type == REGISTER_x);
+        if (kind < 0 || (numbered && operand.reg_num >= (1 << PACKED_REG_BITS))
+                || (has_constant && constants == PACKED_CONSTANTS)) {
+            complete = 0;
+            continue;
+        }
+        packed->kinds |= kind << (i * PACKED_KIND_BITS);
+        if (numbered) {
+            packed->regs |= operand.reg_num << (i * PACKED_REG_BITS);
+        }
+        if (has_constant) {
+            packed->constants[constants++] = operand.constant;
+        }
+    }
+    if (!complete) {
+        fprintf(stderr, "! Cannot hold every operand of: ");
+        fprint_instruction(stderr, instruction);
+    }
+    return complete;
+}
+
+/*
+ * Unpack an instruction held by a program.
+ */
+struct instruction_t unpack_instruction(struct packed_t packed) {
+    struct instruction_t instruction;
+    instruction.operation = packed.operation;
+    int constants = 0;
+    for (int i = 0; i < MAX_OPERANDS; i++) {
+        struct operand_t *operand = &instruction.operands[i];
+        *operand = packed_kinds[(packed.kinds >> (i * PACKED_KIND_BITS)) & ((1 << PACKED_KIND_BITS) - 1)];
+        operand->reg_num = (packed.regs >> (i * PACKED_REG_BITS)) & ((1 << PACKED_REG_BITS) - 1);
+        if (operand->type == OPERAND_constant || operand->type == OPERAND_address || operand->type == OPERAND_memory) {
+            operand->constant = packed.constants[constants++];
+        }
+    }
+    return instruction;
+}
+
+/*
+ * Find the section that covers an address; return NULL if none does.
+ */
+struct section_t *find_section(struct section_t *sections, uint64_t num_sections, uint64_t address) {
+    uint64_t low = 0;
+    uint64_t high = num_sections;
+    while (low < high) {
+        uint64_t middle = (low + high) / 2;
+        if (address < sections[middle].start) {
+            high = middle;
+        }
+        else if (address - sections[middle].start >= sections[middle].bytes) {
+            low = middle + 1;
+        }
+        else {
+            return &sections[middle];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Find the section a slot is in, including the empty slot after it.
+ */
+struct section_t *find_slot_section(struct section_t *sections, uint64_t num_sections, uint64_t slot) {
+    uint64_t low = 0;
+    uint64_t high = num_sections;
+    while (high - low > 1) {
+        uint64_t middle = (low + high) / 2;
+        if (slot < sections[middle].slot) {
+            high = middle;
+        }
+        else {
+            low = middle;
+        }
+    }
+    return &sections[low];
+}
+
+/*
+ * Add a symbol to a table, copying its name.
+ */
+void add_symbol(struct symbol_table_t *table, uint64_t address, char *name, uint64_t length) {
+    if ((table->count & (table->count - 1)) == 0) {
+        uint64_t capacity = table->count == 0 ? 1 : table->count * 2;
+        table->symbols = realloc(table->symbols, capacity * sizeof(struct symbol_t));
+    }
+    // Names grow in powers of two as well
+    uint64_t bytes = table->names_bytes + length + 1;
+    uint64_t capacity = 64;
+    while (capacity < table->names_bytes) {
+        capacity *= 2;
+    }
+    if (table->names == NULL || bytes > capacity) {
+        while (capacity < bytes) {
+            capacity *= 2;
+        }
+        table->names = realloc(table->names, capacity);
+    }
+    struct symbol_t *symbol = &table->symbols[table->count++];
+    symbol->address = address;
+    symbol->name = table->names_bytes;
+    memcpy(table->names + table->names_bytes, name, length);
+    table->names[bytes - 1] = '\0';
+    table->names_bytes = bytes;
+}
+
+/*
+ * Order two symbols by address, keeping symbols at the same address in the
+ * order they were added.
+ */
+static int compare_symbols(const void *first, const void *second) {
+    const struct symbol_t *a = first;
+    const struct symbol_t *b = second;
+    if (a->address != b->address) {
+        return a->address < b->address ? -1 : 1;
+    }
+    return (a->name > b->name) - (a->name < b->name);
+}
+
+/*
+ * Put the symbols of a table in address order.
+ */
+void sort_symbols(struct symbol_table_t *table) {
+    if (table->count > 1) {
+        qsort(table->symbols, table->count, sizeof(struct symbol_t), compare_symbols);
+    }
+}
+
+/*
+ * Find the symbol an address belongs to: the last one at or before it.
+ * Return NULL if there is none.
+ */
+struct symbol_t *find_symbol(struct symbol_table_t *table, uint64_t address) {
+    uint64_t low = 0;
+    uint64_t high = table->count;
+    while (low < high) {
+        uint64_t middle = (low + high) / 2;
+        if (table->symbols[middle].address <= address) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low == 0 ? NULL : &table->symbols[low - 1];
+}
+
+/*
+ * Free the symbols and names of a table that was built by add_symbol().
+ */
+void free_symbols(struct symbol_table_t *table) {
+    free(table->symbols);
+    free(table->names);
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+ * Read a whole file into one buffer, with a terminator after its last byte;
+ * return NULL if it cannot be read.
+ */
+static char *read_source(char *filepath, uint64_t *length) {
     FILE *source = fopen(filepath, "r");
     if (NULL == source) {
         perror("Failed to load code");
-        exit(1);
-    }
-
-    // Read in lines of source code
-    char line[100];
-    int line_num = 0;
-    int instruction_offset = 0;
-    struct instruction_t *instructions = malloc(sizeof(struct instruction_t));
-    while(fgets(line, sizeof(line), source) != NULL) {
-        line_num++;
-        // Skip blank lines
-        if (line[0] == '\n' || line[strlen(line)-2] == ':') {
-            continue;
+        return NULL;
+    }
+    struct stat status;
+    char *text = NULL;
+    if (fstat(fileno(source), &status) == 0) {
+        text = malloc(status.st_size + 1);
+        *length = fread(text, 1, status.st_size, source);
+        if (*length != (uint64_t)status.st_size) {
+            free(text);
+            text = NULL;
         }
+    }
+    if (NULL == text) {
+        perror("Failed to load code");
+    }
+    else {
+        text[*length] = '\0';
+    }
+    fclose(source);
+    return text;
+}
 
-        //printf("%s", line);
+/*
+ * Check whether a line of objdump output holds an instruction: a hex address
+ * followed by a colon and the instruction's encoding. Headers, labels and
+ * interleaved source lines do not.
+ */
+static int is_instruction_line(char *line) {
+    while (isspace(*line)) {
+        line++;
+    }
+    if (!isxdigit(*line)) {
+        return 0;
+    }
+    while (isxdigit(*line)) {
+        line++;
+    }
+    return line[0] == ':' && isspace(line[1]);
+}
 
-        // Skip indendentation
-        int i = 0;
-        while (isspace(line[i])) {
-            i++;
-        }
+/*
+ * Check whether a line of objdump output names the code that follows it, as
+ * in "0000000000000754 <mystrlen>:", and if so find the address and name.
+ */
+static int is_symbol_line(char *line, uint64_t *address, char **name, uint64_t *length) {
+    char *c = line;
+    while (isxdigit(*c)) {
+        c++;
+    }
+    if (c == line || c[0] != ' ' || c[1] != '<') {
+        return 0;
+    }
+    char *end = c + 2;
+    while (*end != '\0' && *end != '\n' && *end != '>') {
+        end++;
+    }
+    if (end[0] != '>' || end[1] != ':') {
+        return 0;
+    }
+    *address = strtoull(line, NULL, 16);
+    *name = c + 2;
+    *length = end - *name;
+    return 1;
+}
 
-        // Extract address 
-        char *addr = line+i;
-        while (!isspace(line[i])) {
-            i++;
+/*
+ * Return the address of an instruction line, and where its encoding and its
+ * operation start.
+ */
+static uint64_t split_instruction_line(char *line, char **encoding, char **operation) {
+    int i = 0;
+    while (isspace(line[i])) {
+        i++;
+    }
+    uint64_t address = strtoull(line + i, NULL, 16);
+    while (!isspace(line[i])) {
+        i++;
+    }
+    while (isspace(line[i])) {
+        i++;
+    }
+    *encoding = line + i;
+    while (line[i] != '\0' && !isspace(line[i])) {
+        i++;
+    }
+    while (isspace(line[i])) {
+        i++;
+    }
+    *operation = line + i;
+    return address;
+}
+
+/*
+ * Build the instruction on a line from its encoding, falling back on its
+ * text when the encoding is not a single 32-bit word or is not one that
+ * decode_instruction() handles.
+ */
+static struct instruction_t read_instruction(uint64_t address, char *encoding, char *operation) {
+    struct instruction_t instruction;
+    int digits = 0;
+    while (isxdigit(encoding[digits])) {
+        digits++;
+    }
+    if (digits == 2 * INSTRUCTION_SIZE && (isspace(encoding[digits]) || encoding[digits] == '\0')
+            && decode_instruction(strtoul(encoding, NULL, 16), address, &instruction)) {
+        return instruction;
+    }
+    return parse_instruction(operation);
+}
+
+/*
+ * Start a new section of a chunk at an address.
+ */
+static void add_chunk_section(struct parse_chunk_t *chunk, uint64_t address) {
+    if ((chunk->num_sections & (chunk->num_sections - 1)) == 0) {
+        uint64_t capacity = chunk->num_sections == 0 ? 1 : chunk->num_sections * 2;
+        chunk->sections = realloc(chunk->sections, capacity * sizeof(struct section_t));
+    }
+    struct section_t *section = &chunk->sections[chunk->num_sections++];
+    section->start = address;
+    section->bytes = INSTRUCTION_SIZE;
+    section->slot = 0;
+}
+
+/*
+ * Go through the instruction lines in one chunk of a file. Before the
+ * sections are known, check the order of the addresses and find where the
+ * sections start, stopping at the first line whose address is out of order
+ * within the chunk, or outside the code. Once they are known, write each
+ * instruction (or, when indexing, where it is in the file) to the slot for
+ * its address.
+ */
+static void parse_chunk(void *context, uint64_t item) {
+    struct parse_t *parse = context;
+    struct parse_chunk_t *chunk = &parse->chunks[item];
+    struct section_t *section = parse->filling ? &parse->map.sections[chunk->first_section] : NULL;
+    char *next = chunk->start;
+    while (next < chunk->end) {
+        // Split off the next line
+        char *line = next;
+        char *newline = memchr(line, '\n', chunk->end - line);
+        next = newline != NULL ? newline + 1 : chunk->end;
+        if (!parse->filling) {
+            chunk->lines++;
+        }
+        if (!is_instruction_line(line)) {
+            uint64_t symbol_address;
+            char *name;
+            uint64_t length;
+            if (!parse->filling && is_symbol_line(line, &symbol_address, &name, &length)) {
+                add_symbol(&chunk->symbols, symbol_address, name, length);
+            }
+            continue;
         }
-        line[i] = '\0';
-        line[i++] = '\0';
 
-        // Store address of first instruction
-        char *endptr = NULL;
-        if (*code_start == 0) {
-            *code_start = strtol(addr, &endptr, 16);
-            // If we didn't parse a hex number, skip the line
-            if (endptr == addr && *code_start == 0) {
-                continue;
+        char *encoding;
+        char *operation;
+        uint64_t address = split_instruction_line(line, &encoding, &operation);
+        if (parse->filling) {
+            while (address - section->start >= section->bytes) {
+                section++;
+            }
+            uint64_t slot = section->slot + (address - section->start) / INSTRUCTION_SIZE;
+            if (parse->offsets != NULL) {
+                parse->offsets[slot] = line - parse->text + 1;
             }
+            else {
+                if (newline != NULL) {
+                    *newline = '\0';
+                }
+                pack_instruction(read_instruction(address, encoding, operation), &parse->instructions[slot]);
+            }
+            continue;
         }
 
-        uint64_t previous_code_end = *code_end;
-        // Again, a failed parse results in a skipped line
-        *code_end = strtol(addr, &endptr, 16);
-        if (endptr == addr && *code_start == 0) {
+        if ((chunk->found && address <= chunk->high) || address < parse->map.code_start
+                || address > parse->map.code_end || (address - parse->map.code_start) % INSTRUCTION_SIZE != 0) {
+            chunk->error_line = chunk->lines;
+            chunk->error_address = address;
+            chunk->error_previous = chunk->found ? chunk->high : parse->map.code_start;
+            return;
+        }
+        if (!chunk->found) {
+            chunk->low = address;
+            chunk->low_line = chunk->lines;
+            chunk->found = 1;
+            add_chunk_section(chunk, address);
+        }
+        else if (address - chunk->high > SECTION_GAP_BYTES) {
+            add_chunk_section(chunk, address);
+        }
+        chunk->high = address;
+        struct section_t *last = &chunk->sections[chunk->num_sections - 1];
+        last->bytes = address - last->start + INSTRUCTION_SIZE;
+    }
+}
+
+/*
+ * Report the first instruction out of order in a chunk, if there is one.
+ */
+static int check_chunk(char *filepath, struct parse_t *parse, struct parse_chunk_t *chunk, uint64_t lines) {
+    if (chunk->error_line == 0) {
+        return 1;
+    }
+    uint64_t address = chunk->error_address;
+    fprintf(stderr, "%s:%lu: ", filepath, lines + chunk->error_line);
+    if (address > parse->map.code_end) {
+        fprintf(stderr, "instruction at 0x%lx comes after the last one, at 0x%lx\n", address, parse->map.code_end);
+    }
+    else if (address >= parse->map.code_start && (address - parse->map.code_start) % INSTRUCTION_SIZE != 0) {
+        fprintf(stderr, "instruction at 0x%lx is not aligned with the first one, at 0x%lx\n", address, parse->map.code_start);
+    }
+    else {
+        fprintf(stderr, "instruction at 0x%lx does not follow the one at 0x%lx\n", address, chunk->error_previous);
+    }
+    return 0;
+}
+
+/*
+ * Join the sections and symbols the chunks found into the file's, numbering
+ * the slots of the sections; return 0 if the chunks' addresses do not follow
+ * on from each other.
+ */
+static int join_sections(char *filepath, struct parse_t *parse, uint64_t chunks) {
+    struct code_map_t *map = &parse->map;
+    map->sections = NULL;
+    map->num_sections = 0;
+    map->count = 0;
+    memset(&map->symbols, 0, sizeof(map->symbols));
+    uint64_t lines = 0;
+    uint64_t previous = 0;
+    int parsed = 1;
+    for (uint64_t k = 0; k < chunks && parsed; k++) {
+        struct parse_chunk_t *chunk = &parse->chunks[k];
+        if (chunk->found && map->num_sections > 0 && chunk->low <= previous) {
+            chunk->error_line = chunk->low_line;
+            chunk->error_address = chunk->low;
+            chunk->error_previous = previous;
+        }
+        parsed = check_chunk(filepath, parse, chunk, lines);
+        lines += chunk->lines;
+        struct symbol_table_t *symbols = &chunk->symbols;
+        for (uint64_t i = 0; i < symbols->count && parsed; i++) {
+            char *name = SYMBOL_NAME(symbols, &symbols->symbols[i]);
+            add_symbol(&map->symbols, symbols->symbols[i].address, name, strlen(name));
+        }
+        if (!parsed || !chunk->found) {
             continue;
         }
-        // If the addresses aren't strictly increasing, we're going to
-        // overwrite old values, and we're going to be very sorry.
-        assert(previous_code_end < *code_end);
 
-        // Ignore instruction encoding
-        while (!isspace(line[i])) {
-            i++;
+        // A chunk's first section carries on the last one found before it
+        // unless there is a gap between them
+        struct section_t *sections = chunk->sections;
+        uint64_t count = chunk->num_sections;
+        map->sections = realloc(map->sections, (map->num_sections + count) * sizeof(struct section_t));
+        if (map->num_sections > 0 && chunk->low - previous <= SECTION_GAP_BYTES) {
+            struct section_t *last = &map->sections[map->num_sections - 1];
+            last->bytes = sections[0].start + sections[0].bytes - last->start;
+            sections++;
+            count--;
         }
-        while(isspace(line[i])) {
-            i++;
+        memcpy(&map->sections[map->num_sections], sections, count * sizeof(struct section_t));
+        map->num_sections += count;
+        chunk->first_section = map->num_sections - chunk->num_sections;
+        previous = chunk->high;
+    }
+    for (uint64_t i = 0; i < map->num_sections; i++) {
+        map->sections[i].slot = map->count;
+        map->count += SECTION_SLOTS(map->sections[i]);
+    }
+    sort_symbols(&map->symbols);
+    return parsed;
+}
+
+/*
+ * Parse objdump output that is in memory, filling in either parse->offsets
+ * (when it is indexing, leaving the text unchanged) or parse->instructions,
+ * and the map of where they are; return 0 if it is not a sequence of
+ * instructions at increasing addresses.
+ *
+ * A large file is split into chunks on line boundaries that are parsed on
+ * separate threads, twice: first to find the sections, which give the size
+ * of the array, and then to write each instruction straight to its slot.
+ */
+static int parse_text(char *filepath, char *text, uint64_t length, struct parse_t *parse, int indexing) {
+    // Find the first and last instruction lines
+    char *first = text;
+    while (first < text + length && !is_instruction_line(first)) {
+        char *newline = memchr(first, '\n', text + length - first);
+        first = newline != NULL ? newline + 1 : text + length;
+    }
+    char *last = text + length;
+    while (last > first && !is_instruction_line(last)) {
+        do {
+            last--;
+        } while (last > first && last[-1] != '\n');
+    }
+    if (first == text + length) {
+        fprintf(stderr, "%s: no instructions found\n", filepath);
+        return 0;
+    }
+    char *encoding;
+    char *operation;
+    parse->text = text;
+    parse->map.code_start = split_instruction_line(first, &encoding, &operation);
+    parse->map.code_end = split_instruction_line(last, &encoding, &operation);
+    if (parse->map.code_end < parse->map.code_start) {
+        parse->map.code_end = parse->map.code_start;
+    }
+
+    // Split the file into chunks that end at a line boundary
+    uint64_t chunks = (length + PARSE_CHUNK_BYTES - 1) / PARSE_CHUNK_BYTES;
+    parse->chunks = calloc(chunks, sizeof(struct parse_chunk_t));
+    parse->chunks[0].start = text;
+    for (uint64_t k = 1; k < chunks; k++) {
+        char *start = text + k * PARSE_CHUNK_BYTES;
+        if (start < parse->chunks[k - 1].start) {
+            start = parse->chunks[k - 1].start;
+        }
+        char *newline = memchr(start, '\n', text + length - start);
+        parse->chunks[k].start = newline != NULL ? newline + 1 : text + length;
+        parse->chunks[k - 1].end = parse->chunks[k].start;
+    }
+    parse->chunks[chunks - 1].end = text + length;
+    int workers = pool_default_workers();
+    workers = (uint64_t)workers < chunks ? workers : (int)chunks;
+    parse->filling = 0;
+    pool_run(workers, chunks, parse_chunk, parse);
+    int parsed = join_sections(filepath, parse, chunks);
+
+    // Slots for addresses that are skipped hold OPERATION_NULL (or offset 0),
+    // as does the one after each section
+    parse->instructions = NULL;
+    parse->offsets = NULL;
+    if (parsed) {
+        if (indexing) {
+            parse->offsets = calloc(parse->map.count, sizeof(uint64_t));
+        }
+        else {
+            parse->instructions = calloc(parse->map.count, sizeof(struct packed_t));
         }
+        parse->filling = 1;
+        pool_run(workers, chunks, parse_chunk, parse);
+    }
+    else {
+        free(parse->map.sections);
+        free_symbols(&parse->map.symbols);
+    }
+    for (uint64_t k = 0; k < chunks; k++) {
+        free(parse->chunks[k].sections);
+        free_symbols(&parse->chunks[k].symbols);
+    }
+    free(parse->chunks);
+    return parsed;
+}
 
-        // Parse instruction
-        instruction_offset = (*code_end - *code_start) / INSTRUCTION_SIZE;
-        instructions = realloc(instructions,
-                               sizeof(struct instruction_t) *
-                                   (instruction_offset + 1));
-        instructions[instruction_offset] = parse_instruction(line+i);
+/*
+ * Parse a file containing the output from objdump; return an array of packed
+ * instructions, one per slot of the map, or NULL if the file cannot be read
+ * or is not a sequence of instructions at increasing addresses. The file is
+ * read in one block and parsed in place, so lines may be of any length.
+ */
+struct packed_t *parse_file(char *filepath, struct code_map_t *map) {
+    uint64_t length;
+    char *text = read_source(filepath, &length);
+    if (NULL == text) {
+        return NULL;
+    }
+    struct parse_t parse;
+    int parsed = parse_text(filepath, text, length, &parse, 0);
+    free(text);
+    if (!parsed) {
+        return NULL;
     }
+    *map = parse.map;
+    return parse.instructions;
+}
 
-    // Last instruction has no operation 
-    instruction_offset++;
-    instructions = realloc(instructions,
-                           sizeof(struct instruction_t) *
-                               (instruction_offset + 1));
-    instructions[instruction_offset].operation = OPERATION_NULL;
-    fclose(source);
+/*
+ * Index a file containing the output from objdump without parsing any
+ * instruction: map the file, and return the offset plus one of the line of
+ * the instruction in each slot (0 for a slot with no instruction), or NULL
+ * if the file cannot be read or is not a sequence of instructions at
+ * increasing addresses. The file's pages are not kept resident, and a byte
+ * past its end is always 0. Unmap the text with
+ * munmap(*text, *length + 1) once it is no longer needed.
+ */
+uint64_t *index_file(char *filepath, char **text, uint64_t *length, struct code_map_t *map) {
+    int descriptor = open(filepath, O_RDONLY);
+    struct stat status;
+    if (descriptor < 0 || fstat(descriptor, &status) != 0) {
+        perror("Failed to load code");
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        return NULL;
+    }
+
+    // Map the file over zeroed memory one byte longer, so the byte after it
+    // reads as 0 even when the file ends at a page boundary
+    *length = status.st_size;
+    *text = mmap(NULL, *length + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (*text != MAP_FAILED && *length > 0
+            && mmap(*text, *length, PROT_READ, MAP_PRIVATE | MAP_FIXED, descriptor, 0) == MAP_FAILED) {
+        munmap(*text, *length + 1);
+        *text = MAP_FAILED;
+    }
+    close(descriptor);
+    if (*text == MAP_FAILED) {
+        perror("Failed to map code");
+        return NULL;
+    }
 
-    /*
-    // Debugging printf()s.
-    fprintf(stderr, "Code goes from %lx to %lx, %ld instructions\n",
-            *code_start,
-            *code_end,
-            (*code_end - *code_start) / INSTRUCTION_SIZE);
-    int k = 0;
-    while(machine.code[k] != NULL) {
-        printf("%p %s\n", (void *)(machine.code_start + k * 4), machine.code[k]);
-        k++;
-    }*/
-    return instructions;
+    struct parse_t parse;
+    if (!parse_text(filepath, *text, *length, &parse, 1)) {
+        munmap(*text, *length + 1);
+        return NULL;
+    }
+
+    // The text was only read, so drop the pages indexing touched; decoding
+    // reads back the few it needs
+    madvise(*text, *length, MADV_DONTNEED);
+    *map = parse.map;
+    return parse.offsets;
+}
+
+/*
+ * Decode the instruction on a line of objdump output, leaving the line as it
+ * is.
+ */
+struct instruction_t decode_line(char *line) {
+    uint64_t length = strcspn(line, "\n");
+    char *copy = malloc(length + 1);
+    memcpy(copy, line, length);
+    copy[length] = '\0';
+    char *encoding;
+    char *operation;
+    uint64_t address = split_instruction_line(copy, &encoding, &operation);
+    struct instruction_t instruction = read_instruction(address, encoding, operation);
+    free(copy);
+    return instruction;
 }
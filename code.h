@@ -1,7 +1,11 @@
 #ifndef __CODE_H__
 #define __CODE_H__
 
+#include <stdio.h>
+#include <stdint.h>
+
 #define OPERATION_add   0x00646461
+#define OPERATION_adds  0x73646461
 #define OPERATION_sub   0x00627573
 #define OPERATION_subs  0x73627573
 #define OPERATION_mul   0x006C756D
@@ -21,6 +25,7 @@
 #define OPERATION_b     0x00000062
 #define OPERATION_bl    0x00006C62
 #define OPERATION_cmp   0x00706D63
+#define OPERATION_tst   0x00747374
 #define OPERATION_bne   0x656E2E62
 #define OPERATION_beq   0x71652E62
 #define OPERATION_blt   0x746C2E62
@@ -60,8 +65,110 @@ struct instruction_t {
     struct operand_t operands[MAX_OPERANDS];
 };
 
+// What a packed operand is: its type and, for registers and memory, the
+// register type of it or of its base
+#define PACKED_null         0
+#define PACKED_constant     1
+#define PACKED_address      2
+#define PACKED_w            3
+#define PACKED_x            4
+#define PACKED_sp           5
+#define PACKED_pc           6
+#define PACKED_memory       7   // Memory with no base register the simulator knows
+#define PACKED_memory_w     8
+#define PACKED_memory_x     9
+#define PACKED_memory_sp    10
+#define PACKED_memory_pc    11
+
+#define PACKED_KIND_BITS    4
+#define PACKED_REG_BITS     5
+#define PACKED_CONSTANTS    2
+
+/*
+ * An instruction as a program holds it: 16 bytes instead of the 28 of a
+ * struct instruction_t, so that four fit in a cache line. Each operand is a
+ * kind and a register number, and the constants of the operands that have
+ * one are kept in operand order. An instruction with more constant, memory
+ * or address operands than PACKED_CONSTANTS, or with a register above 31,
+ * cannot be packed.
+ */
+struct packed_t {
+    unsigned int operation;     // OPERATION_* constants above
+    uint16_t kinds;             // PACKED_* constant of each operand, PACKED_KIND_BITS each
+    uint16_t regs;              // Register number of each operand, PACKED_REG_BITS each
+    uint32_t constants[PACKED_CONSTANTS];
+};
+
+// Addresses more than this far apart with no instruction between them are
+// put in separate sections, rather than in one with empty slots between
+#define SECTION_GAP_BYTES 4096
+
+// The slot of an address that no section covers
+#define SLOT_NONE UINT64_MAX
+
+/*
+ * A run of code at consecutive addresses. Sections are kept in address
+ * order, and their instructions are numbered in that order, each section
+ * followed by one empty slot, so the slots of code whose sections are far
+ * apart are still dense. Addresses with no instruction in a section (gaps
+ * of less than SECTION_GAP_BYTES) have empty slots too.
+ */
+struct section_t {
+    uint64_t start;         // Address of the first instruction
+    uint64_t bytes;         // Up to and including the last instruction
+    uint64_t slot;          // Slot of the first instruction
+};
+
+#define SECTION_SLOTS(section) ((section).bytes / INSTRUCTION_SIZE + 1)
+
+/*
+ * A named address in a program's code, from a "0000000000000754 <mystrlen>:"
+ * line of objdump output or a function symbol of an ELF file. Names are kept
+ * together in one block, so that a table can be saved and mapped as it is.
+ */
+struct symbol_t {
+    uint64_t address;
+    uint64_t name;          // Offset of the name in the table's names
+};
+
+/*
+ * Symbols in address order, once sorted
+ */
+struct symbol_table_t {
+    struct symbol_t *symbols;
+    uint64_t count;
+    char *names;            // Each name followed by a terminator
+    uint64_t names_bytes;
+};
+
+#define SYMBOL_NAME(table, symbol) ((table)->names + (symbol)->name)
+
+/*
+ * Where the instructions of a program are, and the symbols naming them
+ */
+struct code_map_t {
+    uint64_t code_start;    // Address of the first instruction
+    uint64_t code_end;      // Address of the last instruction
+    struct section_t *sections;
+    uint64_t num_sections;
+    uint64_t count;         // Slots in all sections
+    struct symbol_table_t symbols;
+};
+
+void fprint_operand(FILE *out, struct operand_t operand);
 void print_operand(struct operand_t operand);
+void fprint_instruction(FILE *out, struct instruction_t instruction);
 void print_instruction(struct instruction_t instruction);
-struct instruction_t *parse_file(char *filepath, uint64_t *code_start, uint64_t *code_end);
+int pack_instruction(struct instruction_t instruction, struct packed_t *packed);
+struct instruction_t unpack_instruction(struct packed_t packed);
+struct section_t *find_section(struct section_t *sections, uint64_t num_sections, uint64_t address);
+struct section_t *find_slot_section(struct section_t *sections, uint64_t num_sections, uint64_t slot);
+void add_symbol(struct symbol_table_t *table, uint64_t address, char *name, uint64_t length);
+void sort_symbols(struct symbol_table_t *table);
+struct symbol_t *find_symbol(struct symbol_table_t *table, uint64_t address);
+void free_symbols(struct symbol_table_t *table);
+struct packed_t *parse_file(char *filepath, struct code_map_t *map);
+uint64_t *index_file(char *filepath, char **text, uint64_t *length, struct code_map_t *map);
+struct instruction_t decode_line(char *line);
 
 #endif // __CODE_H__
@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include "decode.h"
+
+// Bits high down to low of an encoding
+#define BITS(encoding, high, low) (((encoding) >> (low)) & ((1u << ((high) - (low) + 1)) - 1))
+#define BIT(encoding, bit) (((encoding) >> (bit)) & 1)
+
+// Register number that is sp or the zero register, depending on the instruction
+#define REGISTER_31 31
+
+/*
+ * Make a w or x register operand, or sp for register 31 where the encoding
+ * means sp by it. Return 0 for wsp, which the simulator has no way to hold.
+ */
+static int register_operand(struct operand_t *operand, int sf, int number, int sp_at_31) {
+    operand->type = OPERAND_register;
+    operand->reg_type = sf ? REGISTER_x : REGISTER_w;
+    operand->reg_num = number;
+    if (number == REGISTER_31 && sp_at_31) {
+        operand->reg_type = REGISTER_sp;
+        operand->reg_num = 0;
+        return sf;
+    }
+    return 1;
+}
+
+/*
+ * Make an immediate operand; return 0 if it does not fit the 32 bits an
+ * operand holds (the simulator zero-extends it).
+ */
+static int constant_operand(struct operand_t *operand, uint64_t value) {
+    operand->type = OPERAND_constant;
+    operand->constant = value;
+    return value <= UINT32_MAX;
+}
+
+/*
+ * Make a branch target operand from the branch's address and its scaled,
+ * sign-extended offset of the given width in bits.
+ */
+static void address_operand(struct operand_t *operand, uint64_t address, uint32_t offset, int bits) {
+    int64_t delta = (int64_t)((uint64_t)offset << (64 - bits)) >> (64 - bits);
+    operand->type = OPERAND_address;
+    operand->constant = address + delta * INSTRUCTION_SIZE;
+}
+
+/*
+ * Expand the immediate of a logical instruction (the DecodeBitMasks() of
+ * the architecture); return 0 if the encoding is reserved.
+ */
+static int decode_bit_masks(int sf, int n, int immr, int imms, uint64_t *mask) {
+    int combined = (n << 6) | (~imms & 0x3F);
+    int length = 31 - __builtin_clz(combined | 1);
+    if (combined == 0 || length < 1 || (!sf && n)) {
+        return 0;
+    }
+    int size = 1 << length;
+    int levels = size - 1;
+    int s = imms & levels;
+    int r = immr & levels;
+    if (s == levels) {
+        return 0;
+    }
+
+    // s + 1 ones, rotated right by r within an element, then replicated
+    uint64_t element = ((uint64_t)1 << (s + 1)) - 1;
+    uint64_t element_mask = size == 64 ? UINT64_MAX : ((uint64_t)1 << size) - 1;
+    if (r != 0) {
+        element = ((element >> r) | (element << (size - r))) & element_mask;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < 64; i += size) {
+        value |= element << i;
+    }
+    *mask = sf ? value : (uint32_t)value;
+    return 1;
+}
+
+/*
+ * Check whether movz or movn could make the immediate of a logical
+ * instruction instead, in which case objdump prints orr from the zero
+ * register as orr rather than as mov.
+ */
+static int move_wide_preferred(int sf, uint64_t immediate) {
+    uint64_t inverted = sf ? ~immediate : (uint32_t)~immediate;
+    for (int shift = 0; shift < (sf ? 64 : 32); shift += 16) {
+        uint64_t outside = ~((uint64_t)0xFFFF << shift);
+        if ((immediate & outside) == 0 || (inverted & outside) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Decode add, sub, adds and subs with an immediate, and their aliases mov
+ * (to or from sp) and cmp.
+ */
+static int decode_add_immediate(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31), op = BIT(encoding, 30), s = BIT(encoding, 29);
+    int rn = BITS(encoding, 9, 5), rd = BITS(encoding, 4, 0);
+    uint64_t immediate = (uint64_t)BITS(encoding, 21, 10) << (BIT(encoding, 22) ? 12 : 0);
+    struct operand_t *operands = instruction->operands;
+    if (!op && !s && immediate == 0 && (rd == REGISTER_31 || rn == REGISTER_31)) {
+        instruction->operation = OPERATION_mov;
+        return register_operand(&operands[0], sf, rd, 1) && register_operand(&operands[1], sf, rn, 1);
+    }
+    if (s && rd == REGISTER_31) {
+        if (!op) {
+            return 0;   // cmn
+        }
+        instruction->operation = OPERATION_cmp;
+        return register_operand(&operands[0], sf, rn, 1) && constant_operand(&operands[1], immediate);
+    }
+    static const unsigned int operations[] = {OPERATION_add, OPERATION_adds, OPERATION_sub, OPERATION_subs};
+    instruction->operation = operations[op * 2 + s];
+    return register_operand(&operands[0], sf, rd, !s) && register_operand(&operands[1], sf, rn, 1)
+        && constant_operand(&operands[2], immediate);
+}
+
+/*
+ * Decode add, sub, adds and subs of unshifted registers, and their aliases
+ * neg and cmp.
+ */
+static int decode_add_register(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31), op = BIT(encoding, 30), s = BIT(encoding, 29);
+    int rm = BITS(encoding, 20, 16), rn = BITS(encoding, 9, 5), rd = BITS(encoding, 4, 0);
+    struct operand_t *operands = instruction->operands;
+    if (BITS(encoding, 23, 22) != 0 || BITS(encoding, 15, 10) != 0) {
+        return 0;   // Shifted
+    }
+    if (s && rd == REGISTER_31) {
+        if (!op) {
+            return 0;   // cmn
+        }
+        instruction->operation = OPERATION_cmp;
+        return register_operand(&operands[0], sf, rn, 0) && register_operand(&operands[1], sf, rm, 0);
+    }
+    if (op && !s && rn == REGISTER_31) {
+        instruction->operation = OPERATION_neg;
+        return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rm, 0);
+    }
+    static const unsigned int operations[] = {OPERATION_add, OPERATION_adds, OPERATION_sub, OPERATION_subs};
+    instruction->operation = operations[op * 2 + s];
+    return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rn, 0)
+        && register_operand(&operands[2], sf, rm, 0);
+}
+
+/*
+ * Decode and, orr and eor with an immediate, and the aliases mov (for orr
+ * from the zero register) and tst (for ands to it).
+ */
+static int decode_logical_immediate(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31), opc = BITS(encoding, 30, 29);
+    int rn = BITS(encoding, 9, 5), rd = BITS(encoding, 4, 0);
+    struct operand_t *operands = instruction->operands;
+    uint64_t immediate;
+    if (!decode_bit_masks(sf, BIT(encoding, 22), BITS(encoding, 21, 16), BITS(encoding, 15, 10), &immediate)) {
+        return 0;
+    }
+    if (opc == 3) {
+        if (rd != REGISTER_31) {
+            return 0;   // ands
+        }
+        instruction->operation = OPERATION_tst;
+        return register_operand(&operands[0], sf, rn, 0) && constant_operand(&operands[1], immediate);
+    }
+    if (rd == REGISTER_31) {
+        return 0;   // To sp
+    }
+    if (opc == 1 && rn == REGISTER_31 && !move_wide_preferred(sf, immediate)) {
+        instruction->operation = OPERATION_mov;
+        return register_operand(&operands[0], sf, rd, 0) && constant_operand(&operands[1], immediate);
+    }
+    static const unsigned int operations[] = {OPERATION_and, OPERATION_orr, OPERATION_eor};
+    instruction->operation = operations[opc];
+    return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rn, 0)
+        && constant_operand(&operands[2], immediate);
+}
+
+/*
+ * Decode and, orr and eor of unshifted registers, and the aliases mov (for
+ * orr from the zero register), mvn and tst.
+ */
+static int decode_logical_register(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31), opc = BITS(encoding, 30, 29), n = BIT(encoding, 21);
+    int rm = BITS(encoding, 20, 16), rn = BITS(encoding, 9, 5), rd = BITS(encoding, 4, 0);
+    struct operand_t *operands = instruction->operands;
+    if (BITS(encoding, 23, 22) != 0 || BITS(encoding, 15, 10) != 0) {
+        return 0;   // Shifted
+    }
+    if (n) {
+        if (opc != 1 || rn != REGISTER_31) {
+            return 0;   // bic, orn, eon or bics
+        }
+        instruction->operation = OPERATION_mvn;
+        return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rm, 0);
+    }
+    if (opc == 3) {
+        if (rd != REGISTER_31) {
+            return 0;   // ands
+        }
+        instruction->operation = OPERATION_tst;
+        return register_operand(&operands[0], sf, rn, 0) && register_operand(&operands[1], sf, rm, 0);
+    }
+    if (opc == 1 && rn == REGISTER_31) {
+        instruction->operation = OPERATION_mov;
+        return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rm, 0);
+    }
+    static const unsigned int operations[] = {OPERATION_and, OPERATION_orr, OPERATION_eor};
+    instruction->operation = operations[opc];
+    return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rn, 0)
+        && register_operand(&operands[2], sf, rm, 0);
+}
+
+/*
+ * Decode movz and movn as the mov of the value they produce.
+ */
+static int decode_move_wide(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31), opc = BITS(encoding, 30, 29), hw = BITS(encoding, 22, 21);
+    if ((opc != 0 && opc != 2) || (!sf && hw > 1)) {
+        return 0;   // movk
+    }
+    uint64_t value = (uint64_t)BITS(encoding, 20, 5) << (hw * 16);
+    if (opc == 0) {
+        value = sf ? ~value : (uint32_t)~value;
+    }
+    instruction->operation = OPERATION_mov;
+    return register_operand(&instruction->operands[0], sf, BITS(encoding, 4, 0), 0)
+        && constant_operand(&instruction->operands[1], value);
+}
+
+/*
+ * Decode the lsl and lsr aliases of ubfm.
+ */
+static int decode_bitfield(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31), immr = BITS(encoding, 21, 16), imms = BITS(encoding, 15, 10);
+    int width = sf ? 64 : 32;
+    if (BITS(encoding, 30, 29) != 2 || BIT(encoding, 22) != sf || immr >= width || imms >= width) {
+        return 0;   // sbfm, bfm or unallocated
+    }
+    uint64_t shift;
+    if (imms == width - 1) {
+        instruction->operation = OPERATION_lsr;
+        shift = immr;
+    }
+    else if (imms + 1 == immr) {
+        instruction->operation = OPERATION_lsl;
+        shift = width - 1 - imms;
+    }
+    else {
+        return 0;   // ubfx, ubfiz or uxt*
+    }
+    return register_operand(&instruction->operands[0], sf, BITS(encoding, 4, 0), 0)
+        && register_operand(&instruction->operands[1], sf, BITS(encoding, 9, 5), 0)
+        && constant_operand(&instruction->operands[2], shift);
+}
+
+/*
+ * Decode instructions with two register sources (udiv, sdiv, lslv and lsrv)
+ * or one (clz and cls).
+ */
+static int decode_data_processing(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31), opcode = BITS(encoding, 15, 10);
+    int rm = BITS(encoding, 20, 16), rn = BITS(encoding, 9, 5), rd = BITS(encoding, 4, 0);
+    struct operand_t *operands = instruction->operands;
+    if (BIT(encoding, 29)) {
+        return 0;
+    }
+    if (BIT(encoding, 30)) {
+        if (rm != 0 || (opcode != 4 && opcode != 5)) {
+            return 0;
+        }
+        instruction->operation = opcode == 4 ? OPERATION_clz : OPERATION_cls;
+        return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rn, 0);
+    }
+    switch (opcode) {
+    case 2:
+        instruction->operation = OPERATION_udiv;
+        break;
+    case 3:
+        instruction->operation = OPERATION_sdiv;
+        break;
+    case 8:
+        instruction->operation = OPERATION_lsl;
+        break;
+    case 9:
+        instruction->operation = OPERATION_lsr;
+        break;
+    default:
+        return 0;
+    }
+    return register_operand(&operands[0], sf, rd, 0) && register_operand(&operands[1], sf, rn, 0)
+        && register_operand(&operands[2], sf, rm, 0);
+}
+
+/*
+ * Decode the mul alias of madd.
+ */
+static int decode_multiply(uint32_t encoding, struct instruction_t *instruction) {
+    int sf = BIT(encoding, 31);
+    if (BITS(encoding, 30, 29) != 0 || BITS(encoding, 23, 21) != 0 || BIT(encoding, 15)
+            || BITS(encoding, 14, 10) != REGISTER_31) {
+        return 0;   // madd with an addend, msub, or a widening multiply
+    }
+    instruction->operation = OPERATION_mul;
+    return register_operand(&instruction->operands[0], sf, BITS(encoding, 4, 0), 0)
+        && register_operand(&instruction->operands[1], sf, BITS(encoding, 9, 5), 0)
+        && register_operand(&instruction->operands[2], sf, BITS(encoding, 20, 16), 0);
+}
+
+/*
+ * Decode ldr, str, ldrb and strb with an unsigned, scaled offset.
+ */
+static int decode_load_store(uint32_t encoding, struct instruction_t *instruction) {
+    int size = BITS(encoding, 31, 30), opc = BITS(encoding, 23, 22);
+    int rn = BITS(encoding, 9, 5), rt = BITS(encoding, 4, 0);
+    if (BIT(encoding, 26) || opc > 1 || size == 1) {
+        return 0;   // SIMD, signed or halfword
+    }
+    static const unsigned int loads[] = {OPERATION_ldrb, 0, OPERATION_ldr, OPERATION_ldr};
+    static const unsigned int stores[] = {OPERATION_strb, 0, OPERATION_str, OPERATION_str};
+    instruction->operation = opc ? loads[size] : stores[size];
+
+    struct operand_t *base = &instruction->operands[1];
+    register_operand(base, 1, rn, 1);
+    base->type = OPERAND_memory;
+    base->constant = BITS(encoding, 21, 10) << size;
+    return register_operand(&instruction->operands[0], size == 3, rt, 0);
+}
+
+/*
+ * Decode b, bl, b.cond, ret and nop.
+ */
+static int decode_branch(uint32_t encoding, uint64_t address, struct instruction_t *instruction) {
+    if (encoding == 0xD503201F) {
+        instruction->operation = OPERATION_nop;
+        return 1;
+    }
+    if (encoding == 0xD65F03C0) {
+        instruction->operation = OPERATION_ret;
+        return 1;
+    }
+    if (BITS(encoding, 30, 26) == 0x05) {
+        instruction->operation = BIT(encoding, 31) ? OPERATION_bl : OPERATION_b;
+        address_operand(&instruction->operands[0], address, BITS(encoding, 25, 0), 26);
+        return 1;
+    }
+    if (BITS(encoding, 31, 24) == 0x54 && !BIT(encoding, 4)) {
+        switch (BITS(encoding, 3, 0)) {
+        case 0x0:
+            instruction->operation = OPERATION_beq;
+            break;
+        case 0x1:
+            instruction->operation = OPERATION_bne;
+            break;
+        case 0xA:
+            instruction->operation = OPERATION_bge;
+            break;
+        case 0xB:
+            instruction->operation = OPERATION_blt;
+            break;
+        case 0xC:
+            instruction->operation = OPERATION_bgt;
+            break;
+        case 0xD:
+            instruction->operation = OPERATION_ble;
+            break;
+        default:
+            return 0;
+        }
+        address_operand(&instruction->operands[0], address, BITS(encoding, 23, 5), 19);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Build an instruction from its 32-bit AArch64 encoding and address, the
+ * way parse_instruction() would from objdump's text for it, including the
+ * aliases objdump prints (mov, cmp, tst, lsl, lsr, mul, ...); aliases the
+ * simulator does not know, like negs, are built as the instruction they
+ * stand for. Return 0 if the encoding is not one the simulator can represent
+ * exactly; the text then has to do.
+ */
+int decode_instruction(uint32_t encoding, uint64_t address, struct instruction_t *instruction) {
+    memset(instruction, 0, sizeof(struct instruction_t));
+    int decoded;
+    switch (BITS(encoding, 28, 25)) {
+    case 0x8:
+    case 0x9:
+        // Data processing with immediates
+        switch (BITS(encoding, 25, 23)) {
+        case 2:
+            decoded = decode_add_immediate(encoding, instruction);
+            break;
+        case 4:
+            decoded = decode_logical_immediate(encoding, instruction);
+            break;
+        case 5:
+            decoded = decode_move_wide(encoding, instruction);
+            break;
+        case 6:
+            decoded = decode_bitfield(encoding, instruction);
+            break;
+        default:
+            decoded = 0;
+        }
+        break;
+    case 0x5:
+    case 0xD:
+        // Data processing with registers
+        if (BITS(encoding, 28, 24) == 0x0A) {
+            decoded = decode_logical_register(encoding, instruction);
+        }
+        else if (BITS(encoding, 28, 24) == 0x0B && !BIT(encoding, 21)) {
+            decoded = decode_add_register(encoding, instruction);
+        }
+        else if (BITS(encoding, 28, 21) == 0xD6) {
+            decoded = decode_data_processing(encoding, instruction);
+        }
+        else if (BITS(encoding, 28, 24) == 0x1B) {
+            decoded = decode_multiply(encoding, instruction);
+        }
+        else {
+            decoded = 0;
+        }
+        break;
+    case 0xA:
+    case 0xB:
+        decoded = decode_branch(encoding, address, instruction);
+        break;
+    case 0x4:
+    case 0x6:
+    case 0xC:
+    case 0xE:
+        // Loads and stores; only those with an unsigned immediate offset
+        decoded = BITS(encoding, 29, 24) == 0x39 && decode_load_store(encoding, instruction);
+        break;
+    default:
+        decoded = 0;
+    }
+    return decoded;
+}
+
+/*
+ * Order ELF section headers by address.
+ */
+static int compare_sections(const void *first, const void *second) {
+    const Elf64_Shdr *a = first, *b = second;
+    return (a->sh_addr > b->sh_addr) - (a->sh_addr < b->sh_addr);
+}
+
+/*
+ * Add the function symbols of an ELF file's symbol table to a map, if it has
+ * one.
+ */
+static void load_elf_symbols(FILE *file, Elf64_Shdr *headers, int num_headers, struct code_map_t *map) {
+    for (int i = 0; i < num_headers; i++) {
+        if (headers[i].sh_type != SHT_SYMTAB || headers[i].sh_entsize != sizeof(Elf64_Sym)
+                || headers[i].sh_link >= (uint32_t)num_headers) {
+            continue;
+        }
+        Elf64_Shdr *strings = &headers[headers[i].sh_link];
+        uint64_t count = headers[i].sh_size / sizeof(Elf64_Sym);
+        Elf64_Sym *symbols = malloc(count * sizeof(Elf64_Sym) + 1);
+        char *names = malloc(strings->sh_size + 1);
+        if (fseek(file, headers[i].sh_offset, SEEK_SET) == 0 && fread(symbols, sizeof(Elf64_Sym), count, file) == count
+                && fseek(file, strings->sh_offset, SEEK_SET) == 0 && fread(names, 1, strings->sh_size, file) == strings->sh_size) {
+            names[strings->sh_size] = '\0';
+            for (uint64_t j = 0; j < count; j++) {
+                if (ELF64_ST_TYPE(symbols[j].st_info) == STT_FUNC && symbols[j].st_shndx != SHN_UNDEF
+                        && symbols[j].st_name < strings->sh_size) {
+                    char *name = names + symbols[j].st_name;
+                    add_symbol(&map->symbols, symbols[j].st_value, name, strlen(name));
+                }
+            }
+        }
+        free(symbols);
+        free(names);
+    }
+    sort_symbols(&map->symbols);
+}
+
+/*
+ * Load the executable sections of an AArch64 ELF file, decoding every
+ * instruction in them, each ELF section becoming a section of the map, and
+ * its function symbols.
+ * Return 1 if they were loaded, 0 if the file is not an ELF file, or -1 if
+ * it cannot be loaded. Words that do not decode are left as OPERATION_NULL,
+ * with a warning.
+ */
+int load_elf(char *filepath, struct packed_t **code, struct code_map_t *map) {
+    FILE *file = fopen(filepath, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    Elf64_Ehdr header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.e_ident, ELFMAG, SELFMAG) != 0) {
+        fclose(file);
+        return 0;
+    }
+    if (header.e_ident[EI_CLASS] != ELFCLASS64 || header.e_ident[EI_DATA] != ELFDATA2LSB
+            || header.e_machine != EM_AARCH64 || header.e_shentsize != sizeof(Elf64_Shdr)) {
+        fprintf(stderr, "%s: not a little-endian AArch64 ELF file\n", filepath);
+        fclose(file);
+        return -1;
+    }
+
+    // Keep the sections of code, in address order
+    Elf64_Shdr *headers = malloc(header.e_shnum * sizeof(Elf64_Shdr) + 1);
+    Elf64_Shdr *sections = malloc(header.e_shnum * sizeof(Elf64_Shdr) + 1);
+    uint64_t found = 0;
+    int num_headers = 0;
+    if (fseek(file, header.e_shoff, SEEK_SET) == 0
+            && fread(headers, sizeof(Elf64_Shdr), header.e_shnum, file) == header.e_shnum) {
+        num_headers = header.e_shnum;
+        for (int i = 0; i < header.e_shnum; i++) {
+            if (headers[i].sh_type == SHT_PROGBITS && (headers[i].sh_flags & SHF_EXECINSTR)
+                    && headers[i].sh_size >= INSTRUCTION_SIZE && headers[i].sh_addr % INSTRUCTION_SIZE == 0) {
+                sections[found++] = headers[i];
+            }
+        }
+    }
+    qsort(sections, found, sizeof(Elf64_Shdr), compare_sections);
+    int loadable = found > 0;
+    for (uint64_t i = 1; i < found; i++) {
+        loadable = loadable && sections[i].sh_addr >= sections[i - 1].sh_addr + sections[i - 1].sh_size;
+    }
+    if (!loadable) {
+        fprintf(stderr, "%s: no executable sections to load, or they overlap\n", filepath);
+        free(headers);
+        free(sections);
+        fclose(file);
+        return -1;
+    }
+
+    map->num_sections = found;
+    map->sections = malloc(found * sizeof(struct section_t));
+    map->count = 0;
+    for (uint64_t i = 0; i < found; i++) {
+        struct section_t *section = &map->sections[i];
+        section->start = sections[i].sh_addr;
+        section->bytes = sections[i].sh_size / INSTRUCTION_SIZE * INSTRUCTION_SIZE;
+        section->slot = map->count;
+        map->count += SECTION_SLOTS(*section);
+    }
+    map->code_start = map->sections[0].start;
+    map->code_end = map->sections[found - 1].start + map->sections[found - 1].bytes - INSTRUCTION_SIZE;
+
+    // Decode every word; the slot after each section holds OPERATION_NULL
+    *code = calloc(map->count, sizeof(struct packed_t));
+    uint64_t undecoded = 0;
+    uint64_t total = 0;
+    int read = 1;
+    for (uint64_t i = 0; i < found && read; i++) {
+        struct section_t *section = &map->sections[i];
+        uint64_t count = section->bytes / INSTRUCTION_SIZE;
+        uint32_t *words = malloc(section->bytes);
+        read = fseek(file, sections[i].sh_offset, SEEK_SET) == 0 && fread(words, INSTRUCTION_SIZE, count, file) == count;
+        for (uint64_t j = 0; j < count && read; j++) {
+            struct instruction_t instruction;
+            if (decode_instruction(words[j], section->start + j * INSTRUCTION_SIZE, &instruction)) {
+                pack_instruction(instruction, &(*code)[section->slot + j]);
+            }
+            else {
+                undecoded++;
+            }
+        }
+        total += count;
+        free(words);
+    }
+    memset(&map->symbols, 0, sizeof(map->symbols));
+    if (read) {
+        load_elf_symbols(file, headers, num_headers, map);
+    }
+    free(headers);
+    free(sections);
+    fclose(file);
+    if (!read) {
+        fprintf(stderr, "%s: truncated executable section\n", filepath);
+        free(*code);
+        free(map->sections);
+        return -1;
+    }
+    if (undecoded > 0) {
+        fprintf(stderr, "%s: %lu of %lu instructions could not be decoded\n", filepath, undecoded, total);
+    }
+    return 1;
+}
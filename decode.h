@@ -0,0 +1,10 @@
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <stdint.h>
+#include "code.h"
+
+int decode_instruction(uint32_t encoding, uint64_t address, struct instruction_t *instruction);
+int load_elf(char *filepath, struct packed_t **code, struct code_map_t *map);
+
+#endif // __DECODE_H__
@@ -0,0 +1,887 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "machine.h"
+#include "code.h"
+#include "engine.h"
+#include "jit.h"
+
+#define PC_OF(s) machine_address(m, (s) - engine->slots)
+
+#define SRC1 ((s->wide & ENGINE_WIDE_SRC1) ? *s->src1 : (uint32_t)*s->src1)
+#define SRC2 ((s->wide & ENGINE_WIDE_SRC2) ? *s->src2 : (uint32_t)*s->src2)
+#define PUT(value) (*s->dst = (s->wide & ENGINE_WIDE_DST) ? (value) : (uint32_t)(value))
+
+// Access the simulated memory, as execute_ldr() and execute_str() do, and
+// stop at the current slot if the access faults
+#define LOAD(variable, address, size) do { \
+        if (!memory_load(m->memory, (address), (size), &(variable))) goto fault; \
+    } while (0)
+#define STORE(address, size, value) do { \
+        if (!memory_store(m->memory, (address), (size), (value))) goto fault; \
+    } while (0)
+
+/*
+ * Find the slot for the instruction at a simulated address; NULL if there is
+ * no instruction there.
+ */
+static struct slot_t *slot_at(struct engine_t *engine, uint64_t pc) {
+    struct machine_t *m = engine->machine;
+    if (pc < m->code_top || pc > m->code_bot) {
+        return NULL;
+    }
+    uint64_t slot = machine_slot(m, pc);
+    if (slot == SLOT_NONE) {
+        return NULL;
+    }
+    return &engine->slots[slot];
+}
+
+/*
+ * Stop a machine at an address with no slot: outside the code it simply
+ * stops, but among the code (between sections) it faults.
+ */
+static void stop_at(struct machine_t *m, uint64_t pc) {
+    m->pc = pc;
+    if (pc >= m->code_top && pc <= m->code_bot) {
+        memory_raise_fault(m->memory, FAULT_code, pc);
+        m->memory->fault.pc = pc;
+    }
+}
+
+/*
+ * Run predecoded instructions for at most max_steps steps. Each handler ends
+ * by jumping directly to the handler of the next slot, so there is no central
+ * dispatch switch. A load or store that faults stops the run at its own
+ * instruction, and nothing runs while a fault is pending. When called with a
+ * NULL engine, store the label table in labels instead.
+ */
+static uint64_t run(struct engine_t *engine, uint64_t max_steps, const void ***labels) {
+    static const void *table[NUM_HANDLERS] = {
+#define SHAPES(name, op) \
+        [HANDLER_##name] = &&do_##name, \
+        [HANDLER_##name##_xxx] = &&do_##name##_xxx, \
+        [HANDLER_##name##_xxi] = &&do_##name##_xxi, \
+        [HANDLER_##name##_www] = &&do_##name##_www, \
+        [HANDLER_##name##_wwi] = &&do_##name##_wwi,
+        BINARY_OPERATIONS(SHAPES)
+#undef SHAPES
+        [HANDLER_add_ssi] = &&do_add_ssi,
+        [HANDLER_sub_ssi] = &&do_sub_ssi,
+        [HANDLER_mov_xx] = &&do_mov_xx,
+        [HANDLER_mov_w] = &&do_mov_w,
+        [HANDLER_mov_sx] = &&do_mov_sx,
+        [HANDLER_ldr_x] = &&do_ldr_x,
+        [HANDLER_ldr_w] = &&do_ldr_w,
+        [HANDLER_str_x] = &&do_str_x,
+        [HANDLER_str_w] = &&do_str_w,
+        [HANDLER_ldrb] = &&do_ldrb,
+        [HANDLER_strb] = &&do_strb,
+        [HANDLER_cmp] = &&do_cmp,
+        [HANDLER_cmp_xx] = &&do_cmp_xx,
+        [HANDLER_cmp_xi] = &&do_cmp_xi,
+        [HANDLER_cmp_ww] = &&do_cmp_ww,
+        [HANDLER_cmp_wi] = &&do_cmp_wi,
+        [HANDLER_b] = &&do_b,
+        [HANDLER_bl] = &&do_bl,
+        [HANDLER_bne] = &&do_bne,
+        [HANDLER_beq] = &&do_beq,
+        [HANDLER_blt] = &&do_blt,
+        [HANDLER_bgt] = &&do_bgt,
+        [HANDLER_ble] = &&do_ble,
+        [HANDLER_bge] = &&do_bge,
+        [HANDLER_ret] = &&do_ret,
+        [HANDLER_nop] = &&do_nop,
+        [HANDLER_clz_x] = &&do_clz_x,
+        [HANDLER_clz_w] = &&do_clz_w,
+        [HANDLER_generic] = &&do_generic,
+        [HANDLER_exit] = &&do_exit,
+#define FUSED(name, op) \
+        [HANDLER_cmp_xx_##name] = &&do_cmp_xx_##name, \
+        [HANDLER_cmp_xi_##name] = &&do_cmp_xi_##name, \
+        [HANDLER_cmp_ww_##name] = &&do_cmp_ww_##name, \
+        [HANDLER_cmp_wi_##name] = &&do_cmp_wi_##name,
+        CONDITIONS(FUSED)
+#undef FUSED
+        [HANDLER_increment_x] = &&do_increment_x,
+        [HANDLER_increment_w] = &&do_increment_w,
+        [HANDLER_store_bytes] = &&do_store_bytes,
+    };
+    if (engine == NULL) {
+        *labels = table;
+        return 0;
+    }
+
+    struct machine_t *m = engine->machine;
+    struct slot_t *s = slot_at(engine, m->pc);
+    uint64_t steps = 0;
+    if (max_steps == 0 || m->memory->fault.kind != FAULT_none) {
+        return 0;
+    }
+    if (s == NULL) {
+        stop_at(m, m->pc);
+        return 0;
+    }
+
+// Count the n instructions just executed, then continue with the next one
+#define DISPATCH_N(next, n) do { \
+        steps += (n); \
+        s = (next); \
+        if (steps >= max_steps) goto suspend; \
+        goto *s->handler; \
+    } while (0)
+#define DISPATCH(next) DISPATCH_N(next, 1)
+
+// Run only the slot's own instruction if the superinstruction would overrun
+#define FUSED_PROLOGUE() do { \
+        if (max_steps - steps < s->length) goto *s->single; \
+    } while (0)
+
+// Count the instruction just executed, then stop at a simulated address
+#define HALT(address) do { \
+        stop_at(m, (address)); \
+        steps++; \
+        goto done; \
+    } while (0)
+
+// Count the n instructions just executed, then continue at a branch target,
+// which may be the start of a block the JIT has compiled or should compile
+#define ENTER_N(next, n) do { \
+        struct slot_t *entered = (next); \
+        if (entered->block != NULL && engine->jit_threshold != 0) { \
+            steps += (n); \
+            s = entered; \
+            goto enter_block; \
+        } \
+        DISPATCH_N(entered, n); \
+    } while (0)
+#define ENTER(next) ENTER_N(next, 1)
+
+// Continue at the branch target, or stop if the target is outside the code
+#define BRANCH() do { \
+        if (s->target == NULL) HALT(s->imm); \
+        ENTER(s->target); \
+    } while (0)
+
+// Keep the range shown as the stack covering sp, as print_memory() would
+#define GROW_STACK() do { \
+        if (m->sp < m->stack_top || m->sp > m->stack_bot) machine_grow_stack(m, m->sp); \
+    } while (0)
+
+// Record a compare of two source values for the lazily evaluated flags
+#define COMPARE(is_wide, op1, op2) do { \
+        m->flags.operation = FLAGS_sub; \
+        m->flags.wide = (is_wide); \
+        m->flags.first = (op1); \
+        m->flags.second = (op2); \
+    } while (0)
+
+    goto *s->handler;
+
+#define SHAPES(name, op) \
+do_##name: \
+    PUT(SRC1 op SRC2); \
+    DISPATCH(s + 1); \
+do_##name##_xxx: \
+    *s->dst = *s->src1 op *s->src2; \
+    DISPATCH(s + 1); \
+do_##name##_xxi: \
+    *s->dst = *s->src1 op s->imm; \
+    DISPATCH(s + 1); \
+do_##name##_www: \
+    *s->dst = (uint32_t)((uint64_t)(uint32_t)*s->src1 op (uint32_t)*s->src2); \
+    DISPATCH(s + 1); \
+do_##name##_wwi: \
+    *s->dst = (uint32_t)((uint64_t)(uint32_t)*s->src1 op s->imm); \
+    DISPATCH(s + 1);
+    BINARY_OPERATIONS(SHAPES)
+#undef SHAPES
+do_add_ssi:
+    m->sp = *s->src1 + s->imm;
+    GROW_STACK();
+    DISPATCH(s + 1);
+do_sub_ssi:
+    m->sp = *s->src1 - s->imm;
+    GROW_STACK();
+    DISPATCH(s + 1);
+do_mov_xx:
+    *s->dst = *s->src1;
+    DISPATCH(s + 1);
+do_mov_w:
+    *s->dst = (uint32_t)*s->src1;
+    DISPATCH(s + 1);
+do_mov_sx:
+    m->sp = *s->src1;
+    GROW_STACK();
+    DISPATCH(s + 1);
+do_ldr_x:
+    LOAD(*s->dst, *s->src1 + s->imm, 8);
+    DISPATCH(s + 1);
+do_ldr_w:
+    LOAD(*s->dst, *s->src1 + s->imm, 4);
+    DISPATCH(s + 1);
+do_str_x:
+    STORE(*s->src1 + s->imm, 8, *s->src2);
+    DISPATCH(s + 1);
+do_str_w:
+    STORE(*s->src1 + s->imm, 4, *s->src2);
+    DISPATCH(s + 1);
+do_ldrb:
+    LOAD(*s->dst, *s->src1 + s->imm, 1);
+    DISPATCH(s + 1);
+do_strb:
+    STORE(*s->src1 + s->imm, 1, *s->src2);
+    DISPATCH(s + 1);
+do_cmp:
+    COMPARE((s->wide & ENGINE_WIDE_SRC1) != 0, SRC1, SRC2);
+    DISPATCH(s + 1);
+do_cmp_xx:
+    COMPARE(1, *s->src1, *s->src2);
+    DISPATCH(s + 1);
+do_cmp_xi:
+    COMPARE(1, *s->src1, s->imm);
+    DISPATCH(s + 1);
+do_cmp_ww:
+    COMPARE(0, (uint32_t)*s->src1, (uint32_t)*s->src2);
+    DISPATCH(s + 1);
+do_cmp_wi:
+    COMPARE(0, (uint32_t)*s->src1, s->imm);
+    DISPATCH(s + 1);
+do_b:
+    BRANCH();
+do_bl:
+    m->registers[30] = PC_OF(s) + INSTRUCTION_SIZE;
+    BRANCH();
+#define CONDITIONAL(name, op) \
+do_##name: \
+    if (condition_holds(&m->flags, OPERATION_##name)) { \
+        BRANCH(); \
+    } \
+    DISPATCH(s + 1);
+    CONDITIONS(CONDITIONAL)
+#undef CONDITIONAL
+do_ret: {
+    uint64_t pc = PC_OF(s);
+    uint64_t next = m->registers[30];
+    if (next == pc) {
+        DISPATCH(s + 1);
+    }
+    struct slot_t *target = slot_at(engine, next);
+    if (target == NULL) {
+        HALT(next);
+    }
+    ENTER(target);
+}
+do_nop:
+    DISPATCH(s + 1);
+do_clz_x:
+    *s->dst = *s->src1 ? __builtin_clzll(*s->src1) : WORD_SIZE_BITS;
+    DISPATCH(s + 1);
+do_clz_w:
+    *s->dst = (uint32_t)*s->src1 ? __builtin_clz((uint32_t)*s->src1) : HALFWORD_SIZE_BITS;
+    DISPATCH(s + 1);
+do_generic: {
+    // Shapes the engine does not handle, and empty slots, are run by the
+    // reference interpreter
+    m->pc = PC_OF(s);
+    machine_step(m);
+    if (m->memory->fault.kind != FAULT_none) {
+        goto fault;
+    }
+    GROW_STACK();
+    struct slot_t *target = slot_at(engine, m->pc);
+    if (target == NULL) {
+        HALT(m->pc);
+    }
+    DISPATCH(target);
+}
+do_exit:
+    m->pc = PC_OF(s);
+    goto done;
+
+// The branch is decided by a signed comparison in the compare's width
+#define FUSED_SHAPE(name, op, shape, is_wide, signed_t, op1, op2) \
+do_cmp_##shape##_##name: { \
+    FUSED_PROLOGUE(); \
+    COMPARE(is_wide, op1, op2); \
+    struct slot_t *branch = s + 1; \
+    if ((signed_t)(op1) op (signed_t)(op2)) { \
+        if (branch->target == NULL) { \
+            steps++; \
+            HALT(branch->imm); \
+        } \
+        ENTER_N(branch->target, 2); \
+    } \
+    DISPATCH_N(s + 2, 2); \
+}
+#define FUSED(name, op) \
+    FUSED_SHAPE(name, op, xx, 1, int64_t, *s->src1, *s->src2) \
+    FUSED_SHAPE(name, op, xi, 1, int64_t, *s->src1, s->imm) \
+    FUSED_SHAPE(name, op, ww, 0, int32_t, (uint32_t)*s->src1, (uint32_t)*s->src2) \
+    FUSED_SHAPE(name, op, wi, 0, int32_t, (uint32_t)*s->src1, s->imm)
+    CONDITIONS(FUSED)
+#undef FUSED
+#undef FUSED_SHAPE
+do_increment_x: {
+    FUSED_PROLOGUE();
+    uint64_t address = *s->src1 + s->imm;
+    uint64_t word;
+    LOAD(word, address, 8);
+    uint64_t value = word + s[1].imm;
+    *s->dst = value;
+    STORE(address, 8, value);
+    DISPATCH_N(s + 3, 3);
+}
+do_increment_w: {
+    FUSED_PROLOGUE();
+    uint64_t address = *s->src1 + s->imm;
+    uint64_t word;
+    LOAD(word, address, 4);
+    uint32_t value = word + s[1].imm;
+    *s->dst = value;
+    STORE(address, 4, value);
+    DISPATCH_N(s + 3, 3);
+}
+do_store_bytes:
+    FUSED_PROLOGUE();
+    for (struct slot_t *pair = s; pair < s + s->length; pair += 2) {
+        *pair->dst = pair->imm;
+        if (!memory_store(m->memory, *pair[1].src1 + pair[1].imm, 1, *pair[1].src2)) {
+            // Stop at the faulting strb, counting everything before it
+            steps += pair + 1 - s;
+            s = pair + 1;
+            goto fault;
+        }
+    }
+    DISPATCH_N(s + s->length, s->length);
+
+enter_block: {
+    // Run compiled blocks for as long as they chain into each other
+    if (steps >= max_steps) {
+        goto suspend;
+    }
+    struct block_t *block = s->block;
+    while (block != NULL) {
+        if (block->native == NULL && ++block->count == engine->jit_threshold) {
+            jit_compile(engine->jit, engine, block);
+        }
+        if (block->native == NULL || max_steps - steps < block->length) {
+            break;
+        }
+        struct native_budget_t budget = {0, max_steps - steps};
+        uint64_t next = block->native(m, &budget);
+        uint64_t executed = budget.executed;
+        steps += executed;
+        GROW_STACK();
+        s = slot_at(engine, next);
+        if (s == NULL) {
+            stop_at(m, next);
+            goto done;
+        }
+        // A side exit leaves the rest of the block to the interpreter
+        if (executed == 0 || steps >= max_steps) {
+            break;
+        }
+        block = s->block;
+    }
+    if (steps >= max_steps) {
+        goto suspend;
+    }
+    goto *s->handler;
+}
+
+fault:
+    // The instruction at s did not complete
+    m->pc = PC_OF(s);
+    m->memory->fault.pc = m->pc;
+    goto done;
+suspend:
+    m->pc = PC_OF(s);
+done:
+    return steps;
+
+#undef DISPATCH_N
+#undef DISPATCH
+#undef ENTER_N
+#undef ENTER
+#undef FUSED_PROLOGUE
+#undef HALT
+#undef BRANCH
+#undef GROW_STACK
+#undef COMPARE
+#undef LOAD
+#undef STORE
+}
+
+/*
+ * Resolve a register or constant operand to the location it is read from;
+ * return 0 if the engine cannot read it directly.
+ */
+static int resolve_source(struct machine_t *m, struct slot_t *slot, struct operand_t operand,
+                          uint64_t **src, uint8_t wide_bit) {
+    switch (operand.type) {
+    case OPERAND_constant:
+    case OPERAND_address:
+        if (slot->src1 == &slot->imm || slot->src2 == &slot->imm) {
+            return 0; // Only one immediate per slot
+        }
+        slot->imm = operand.constant;
+        *src = &slot->imm;
+        slot->wide |= wide_bit;
+        return 1;
+    case OPERAND_register:
+        switch (operand.reg_type) {
+        case REGISTER_x:
+            *src = &m->registers[operand.reg_num];
+            slot->wide |= wide_bit;
+            return 1;
+        case REGISTER_w:
+            *src = &m->registers[operand.reg_num];
+            return 1;
+        case REGISTER_sp:
+            *src = &m->sp;
+            slot->wide |= wide_bit;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Resolve a register operand that is written. Writes to sp are only resolved
+ * when the caller has a handler that keeps the stack grown; writes to pc are
+ * always left to the reference interpreter.
+ */
+static int resolve_destination(struct machine_t *m, struct slot_t *slot, struct operand_t operand, int allow_sp) {
+    if (operand.type != OPERAND_register) {
+        return 0;
+    }
+    switch (operand.reg_type) {
+    case REGISTER_x:
+        slot->wide |= ENGINE_WIDE_DST;
+        // Fall through
+    case REGISTER_w:
+        slot->dst = &m->registers[operand.reg_num];
+        return 1;
+    case REGISTER_sp:
+        if (allow_sp) {
+            slot->dst = &m->sp;
+            slot->wide |= ENGINE_WIDE_DST;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Resolve a memory operand with an x or sp base register to a base pointer
+ * (src1) and an offset (imm).
+ */
+static int resolve_memory(struct machine_t *m, struct slot_t *slot, struct operand_t operand) {
+    if (operand.type != OPERAND_memory) {
+        return 0;
+    }
+    switch (operand.reg_type) {
+    case REGISTER_x:
+        slot->src1 = &m->registers[operand.reg_num];
+        break;
+    case REGISTER_sp:
+        slot->src1 = &m->sp;
+        break;
+    default:
+        return 0;
+    }
+    slot->imm = operand.constant;
+    return 1;
+}
+
+/*
+ * Resolve the address operand of a branch to a slot.
+ */
+static int resolve_target(struct engine_t *engine, struct slot_t *slot, struct operand_t operand) {
+    if (operand.type != OPERAND_address) {
+        return 0;
+    }
+    uint64_t pc = machine_address(engine->machine, slot - engine->slots);
+    // Branching to itself leaves the pc unchanged, so the simulator moves on
+    if (operand.constant == pc) {
+        slot->target = slot + 1;
+    }
+    else {
+        slot->target = slot_at(engine, operand.constant);
+    }
+    slot->imm = operand.constant;
+    return 1;
+}
+
+/*
+ * Pick the variant of a general handler that matches the slot's operand
+ * shape (see enum handler_t), or keep the general handler.
+ */
+static enum handler_t specialize(struct slot_t *slot, enum handler_t general) {
+    int immediate = (slot->src2 == &slot->imm);
+    switch (slot->wide) {
+    case ENGINE_WIDE_DST | ENGINE_WIDE_SRC1 | ENGINE_WIDE_SRC2:
+        return general + (immediate ? SHAPE_xxi : SHAPE_xxx);
+    case ENGINE_WIDE_SRC2:
+        // Immediates are always marked wide
+        return immediate ? general + SHAPE_wwi : general;
+    case 0:
+        return general + SHAPE_www;
+    }
+    return general;
+}
+
+/*
+ * Choose a handler for an instruction and resolve its operands; return the
+ * generic handler for any shape the fast handlers do not cover.
+ */
+static enum handler_t predecode(struct engine_t *engine, struct slot_t *slot, struct instruction_t instruction) {
+    struct machine_t *m = engine->machine;
+    struct operand_t *operands = instruction.operands;
+    enum handler_t general;
+    switch (instruction.operation) {
+    case OPERATION_add:
+    case OPERATION_sub:
+    case OPERATION_mul:
+    case OPERATION_sdiv:
+    case OPERATION_udiv:
+    case OPERATION_lsl:
+    case OPERATION_lsr:
+    case OPERATION_and:
+    case OPERATION_orr:
+    case OPERATION_eor:
+        switch (instruction.operation) {
+        case OPERATION_add:
+            general = HANDLER_add;
+            break;
+        case OPERATION_sub:
+            general = HANDLER_sub;
+            break;
+        case OPERATION_mul:
+            general = HANDLER_mul;
+            break;
+        case OPERATION_sdiv:
+        case OPERATION_udiv:
+            general = HANDLER_div;
+            break;
+        case OPERATION_lsl:
+            general = HANDLER_lsl;
+            break;
+        case OPERATION_lsr:
+            general = HANDLER_lsr;
+            break;
+        case OPERATION_and:
+            general = HANDLER_and;
+            break;
+        case OPERATION_orr:
+            general = HANDLER_orr;
+            break;
+        default:
+            general = HANDLER_eor;
+        }
+        int sp_arithmetic = (general == HANDLER_add || general == HANDLER_sub);
+        if (!resolve_destination(m, slot, operands[0], sp_arithmetic)
+                || !resolve_source(m, slot, operands[1], &slot->src1, ENGINE_WIDE_SRC1)
+                || !resolve_source(m, slot, operands[2], &slot->src2, ENGINE_WIDE_SRC2)) {
+            return HANDLER_generic;
+        }
+        if (slot->dst == &m->sp) {
+            if (slot->src2 != &slot->imm || !(slot->wide & ENGINE_WIDE_SRC1)) {
+                return HANDLER_generic;
+            }
+            return general == HANDLER_add ? HANDLER_add_ssi : HANDLER_sub_ssi;
+        }
+        return specialize(slot, general);
+    case OPERATION_mov:
+        if (!resolve_destination(m, slot, operands[0], 1)
+                || !resolve_source(m, slot, operands[1], &slot->src1, ENGINE_WIDE_SRC1)) {
+            return HANDLER_generic;
+        }
+        if (slot->dst == &m->sp) {
+            return (slot->wide & ENGINE_WIDE_SRC1) ? HANDLER_mov_sx : HANDLER_generic;
+        }
+        // A 32-bit destination or source both leave only the lower 32 bits
+        if ((slot->wide & ENGINE_WIDE_DST) && (slot->wide & ENGINE_WIDE_SRC1)) {
+            return HANDLER_mov_xx;
+        }
+        return HANDLER_mov_w;
+    case OPERATION_ldr:
+    case OPERATION_ldrb:
+        if (!resolve_destination(m, slot, operands[0], 0) || !resolve_memory(m, slot, operands[1])) {
+            return HANDLER_generic;
+        }
+        if (instruction.operation == OPERATION_ldrb) {
+            return HANDLER_ldrb;
+        }
+        return (slot->wide & ENGINE_WIDE_DST) ? HANDLER_ldr_x : HANDLER_ldr_w;
+    case OPERATION_str:
+    case OPERATION_strb:
+        if (operands[0].type != OPERAND_register
+                || (operands[0].reg_type != REGISTER_w && operands[0].reg_type != REGISTER_x)
+                || !resolve_source(m, slot, operands[0], &slot->src2, ENGINE_WIDE_SRC2)
+                || !resolve_memory(m, slot, operands[1])) {
+            return HANDLER_generic;
+        }
+        if (instruction.operation == OPERATION_strb) {
+            return HANDLER_strb;
+        }
+        return (slot->wide & ENGINE_WIDE_SRC2) ? HANDLER_str_x : HANDLER_str_w;
+    case OPERATION_cmp:
+        if (!resolve_source(m, slot, operands[0], &slot->src1, ENGINE_WIDE_SRC1)
+                || !resolve_source(m, slot, operands[1], &slot->src2, ENGINE_WIDE_SRC2)) {
+            return HANDLER_generic;
+        }
+        switch (slot->wide) {
+        case ENGINE_WIDE_SRC1 | ENGINE_WIDE_SRC2:
+            return slot->src2 == &slot->imm ? HANDLER_cmp_xi : HANDLER_cmp_xx;
+        case ENGINE_WIDE_SRC2:
+            return slot->src2 == &slot->imm ? HANDLER_cmp_wi : HANDLER_cmp;
+        case 0:
+            return HANDLER_cmp_ww;
+        }
+        return HANDLER_cmp;
+    case OPERATION_b:
+    case OPERATION_bl:
+    case OPERATION_bne:
+    case OPERATION_beq:
+    case OPERATION_blt:
+    case OPERATION_bgt:
+    case OPERATION_ble:
+    case OPERATION_bge:
+        if (!resolve_target(engine, slot, operands[0])) {
+            return HANDLER_generic;
+        }
+        switch (instruction.operation) {
+        case OPERATION_b:
+            return HANDLER_b;
+        case OPERATION_bl:
+            return HANDLER_bl;
+        case OPERATION_bne:
+            return HANDLER_bne;
+        case OPERATION_beq:
+            return HANDLER_beq;
+        case OPERATION_blt:
+            return HANDLER_blt;
+        case OPERATION_bgt:
+            return HANDLER_bgt;
+        case OPERATION_ble:
+            return HANDLER_ble;
+        default:
+            return HANDLER_bge;
+        }
+    case OPERATION_ret:
+        return HANDLER_ret;
+    case OPERATION_nop:
+        return HANDLER_nop;
+    case OPERATION_clz:
+        if (operands[1].type != OPERAND_register
+                || (operands[1].reg_type != REGISTER_w && operands[1].reg_type != REGISTER_x)
+                || !resolve_destination(m, slot, operands[0], 0)
+                || !resolve_source(m, slot, operands[1], &slot->src1, ENGINE_WIDE_SRC1)) {
+            return HANDLER_generic;
+        }
+        return (slot->wide & ENGINE_WIDE_SRC1) ? HANDLER_clz_x : HANDLER_clz_w;
+    }
+    return HANDLER_generic;
+}
+
+/*
+ * Check whether a handler may leave the straight-line order of the code.
+ */
+static int ends_block(enum handler_t handler) {
+    switch (handler) {
+    case HANDLER_b:
+    case HANDLER_bl:
+    case HANDLER_bne:
+    case HANDLER_beq:
+    case HANDLER_blt:
+    case HANDLER_bgt:
+    case HANDLER_ble:
+    case HANDLER_bge:
+    case HANDLER_ret:
+    case HANDLER_generic:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Split the slots into basic blocks. A block starts at the first slot, at
+ * every branch target, and after every instruction that may branch.
+ */
+static void find_blocks(struct engine_t *engine, enum handler_t *handlers) {
+    uint8_t *leaders = calloc(engine->num_slots + 1, 1);
+    leaders[0] = 1;
+    for (uint64_t i = 0; i < engine->num_slots; i++) {
+        if (ends_block(handlers[i])) {
+            leaders[i + 1] = 1;
+        }
+        struct slot_t *target = engine->slots[i].target;
+        if (target != NULL) {
+            leaders[target - engine->slots] = 1;
+        }
+    }
+
+    engine->num_blocks = 0;
+    for (uint64_t i = 0; i < engine->num_slots; i++) {
+        engine->num_blocks += leaders[i];
+    }
+    engine->blocks = malloc(engine->num_blocks * sizeof(struct block_t));
+    uint64_t block = 0;
+    for (uint64_t i = 0; i < engine->num_slots; i++) {
+        if (leaders[i]) {
+            if (block > 0) {
+                engine->blocks[block - 1].length = i - engine->blocks[block - 1].first;
+            }
+            engine->blocks[block].first = i;
+            engine->blocks[block].count = 0;
+            engine->blocks[block].native = NULL;
+            engine->slots[i].block = &engine->blocks[block];
+            block++;
+        }
+    }
+    engine->blocks[block - 1].length = engine->num_slots - engine->blocks[block - 1].first;
+    free(leaders);
+}
+
+/*
+ * Check for a load, an add of an immediate, and a store of the result back
+ * to the same word, all through the same register (the -O0 idiom for i++).
+ */
+static int is_increment(struct slot_t *slots, enum handler_t *handlers, int wide) {
+    struct slot_t *load = &slots[0], *add = &slots[1], *store = &slots[2];
+    if (handlers[0] != (wide ? HANDLER_ldr_x : HANDLER_ldr_w)
+            || handlers[1] != (wide ? HANDLER_add_xxi : HANDLER_add_wwi)
+            || handlers[2] != (wide ? HANDLER_str_x : HANDLER_str_w)) {
+        return 0;
+    }
+    return add->dst == load->dst && add->src1 == load->dst && store->src2 == load->dst
+        && store->src1 == load->src1 && store->imm == load->imm && load->src1 != load->dst;
+}
+
+/*
+ * Check for a mov of an immediate into a register followed by a strb.
+ */
+static int is_store_byte(struct slot_t *slots, enum handler_t *handlers) {
+    return (handlers[0] == HANDLER_mov_w || handlers[0] == HANDLER_mov_xx)
+        && slots[0].src1 == &slots[0].imm && handlers[1] == HANDLER_strb;
+}
+
+/*
+ * Replace common instruction sequences inside each block with
+ * superinstructions. The fused slots stay in place, so branches into the
+ * middle of a sequence and single steps still run them one at a time.
+ */
+static void fuse_blocks(struct engine_t *engine, enum handler_t *handlers, const void **labels) {
+    engine->num_fused = 0;
+    for (uint64_t b = 0; b < engine->num_blocks; b++) {
+        uint64_t i = engine->blocks[b].first;
+        uint64_t end = i + engine->blocks[b].length;
+        while (i < end) {
+            struct slot_t *slot = &engine->slots[i];
+            enum handler_t fused = NUM_HANDLERS;
+            uint64_t length = 1;
+
+            if (handlers[i] >= HANDLER_cmp_xx && handlers[i] <= HANDLER_cmp_wi
+                    && i + 1 < end && handlers[i + 1] >= HANDLER_bne && handlers[i + 1] <= HANDLER_bge) {
+                fused = HANDLER_cmp_xx_bne
+                    + (handlers[i + 1] - HANDLER_bne) * (HANDLER_cmp_wi - HANDLER_cmp_xx + 1)
+                    + (handlers[i] - HANDLER_cmp_xx);
+                length = 2;
+            }
+            else if (i + 2 < end && (is_increment(slot, &handlers[i], 1) || is_increment(slot, &handlers[i], 0))) {
+                fused = handlers[i] == HANDLER_ldr_x ? HANDLER_increment_x : HANDLER_increment_w;
+                length = 3;
+            }
+            else if (i + 1 < end && is_store_byte(slot, &handlers[i])) {
+                fused = HANDLER_store_bytes;
+                length = 2;
+                while (i + length + 1 < end && length + 2 <= UINT8_MAX
+                        && is_store_byte(&slot[length], &handlers[i + length])) {
+                    length += 2;
+                }
+            }
+
+            if (fused != NUM_HANDLERS) {
+                slot->single = slot->handler;
+                slot->handler = labels[fused];
+                slot->length = length;
+                engine->num_fused++;
+            }
+            i += length;
+        }
+    }
+}
+
+/*
+ * Translate the machine's code into a stream of predecoded slots, split it
+ * into basic blocks, and fuse common sequences within each block.
+ */
+struct engine_t *engine_create(struct machine_t *m) {
+    const void **labels;
+    run(NULL, 0, &labels);
+
+    struct engine_t *engine = malloc(sizeof(struct engine_t));
+    engine->machine = m;
+    // The empty slot after the last section of a program is the exit
+    if (m->program != NULL) {
+        engine->num_slots = m->program->count - 1;
+    }
+    else {
+        engine->num_slots = (m->code_bot - m->code_top) / INSTRUCTION_SIZE + 1;
+    }
+    engine->slots = calloc(engine->num_slots + 1, sizeof(struct slot_t));
+
+    enum handler_t *handlers = malloc(engine->num_slots * sizeof(enum handler_t));
+    for (uint64_t i = 0; i < engine->num_slots; i++) {
+        struct slot_t *slot = &engine->slots[i];
+        // Lazily decoded code is all decoded here, to find blocks across it
+        handlers[i] = predecode(engine, slot, m->program != NULL ? program_fetch(m->program, i) : unpack_instruction(m->code[i]));
+        if (handlers[i] == HANDLER_generic) {
+            memset(slot, 0, sizeof(struct slot_t));
+        }
+        slot->handler = labels[handlers[i]];
+        slot->kind = handlers[i];
+    }
+    engine->slots[engine->num_slots].handler = labels[HANDLER_exit];
+
+    engine->jit_threshold = 0;
+    engine->jit = NULL;
+    find_blocks(engine, handlers);
+    fuse_blocks(engine, handlers, labels);
+    free(handlers);
+    return engine;
+}
+
+/*
+ * Run the machine's code until the pc leaves the code or max_steps
+ * instructions have executed; return the number of instructions executed.
+ */
+uint64_t engine_run(struct engine_t *engine, uint64_t max_steps) {
+    return run(engine, max_steps, NULL);
+}
+
+/*
+ * Compile blocks to native code once a branch has entered them threshold
+ * times.
+ */
+void engine_enable_jit(struct engine_t *engine, uint64_t threshold) {
+    if (engine->jit == NULL) {
+        engine->jit = jit_create();
+    }
+    engine->jit_threshold = engine->jit != NULL ? threshold : 0;
+}
+
+/*
+ * Free the predecoded code and any native code compiled from it.
+ */
+void engine_destroy(struct engine_t *engine) {
+    if (engine->jit != NULL) {
+        jit_destroy(engine->jit);
+    }
+    free(engine->blocks);
+    free(engine->slots);
+    free(engine);
+}
@@ -0,0 +1,171 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stdint.h>
+#include "machine.h"
+
+#define ENGINE_UNBOUNDED UINT64_MAX
+
+/*
+ * Operations that write a destination register from two sources, with the C
+ * operator each one applies to the 64-bit source values.
+ */
+#define BINARY_OPERATIONS(X) \
+    X(add, +) \
+    X(sub, -) \
+    X(mul, *) \
+    X(div, /) \
+    X(lsl, <<) \
+    X(lsr, >>) \
+    X(and, &) \
+    X(orr, |) \
+    X(eor, ^)
+
+/*
+ * Conditional branches, with the signed comparison each one takes after a
+ * cmp of two values (matching condition_holds()).
+ */
+#define CONDITIONS(X) \
+    X(bne, !=) \
+    X(beq, ==) \
+    X(blt, <) \
+    X(bgt, >) \
+    X(ble, <=) \
+    X(bge, >=)
+
+/*
+ * Handlers implemented by engine_run(); the values index the label table.
+ *
+ * Every binary operation has a general handler followed by variants
+ * specialized for an operand shape, chosen once by predecode():
+ *   xxx  x register from two 64-bit registers (x or sp)
+ *   xxi  x register from a 64-bit register and an immediate
+ *   www  w register from two w registers
+ *   wwi  w register from a w register and an immediate
+ * The general handler only remains for mixed w/x shapes.
+ */
+enum handler_t {
+#define SHAPES(name, op) \
+    HANDLER_##name, HANDLER_##name##_xxx, HANDLER_##name##_xxi, HANDLER_##name##_www, HANDLER_##name##_wwi,
+    BINARY_OPERATIONS(SHAPES)
+#undef SHAPES
+    HANDLER_add_ssi,
+    HANDLER_sub_ssi,
+    HANDLER_mov_xx,
+    HANDLER_mov_w,
+    HANDLER_mov_sx,
+    HANDLER_ldr_x,
+    HANDLER_ldr_w,
+    HANDLER_str_x,
+    HANDLER_str_w,
+    HANDLER_ldrb,
+    HANDLER_strb,
+    HANDLER_cmp,
+    HANDLER_cmp_xx,
+    HANDLER_cmp_xi,
+    HANDLER_cmp_ww,
+    HANDLER_cmp_wi,
+    HANDLER_b,
+    HANDLER_bl,
+    HANDLER_bne,
+    HANDLER_beq,
+    HANDLER_blt,
+    HANDLER_bgt,
+    HANDLER_ble,
+    HANDLER_bge,
+    HANDLER_ret,
+    HANDLER_nop,
+    HANDLER_clz_x,
+    HANDLER_clz_w,
+    HANDLER_generic,
+    HANDLER_exit,
+    // Superinstructions: cmp (in each cmp shape) fused with a conditional branch
+#define FUSED(name, op) \
+    HANDLER_cmp_xx_##name, HANDLER_cmp_xi_##name, HANDLER_cmp_ww_##name, HANDLER_cmp_wi_##name,
+    CONDITIONS(FUSED)
+#undef FUSED
+    // Superinstructions: ldr/add #imm/str of the same memory word
+    HANDLER_increment_x,
+    HANDLER_increment_w,
+    // Superinstructions: a run of mov #imm/strb pairs
+    HANDLER_store_bytes,
+    NUM_HANDLERS
+};
+
+// Offsets of the shape variants from an operation's general handler
+#define SHAPE_xxx 1
+#define SHAPE_xxi 2
+#define SHAPE_www 3
+#define SHAPE_wwi 4
+
+struct block_t;
+struct jit_t;
+
+/*
+ * One predecoded instruction. The handler is the address of a label inside
+ * engine_run(); operands are resolved to pointers into the machine (or to
+ * the slot's own immediate) when the engine is created.
+ *
+ * A slot that starts a fused sequence runs a superinstruction covering
+ * length instructions; single is the handler for just its own instruction,
+ * used when fewer steps than that remain.
+ */
+struct slot_t {
+    const void *handler;
+    const void *single;
+    uint64_t *dst;
+    uint64_t *src1;
+    uint64_t *src2;
+    struct slot_t *target;      // Branch target; NULL if outside the code
+    uint64_t imm;               // Immediate operand or out-of-range branch address
+    struct block_t *block;      // Block this slot starts; NULL inside a block
+    uint8_t kind;               // enum handler_t of the slot's own instruction
+    uint8_t wide;               // ENGINE_WIDE_* bits: which operands are 64-bit
+    uint8_t length;             // Instructions covered by a superinstruction
+};
+
+#define ENGINE_WIDE_DST     0b00000001
+#define ENGINE_WIDE_SRC1    0b00000010
+#define ENGINE_WIDE_SRC2    0b00000100
+
+/*
+ * Native code for a block gets the machine and a budget: it adds the
+ * instructions it executes to executed, may continue straight into other
+ * compiled blocks while executed stays within limit, and returns the
+ * simulated address to continue at.
+ */
+struct native_budget_t {
+    uint64_t executed;
+    uint64_t limit;
+};
+typedef uint64_t (*native_block_t)(struct machine_t *m, struct native_budget_t *budget);
+
+/*
+ * A basic block: a run of slots entered only at the first one and left only
+ * after the last one. Blocks entered by a branch more than the engine's JIT
+ * threshold times are compiled to native code.
+ */
+struct block_t {
+    uint64_t first;             // Index of the first slot
+    uint64_t length;            // Number of slots
+    uint64_t count;             // Times entered by a branch
+    native_block_t native;      // NULL until compiled
+};
+
+struct engine_t {
+    struct machine_t *machine;
+    struct slot_t *slots;       // One slot per instruction, plus a final exit slot
+    uint64_t num_slots;
+    struct block_t *blocks;
+    uint64_t num_blocks;
+    uint64_t num_fused;         // Superinstructions formed when the engine was created
+    uint64_t jit_threshold;     // Branch entries before a block is compiled; 0 disables the JIT
+    struct jit_t *jit;
+};
+
+struct engine_t *engine_create(struct machine_t *m);
+uint64_t engine_run(struct engine_t *engine, uint64_t max_steps);
+void engine_enable_jit(struct engine_t *engine, uint64_t threshold);
+void engine_destroy(struct engine_t *engine);
+
+#endif // __ENGINE_H__
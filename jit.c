@@ -0,0 +1,602 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "machine.h"
+#include "code.h"
+#include "engine.h"
+#include "jit.h"
+
+/*
+ * Compiles hot basic blocks to x86-64 code. Guest registers stay in the
+ * machine struct: compiled code gets the machine in rdi and its budget in
+ * rsi, loads operands into rax/rcx/rdx, and stores results straight back.
+ * Loads and stores look up the memory's TLB inline and call
+ * memory_translate() on a miss. Misaligned accesses and accesses that would
+ * fault leave the block (a side exit) so the interpreter can run that
+ * instruction instead. A block whose successor is also compiled jumps
+ * straight to it while the budget allows.
+ */
+
+#if defined(__x86_64__)
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+
+// Largest amount of code any one instruction, including its exits, needs
+#define MAX_INSTRUCTION_BYTES 192
+
+struct jit_t {
+    uint8_t *code;
+    size_t used;
+};
+
+struct emitter_t {
+    uint8_t *start;
+    uint8_t *p;
+    struct machine_t *m;
+};
+
+static void emit8(struct emitter_t *e, uint8_t byte) {
+    *e->p++ = byte;
+}
+
+static void emit32(struct emitter_t *e, uint32_t value) {
+    memcpy(e->p, &value, sizeof(value));
+    e->p += sizeof(value);
+}
+
+static void emit64(struct emitter_t *e, uint64_t value) {
+    memcpy(e->p, &value, sizeof(value));
+    e->p += sizeof(value);
+}
+
+/*
+ * Emit a fixed sequence of bytes.
+ */
+static void emit_bytes(struct emitter_t *e, const uint8_t *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        emit8(e, bytes[i]);
+    }
+}
+
+/*
+ * Emit an opcode whose ModRM operand is [rdi + the offset of a field of the
+ * machine]; reg is the register (or opcode extension) in the ModRM reg field.
+ */
+static void emit_machine_operand(struct emitter_t *e, uint8_t rex, uint8_t opcode, int reg, void *field) {
+    if (rex) {
+        emit8(e, rex);
+    }
+    emit8(e, opcode);
+    emit8(e, 0x87 | (reg << 3));
+    emit32(e, (uint32_t)((uint8_t *)field - (uint8_t *)e->m));
+}
+
+// mov reg, qword/dword [machine field]; 32-bit loads zero-extend
+static void emit_load(struct emitter_t *e, int reg, uint64_t *field, int wide) {
+    emit_machine_operand(e, wide ? 0x48 : 0, 0x8B, reg, field);
+}
+
+// mov qword [machine field], reg
+static void emit_store(struct emitter_t *e, int reg, void *field) {
+    emit_machine_operand(e, 0x48, 0x89, reg, field);
+}
+
+// mov reg32, imm32 (zero-extends to 64 bits)
+static void emit_immediate(struct emitter_t *e, int reg, uint32_t value) {
+    emit8(e, 0xB8 + reg);
+    emit32(e, value);
+}
+
+/*
+ * Load a source operand of a slot, which is either a register in the
+ * machine or the slot's immediate.
+ */
+static void emit_source(struct emitter_t *e, int reg, struct slot_t *slot, uint64_t *src, int wide) {
+    if (src == &slot->imm) {
+        emit_immediate(e, reg, slot->imm);
+    }
+    else {
+        emit_load(e, reg, src, wide);
+    }
+}
+
+/*
+ * Emit a short forward jump whose distance is filled in by end_skip().
+ */
+static uint8_t *begin_skip(struct emitter_t *e, uint8_t jcc) {
+    emit8(e, jcc);
+    emit8(e, 0);
+    return e->p - 1;
+}
+
+static void end_skip(struct emitter_t *e, uint8_t *rel) {
+    *rel = (uint8_t)(e->p - rel - 1);
+}
+
+/*
+ * Leave the block, adding the instructions executed to the budget, and
+ * continue at a simulated address. If next is the block at that address,
+ * jump straight to its native code once it has some and the budget covers it.
+ */
+static void emit_exit(struct emitter_t *e, uint64_t steps, uint64_t pc, struct block_t *next) {
+    emit8(e, 0x48); // add qword [rsi], imm32
+    emit8(e, 0x81);
+    emit8(e, 0x06);
+    emit32(e, (uint32_t)steps);
+    if (next != NULL) {
+        static const uint8_t load_native[] = {
+            0x48, 0x8B, 0x00,           // mov rax, [rax]
+            0x48, 0x85, 0xC0,           // test rax, rax
+        };
+        static const uint8_t check_budget[] = {
+            0x48, 0x8B, 0x0E,           // mov rcx, [rsi]
+            0x48, 0x81, 0xC1,           // add rcx, imm32 (next block length)
+        };
+        static const uint8_t chain[] = {
+            0x48, 0x3B, 0x4E, 0x08,     // cmp rcx, [rsi + 8]
+            0x77, 0x02,                 // ja over the jump
+            0xFF, 0xE0,                 // jmp rax
+        };
+        emit8(e, 0x48); // mov rax, imm64
+        emit8(e, 0xB8);
+        emit64(e, (uint64_t)&next->native);
+        emit_bytes(e, load_native, sizeof(load_native));
+        uint8_t *uncompiled = begin_skip(e, 0x74);  // jz
+        emit_bytes(e, check_budget, sizeof(check_budget));
+        emit32(e, (uint32_t)next->length);
+        emit_bytes(e, chain, sizeof(chain));
+        end_skip(e, uncompiled);
+    }
+    emit8(e, 0x48); // mov rax, imm64
+    emit8(e, 0xB8);
+    emit64(e, pc);
+    emit8(e, 0xC3); // ret
+}
+
+/*
+ * Find the block that starts at a simulated address, if any.
+ */
+static struct block_t *block_at(struct engine_t *engine, uint64_t pc) {
+    struct machine_t *m = engine->machine;
+    if (pc < m->code_top || pc > m->code_bot) {
+        return NULL;
+    }
+    uint64_t slot = machine_slot(m, pc);
+    if (slot == SLOT_NONE) {
+        return NULL;
+    }
+    return engine->slots[slot].block;
+}
+
+/*
+ * Emit a binary operation on rax and rcx, leaving the result in rax.
+ */
+static int emit_operation(struct emitter_t *e, int general) {
+    static const uint8_t alu[][4] = {
+        [HANDLER_add] = {0x48, 0x01, 0xC8},         // add rax, rcx
+        [HANDLER_sub] = {0x48, 0x29, 0xC8},         // sub rax, rcx
+        [HANDLER_mul] = {0x48, 0x0F, 0xAF, 0xC1},   // imul rax, rcx
+        [HANDLER_lsl] = {0x48, 0xD3, 0xE0},         // shl rax, cl
+        [HANDLER_lsr] = {0x48, 0xD3, 0xE8},         // shr rax, cl
+        [HANDLER_and] = {0x48, 0x21, 0xC8},         // and rax, rcx
+        [HANDLER_orr] = {0x48, 0x09, 0xC8},         // or rax, rcx
+        [HANDLER_eor] = {0x48, 0x31, 0xC8},         // xor rax, rcx
+    };
+    if (general == HANDLER_div || general > HANDLER_eor) {
+        return 0;
+    }
+    int length = (general == HANDLER_mul) ? 4 : 3;
+    for (int i = 0; i < length; i++) {
+        emit8(e, alu[general][i]);
+    }
+    return 1;
+}
+
+_Static_assert(sizeof(struct tlb_entry_t) == 16, "TLB entries are indexed with a shift by 4");
+
+/*
+ * Compute the address of a memory operand into rdx as a real address, or
+ * leave the block at this instruction if the access is misaligned or would
+ * fault.
+ */
+static void emit_address(struct emitter_t *e, struct slot_t *slot, uint64_t width, int write,
+                         uint64_t index, uint64_t pc) {
+    struct machine_t *m = e->m;
+    uint32_t tlb = offsetof(struct memory_t, tlb);
+    emit_load(e, RAX, slot->src1, 1);
+    emit_immediate(e, RCX, slot->imm);
+    emit8(e, 0x48); // add rax, rcx
+    emit8(e, 0x01);
+    emit8(e, 0xC8);
+
+    // Aligned accesses never span two pages
+    if (width > 1) {
+        emit8(e, 0xA8); // test al, imm8
+        emit8(e, width - 1);
+        uint8_t *aligned = begin_skip(e, 0x74);     // jz
+        emit_exit(e, index, pc, NULL);
+        end_skip(e, aligned);
+    }
+
+    // rcx = the TLB entry for the page, less the offset of the TLB
+    static const uint8_t find_entry[] = {
+        0x48, 0x89, 0xC2,                   // mov rdx, rax
+        0x48, 0xC1, 0xEA, PAGE_SIZE_BITS,   // shr rdx, PAGE_SIZE_BITS
+        0x89, 0xD1,                         // mov ecx, edx
+        0x83, 0xE1, TLB_ENTRIES - 1,        // and ecx, TLB_ENTRIES - 1
+        0xC1, 0xE1, 0x04,                   // shl ecx, 4
+    };
+    emit_bytes(e, find_entry, sizeof(find_entry));
+    emit_machine_operand(e, 0x48, 0x03, RCX, &m->memory);     // add rcx, [memory]
+    if (write) {
+        static const uint8_t writable_tag[] = {
+            0x48, 0x01, 0xD2,               // add rdx, rdx
+            0x48, 0x83, 0xCA, TLB_WRITABLE, // or rdx, TLB_WRITABLE
+            0x48, 0x3B, 0x91,               // cmp rdx, [rcx + tlb]
+        };
+        emit_bytes(e, writable_tag, sizeof(writable_tag));
+        emit32(e, tlb);
+    }
+    else {
+        emit8(e, 0x4C); // mov r8, [rcx + tlb]
+        emit8(e, 0x8B);
+        emit8(e, 0x81);
+        emit32(e, tlb);
+        static const uint8_t page_tag[] = {
+            0x49, 0xD1, 0xE8,               // shr r8, 1
+            0x49, 0x39, 0xD0,               // cmp r8, rdx
+        };
+        emit_bytes(e, page_tag, sizeof(page_tag));
+    }
+    uint8_t *miss = begin_skip(e, 0x75);    // jne
+    emit8(e, 0x48); // mov rdx, rax
+    emit8(e, 0x89);
+    emit8(e, 0xC2);
+    emit8(e, 0x48); // add rdx, [rcx + tlb + addend]
+    emit8(e, 0x03);
+    emit8(e, 0x91);
+    emit32(e, tlb + offsetof(struct tlb_entry_t, addend));
+    uint8_t *done = begin_skip(e, 0xEB);    // jmp
+    end_skip(e, miss);
+
+    // Otherwise call memory_translate(memory, address, width, write), keeping
+    // rdi and rsi and the stack 16-byte aligned
+    static const uint8_t call_setup[] = {
+        0x57,                       // push rdi
+        0x56,                       // push rsi
+        0x48, 0x83, 0xEC, 0x08,     // sub rsp, 8
+        0x48, 0x89, 0xC6,           // mov rsi, rax
+    };
+    static const uint8_t call_finish[] = {
+        0xFF, 0xD0,                 // call rax
+        0x48, 0x83, 0xC4, 0x08,     // add rsp, 8
+        0x5E,                       // pop rsi
+        0x5F,                       // pop rdi
+        0x48, 0x85, 0xC0,           // test rax, rax
+    };
+    emit_bytes(e, call_setup, sizeof(call_setup));
+    emit_machine_operand(e, 0x48, 0x8B, 7, &m->memory);       // mov rdi, [memory]
+    emit_immediate(e, RDX, width);
+    emit_immediate(e, RCX, write);
+    emit8(e, 0x48); // mov rax, imm64
+    emit8(e, 0xB8);
+    emit64(e, (uint64_t)&memory_translate);
+    emit_bytes(e, call_finish, sizeof(call_finish));
+    uint8_t *translated = begin_skip(e, 0x75);  // jnz
+    emit_exit(e, index, pc, NULL);
+    end_skip(e, translated);
+    emit8(e, 0x48); // mov rdx, rax
+    emit8(e, 0x89);
+    emit8(e, 0xC2);
+    end_skip(e, done);
+}
+
+/*
+ * After sp is set from rax, leave the block once this instruction is done if
+ * sp is outside the range shown as the stack, so the caller can extend it.
+ */
+static void emit_stack_check(struct emitter_t *e, uint64_t index, uint64_t pc) {
+    struct machine_t *m = e->m;
+    emit_machine_operand(e, 0x48, 0x3B, RAX, &m->stack_top);   // cmp rax, [stack_top]
+    uint8_t *below = begin_skip(e, 0x72);       // jb
+    emit_machine_operand(e, 0x48, 0x3B, RAX, &m->stack_bot);   // cmp rax, [stack_bot]
+    uint8_t *inside = begin_skip(e, 0x76);      // jbe
+    end_skip(e, below);
+    emit_exit(e, index + 1, pc + INSTRUCTION_SIZE, NULL);
+    end_skip(e, inside);
+}
+
+/*
+ * Emit code for one instruction that does not end the block; return 0 if the
+ * instruction's handler is not supported.
+ */
+static int emit_instruction(struct emitter_t *e, struct slot_t *slot, uint64_t index, uint64_t pc) {
+    struct machine_t *m = e->m;
+    int kind = slot->kind;
+    if (kind < HANDLER_add_ssi) {
+        // Binary operations: kind is general + shape
+        int general = kind - (kind - HANDLER_add) % (SHAPE_wwi + 1);
+        int shape = kind - general;
+        if (shape == 0) {
+            return 0;
+        }
+        int wide = (shape == SHAPE_xxx || shape == SHAPE_xxi);
+        emit_source(e, RAX, slot, slot->src1, wide);
+        emit_source(e, RCX, slot, slot->src2, wide);
+        if (!emit_operation(e, general)) {
+            return 0;
+        }
+        if (!wide) {
+            emit8(e, 0x89); // mov eax, eax
+            emit8(e, 0xC0);
+        }
+        emit_store(e, RAX, slot->dst);
+        return 1;
+    }
+
+    switch (kind) {
+    case HANDLER_add_ssi:
+    case HANDLER_sub_ssi:
+        emit_load(e, RAX, slot->src1, 1);
+        emit_immediate(e, RCX, slot->imm);
+        emit_operation(e, kind == HANDLER_add_ssi ? HANDLER_add : HANDLER_sub);
+        emit_store(e, RAX, &m->sp);
+        emit_stack_check(e, index, pc);
+        return 1;
+    case HANDLER_mov_xx:
+    case HANDLER_mov_w:
+    case HANDLER_mov_sx:
+        emit_source(e, RAX, slot, slot->src1, kind != HANDLER_mov_w);
+        emit_store(e, RAX, kind == HANDLER_mov_sx ? (void *)&m->sp : (void *)slot->dst);
+        if (kind == HANDLER_mov_sx) {
+            emit_stack_check(e, index, pc);
+        }
+        return 1;
+    case HANDLER_ldr_x:
+    case HANDLER_ldr_w:
+    case HANDLER_ldrb:
+        emit_address(e, slot, kind == HANDLER_ldr_x ? 8 : kind == HANDLER_ldr_w ? 4 : 1, 0, index, pc);
+        if (kind == HANDLER_ldr_x) {
+            emit8(e, 0x48); // mov rax, [rdx]
+            emit8(e, 0x8B);
+            emit8(e, 0x02);
+        }
+        else if (kind == HANDLER_ldr_w) {
+            emit8(e, 0x8B); // mov eax, [rdx]
+            emit8(e, 0x02);
+        }
+        else {
+            emit8(e, 0x0F); // movzx eax, byte [rdx]
+            emit8(e, 0xB6);
+            emit8(e, 0x02);
+        }
+        emit_store(e, RAX, slot->dst);
+        return 1;
+    case HANDLER_str_x:
+    case HANDLER_str_w:
+    case HANDLER_strb:
+        emit_address(e, slot, kind == HANDLER_str_x ? 8 : kind == HANDLER_str_w ? 4 : 1, 1, index, pc);
+        emit_load(e, RAX, slot->src2, 1);
+        if (kind == HANDLER_str_x) {
+            emit8(e, 0x48); // mov [rdx], rax
+            emit8(e, 0x89);
+        }
+        else if (kind == HANDLER_str_w) {
+            emit8(e, 0x89); // mov [rdx], eax
+        }
+        else {
+            emit8(e, 0x88); // mov [rdx], al
+        }
+        emit8(e, 0x02);
+        return 1;
+    case HANDLER_cmp_xx:
+    case HANDLER_cmp_xi:
+    case HANDLER_cmp_ww:
+    case HANDLER_cmp_wi: {
+        int wide = (kind == HANDLER_cmp_xx || kind == HANDLER_cmp_xi);
+        emit_source(e, RAX, slot, slot->src1, wide);
+        emit_source(e, RCX, slot, slot->src2, wide);
+        // Only record the compare; the branch ending the block evaluates it
+        emit_store(e, RAX, &m->flags.first);
+        emit_store(e, RCX, &m->flags.second);
+        emit_machine_operand(e, 0, 0xC6, 0, &m->flags.operation);   // mov byte [operation], imm8
+        emit8(e, FLAGS_sub);
+        emit_machine_operand(e, 0, 0xC6, 0, &m->flags.wide);        // mov byte [wide], imm8
+        emit8(e, wide);
+        return 1;
+    }
+    case HANDLER_nop:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Emit the exit from a block that ends with the given slot; return 0 if the
+ * slot's handler is not supported. A conditional branch is only supported
+ * after a compare earlier in the block, whose width is given by wide_compare
+ * (-1 if there is none).
+ */
+static int emit_block_end(struct emitter_t *e, struct engine_t *engine, struct slot_t *slot,
+                          uint64_t steps, uint64_t pc, int wide_compare) {
+    struct machine_t *m = e->m;
+    // Branching to itself leaves the pc unchanged, so the simulator moves on
+    uint64_t target = (slot->imm == pc) ? pc + INSTRUCTION_SIZE : slot->imm;
+    uint64_t next = pc + INSTRUCTION_SIZE;
+    switch (slot->kind) {
+    case HANDLER_b:
+        emit_exit(e, steps, target, block_at(engine, target));
+        return 1;
+    case HANDLER_bl:
+        emit8(e, 0x48); // mov rax, imm64
+        emit8(e, 0xB8);
+        emit64(e, pc + INSTRUCTION_SIZE);
+        emit_store(e, RAX, &m->registers[30]);
+        emit_exit(e, steps, target, block_at(engine, target));
+        return 1;
+    case HANDLER_bne:
+    case HANDLER_beq:
+    case HANDLER_blt:
+    case HANDLER_bgt:
+    case HANDLER_ble:
+    case HANDLER_bge: {
+        if (wide_compare < 0) {
+            return 0;
+        }
+        emit_load(e, RAX, &m->flags.first, 1);
+        emit_load(e, RCX, &m->flags.second, 1);
+        if (wide_compare) {
+            emit8(e, 0x48);
+        }
+        emit8(e, 0x39); // cmp rax/eax, rcx/ecx
+        emit8(e, 0xC8);
+        uint8_t skip;   // jcc on the signed condition that skips the taken exit
+        switch (slot->kind) {
+        case HANDLER_bne:
+            skip = 0x74;    // je
+            break;
+        case HANDLER_beq:
+            skip = 0x75;    // jne
+            break;
+        case HANDLER_blt:
+            skip = 0x7D;    // jge
+            break;
+        case HANDLER_bgt:
+            skip = 0x7E;    // jle
+            break;
+        case HANDLER_ble:
+            skip = 0x7F;    // jg
+            break;
+        default:
+            skip = 0x7C;    // jl
+        }
+        uint8_t *not_taken = begin_skip(e, skip);
+        emit_exit(e, steps, target, block_at(engine, target));
+        end_skip(e, not_taken);
+        emit_exit(e, steps, next, block_at(engine, next));
+        return 1;
+    }
+    case HANDLER_ret:
+        emit_load(e, RAX, &m->registers[30], 1);
+        emit8(e, 0x48); // mov rcx, imm64
+        emit8(e, 0xB9);
+        emit64(e, pc);
+        emit8(e, 0x48); // cmp rax, rcx
+        emit8(e, 0x39);
+        emit8(e, 0xC8);
+        emit8(e, 0x75); // jne over the adjustment
+        emit8(e, 10);
+        emit8(e, 0x48); // mov rax, imm64
+        emit8(e, 0xB8);
+        emit64(e, next);
+        emit8(e, 0x48); // add qword [rsi], imm32
+        emit8(e, 0x81);
+        emit8(e, 0x06);
+        emit32(e, (uint32_t)steps);
+        emit8(e, 0xC3); // ret
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Reserve memory for compiled code.
+ */
+struct jit_t *jit_create(void) {
+    void *code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        return NULL;
+    }
+    struct jit_t *jit = malloc(sizeof(struct jit_t));
+    jit->code = code;
+    jit->used = 0;
+    return jit;
+}
+
+/*
+ * Compile a block to native code; return 0 (leaving the block to the
+ * interpreter) if it contains an unsupported instruction or no space is left.
+ */
+int jit_compile(struct jit_t *jit, struct engine_t *engine, struct block_t *block) {
+    size_t limit = block->length * MAX_INSTRUCTION_BYTES;
+    if (jit->used + limit > JIT_CODE_SIZE) {
+        return 0;
+    }
+
+    struct emitter_t e;
+    e.start = malloc(limit);
+    e.p = e.start;
+    e.m = engine->machine;
+
+    uint64_t last = block->first + block->length - 1;
+    int wide_compare = -1;
+    for (uint64_t i = block->first; i <= last; i++) {
+        struct slot_t *slot = &engine->slots[i];
+        uint64_t pc = machine_address(e.m, i);
+        uint64_t index = i - block->first;
+        int ok;
+        if (i == last && slot->kind >= HANDLER_b && slot->kind <= HANDLER_ret) {
+            ok = emit_block_end(&e, engine, slot, index + 1, pc, wide_compare);
+        }
+        else {
+            ok = emit_instruction(&e, slot, index, pc);
+            if (slot->kind >= HANDLER_cmp_xx && slot->kind <= HANDLER_cmp_wi) {
+                wide_compare = (slot->kind == HANDLER_cmp_xx || slot->kind == HANDLER_cmp_xi);
+            }
+            if (ok && i == last) {
+                uint64_t next = pc + INSTRUCTION_SIZE;
+                emit_exit(&e, index + 1, next, block_at(engine, next));
+            }
+        }
+        if (!ok) {
+            free(e.start);
+            return 0;
+        }
+    }
+
+    // Copy the code in with the pages briefly writable
+    size_t size = e.p - e.start;
+    if (mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        free(e.start);
+        return 0;
+    }
+    uint8_t *native = jit->code + jit->used;
+    memcpy(native, e.start, size);
+    jit->used += size;
+    mprotect(jit->code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+    free(e.start);
+
+    block->native = (native_block_t)native;
+    return 1;
+}
+
+/*
+ * Release the compiled code.
+ */
+void jit_destroy(struct jit_t *jit) {
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+#else
+
+/*
+ * Without an x86-64 host there is no JIT; engine_enable_jit() leaves the
+ * interpreter in charge.
+ */
+struct jit_t *jit_create(void) {
+    return NULL;
+}
+
+int jit_compile(struct jit_t *jit, struct engine_t *engine, struct block_t *block) {
+    return 0;
+}
+
+void jit_destroy(struct jit_t *jit) {
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdint.h>
+#include "engine.h"
+
+#define JIT_THRESHOLD 50
+#define JIT_CODE_SIZE (1 << 20)
+
+struct jit_t *jit_create(void);
+int jit_compile(struct jit_t *jit, struct engine_t *engine, struct block_t *block);
+void jit_destroy(struct jit_t *jit);
+
+#endif // __JIT_H__
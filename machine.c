@@ -8,30 +8,22 @@
 struct machine_t machine;
 
 /*
- * Allocate more space to keep track of values on the simulated stack.
+ * Extend the range of addresses shown as the stack to cover a new sp. The
+ * memory itself is paged (or a reserved arena that is only committed here),
+ * so nothing is copied.
  */
-void grow_stack(uint64_t new_sp) {
+void machine_grow_stack(struct machine_t *m, uint64_t new_sp) {
     // Grow the stack upwards
-    if (new_sp < machine.stack_top) {
+    if (new_sp < m->stack_top) {
         // Round down to a multiple of word size
         if (new_sp % WORD_SIZE_BYTES != 0) {
             new_sp -= new_sp % WORD_SIZE_BYTES;
         }
-
-        // Allocate space and copy over old values 
-        void *new_stack = malloc(machine.stack_bot - new_sp + 1);
-        memset(new_stack, 0, machine.stack_top - new_sp);
-        if (machine.stack != NULL) {
-            memcpy(new_stack + (machine.stack_top - new_sp), machine.stack, machine.stack_bot - machine.stack_top + 1);
-            free(machine.stack);
-        }
-
-        // Update machine
-        machine.stack = new_stack;
-        machine.stack_top = new_sp;
+        m->stack_top = new_sp;
+        memory_commit_stack(m->memory, new_sp);
     }
     // Grow the stack downwards
-    else if (new_sp > machine.stack_bot) {
+    else if (new_sp > m->stack_bot) {
         // Round up to a multiple of word size
         if (new_sp % WORD_SIZE_BYTES != 0) {
             new_sp += WORD_SIZE_BYTES - (new_sp % WORD_SIZE_BYTES);
@@ -39,111 +31,333 @@ void grow_stack(uint64_t new_sp) {
         else {
             new_sp += WORD_SIZE_BYTES;
         }
+        m->stack_bot = new_sp - 1;
+    }
+}
 
-        // Allocate space and copy over old values 
-        void *new_stack = malloc(new_sp - machine.stack_top);
-        memset(new_stack + (machine.stack_bot - machine.stack_top), 0, new_sp - machine.stack_bot);
-        if (machine.stack != NULL) {
-            memcpy(new_stack, machine.stack, machine.stack_bot - machine.stack_top);
-            free(machine.stack);
-        }
+/*
+ * Extend the range of addresses shown as the stack of the global machine.
+ */
+void grow_stack(uint64_t new_sp) {
+    machine_grow_stack(&machine, new_sp);
+}
+
+/*
+ * Create a machine with no code loaded. Machines share nothing, so each one
+ * may run on its own thread.
+ */
+struct machine_t *machine_create(void) {
+    return calloc(1, sizeof(struct machine_t));
+}
 
-        // Update machine
-        machine.stack = new_stack;
-        machine.stack_bot = new_sp - 1;
+/*
+ * Load code into a machine and reset it to start at pc with the given sp;
+ * return 0 if the code could not be loaded. Code that was loaded before is
+ * shared rather than parsed again, and a machine can be loaded again to
+ * start over.
+ */
+int machine_load(struct machine_t *m, char *code_filepath, uint64_t pc, uint64_t sp) {
+    struct program_t *program = program_load(code_filepath, PROGRAM_eager);
+    if (program == NULL) {
+        return 0;
     }
+    machine_load_program(m, program, pc, sp);
+    program_release(program);
+    return 1;
 }
 
 /*
- * Initialize the machine
+ * Load a program that is already loaded into a machine, taking a reference
+ * to it, and reset the machine to start at pc with the given sp.
  */
-void init_machine(uint64_t sp, uint64_t pc, char *code_filepath) {
+void machine_load_program(struct machine_t *m, struct program_t *program, uint64_t pc, uint64_t sp) {
+    // Load code
+    program_retain(program);
+    if (m->program != NULL) {
+        program_release(m->program);
+    }
+    if (m->memory != NULL) {
+        memory_destroy(m->memory);
+    }
+    m->program = program;
+    m->code = program->code;
+    m->code_top = program->code_top;
+    m->code_bot = program->code_bot;
+    m->sections = program->sections;
+    m->num_sections = program->num_sections;
+    m->section = program->sections[0];
+
     // Populate general purpose registers
     for (int i = 0; i <= 30; i++) {
-        machine.registers[i] = REGISTER_NULL;
+        m->registers[i] = REGISTER_NULL;
     }
     
     // Populate special purpose registers
-    machine.sp = sp;
-    machine.pc = pc;
-    
-    // Load code
-    machine.code = parse_file(code_filepath, &(machine.code_top), &(machine.code_bot));
+    m->sp = sp;
+    m->pc = pc;
 
-    // Prepare stack
-    machine.stack_top = sp;
-    machine.stack_bot = sp + WORD_SIZE_BYTES - 1;
-    machine.stack = malloc(WORD_SIZE_BYTES);
-    memset(machine.stack, 0, WORD_SIZE_BYTES);
+    // Prepare memory, showing one word of stack
+    m->memory = memory_create();
+    m->stack_top = sp;
+    m->stack_bot = sp + WORD_SIZE_BYTES - 1;
 
     // Clear all condition codes
-    machine.conditions = 0;
+    m->flags.operation = FLAGS_none;
+    machine_clear_dirty(m);
 }
 
-void print_memory() {
-    // Print condition codes
-    printf("Condition codes:");
-    if (machine.conditions & CONDITION_ZERO) {
-        printf(" Z");
+/*
+ * Execute the instruction at a machine's pc, then move on to the next one
+ * unless it branched. Return 0 if the machine has stopped instead: its pc is
+ * outside the code, there is no instruction at it, or the instruction faulted
+ * (and stays the pc).
+ */
+int machine_step(struct machine_t *m) {
+    if (m->pc < m->code_top || m->pc > m->code_bot || m->memory->fault.kind != FAULT_none) {
+        return 0;
+    }
+    struct instruction_t instruction = machine_fetch(m);
+    if (instruction.operation == OPERATION_NULL) {
+        memory_raise_fault(m->memory, FAULT_code, m->pc);
+        m->memory->fault.pc = m->pc;
+        return 0;
     }
-    if (machine.conditions & CONDITION_NEGATIVE) {
-        printf(" N");
+    uint64_t pc_before = m->pc;
+    machine_execute(m, instruction);
+    if (m->memory->fault.kind != FAULT_none) {
+        return 0;
+    }
+    if (m->pc == pc_before) {
+        m->pc += 4;
+    }
+    return 1;
+}
+
+/*
+ * Step a machine until it stops or has executed max_steps instructions;
+ * return how many it executed. Use an engine to run faster.
+ */
+uint64_t machine_run(struct machine_t *m, uint64_t max_steps) {
+    uint64_t steps = 0;
+    while (steps < max_steps && machine_step(m)) {
+        steps++;
+    }
+    return steps;
+}
+
+/*
+ * Release a machine created by machine_create() and everything it loaded.
+ */
+void machine_destroy(struct machine_t *m) {
+    if (m->memory != NULL) {
+        memory_destroy(m->memory);
+    }
+    if (m->program != NULL) {
+        program_release(m->program);
+    }
+    free(m);
+}
+
+/*
+ * Initialize the global machine, exiting if its code cannot be loaded
+ */
+void init_machine(uint64_t sp, uint64_t pc, char *code_filepath) {
+    if (!machine_load(&machine, code_filepath, pc, sp)) {
+        exit(1);
+    }
+}
+
+/*
+ * Print condition codes as the outcome of a signed compare: zero, negative
+ * (less than) or positive (greater than)
+ */
+static void print_condition_codes(struct machine_t *m, FILE *out) {
+    fprintf(out, "Condition codes:");
+    if (m->flags.operation != FLAGS_none) {
+        uint8_t nzcv = get_nzcv(&m->flags);
+        if (nzcv & FLAG_Z) {
+            fprintf(out, " Z");
+        }
+        else if (((nzcv & FLAG_N) != 0) != ((nzcv & FLAG_V) != 0)) {
+            fprintf(out, " N");
+        }
+        else {
+            fprintf(out, " P");
+        }
     }
-    if (machine.conditions & CONDITION_POSITIVE) {
-        printf(" P");
+    fprintf(out, "\n");
+}
+
+/*
+ * Print one word shown as the stack.
+ */
+static void print_stack_word(struct machine_t *m, FILE *out, uint64_t address) {
+    static const char hex[] = "0123456789ABCDEF";
+    uint64_t value = memory_peek(m->memory, address);
+    char bytes[8 * 3 + 1];
+    for (int j = 0; j < 8; j++) {
+        uint8_t byte = value >> (8 * j);
+        bytes[3 * j] = hex[byte >> 4];
+        bytes[3 * j + 1] = hex[byte & 0xF];
+        bytes[3 * j + 2] = ' ';
     }
-    printf("\n");
+    bytes[8 * 3] = '\0';
+    fprintf(out, "\t0x%08lX | %s|\n", address, bytes);
+}
+
+/*
+ * Print the condition codes, registers and stack of a machine to a stream.
+ */
+void machine_print_memory(struct machine_t *m, FILE *out) {
+    print_condition_codes(m, out);
 
     // Print the value of all used registers
-    printf("Registers:\n");
+    fprintf(out, "Registers:\n");
     for (int i = 0; i <= 30; i++) {
-        if (machine.registers[i] != REGISTER_NULL) {
-            printf("\tw/x%d = 0x%lx\n", i, machine.registers[i]);
+        if (m->registers[i] != REGISTER_NULL) {
+            fprintf(out, "\tw/x%d = 0x%lx\n", i, m->registers[i]);
         }
     }
-    printf("\tsp = 0x%lX\n", machine.sp);
-    printf("\tpc = 0x%lX\n", machine.pc);
+    fprintf(out, "\tsp = 0x%lX\n", m->sp);
+    fprintf(out, "\tpc = 0x%lX\n", m->pc);
 
     // If necessary, grow the stack before printing it
-    if (machine.sp < machine.stack_top || machine.sp > machine.stack_bot) {
-        grow_stack(machine.sp);
+    if (m->sp < m->stack_top || m->sp > m->stack_bot) {
+        machine_grow_stack(m, m->sp);
     }
 
     // Print the value of all words on the stack
-    printf("Stack:\n");
-    unsigned char *stack = machine.stack;
-    for (int i = 0; i < (machine.stack_bot - machine.stack_top); i += 8) {
-        printf("\t");
+    fprintf(out, "Stack:\n");
+    for (int i = 0; i < (m->stack_bot - m->stack_top); i += 8) {
+        fprintf(out, "\t");
 
-        if (machine.sp == i + machine.stack_top) {
-            printf("%10s ", "sp->");
+        if (m->sp == i + m->stack_top) {
+            fprintf(out, "%10s ", "sp->");
         }
         else {
-            printf("           ");
+            fprintf(out, "           ");
         }
 
-        printf("+-------------------------+\n");
-        printf("\t0x%08lX | ", i + machine.stack_top);
-        for (int j = 0; j < 8; j++) {
-            printf("%02X ", stack[i+j]);
+        fprintf(out, "+-------------------------+\n");
+        print_stack_word(m, out, i + m->stack_top);
+    }
+    fprintf(out, "\t           +-------------------------+\n");
+}
+
+/*
+ * Print the state of the global machine.
+ */
+void print_memory() {
+    machine_print_memory(&machine, stdout);
+}
+
+/*
+ * Print only what changed in a machine since the last clear_dirty(), then
+ * clear it: the condition codes if a flag-setting instruction ran, the
+ * registers that changed, the pc, and the stack words stored to or newly
+ * covered by the stack (unless they are zero). Nothing here walks the whole
+ * stack.
+ */
+void machine_print_changes(struct machine_t *m, FILE *out) {
+    if (m->sp < m->stack_top || m->sp > m->stack_bot) {
+        machine_grow_stack(m, m->sp);
+    }
+
+    if (m->dirty.registers & DIRTY_flags) {
+        print_condition_codes(m, out);
+    }
+    for (int i = 0; i <= 30; i++) {
+        if (m->dirty.registers & ((uint64_t)1 << i)) {
+            fprintf(out, "\tw/x%d = 0x%lx\n", i, m->registers[i]);
         }
-        printf("|\n");
     }
-    printf("\t           +-------------------------+\n");
+    if (m->dirty.registers & DIRTY_sp) {
+        fprintf(out, "\tsp = 0x%lX\n", m->sp);
+    }
+    fprintf(out, "\tpc = 0x%lX\n", m->pc);
+
+    // Words that were shown before must have been stored to
+    uint64_t first[CHANGED_RANGES], last[CHANGED_RANGES];
+    int count = machine_changed_words(m, first, last);
+    for (int i = 0; i < count; i++) {
+        for (uint64_t j = first[i]; j <= last[i]; j++) {
+            uint64_t address = m->stack_top + j * WORD_SIZE_BYTES;
+            if ((address >= m->dirty.stack_top && address <= m->dirty.stack_bot)
+                    || memory_peek(m->memory, address) != 0) {
+                print_stack_word(m, out, address);
+            }
+        }
+    }
+    machine_clear_dirty(m);
 }
 
 /*
- * Get the next instruction to execute
+ * Print what changed in the global machine.
  */
-struct instruction_t fetch() {
-    int index = (machine.pc - machine.code_top) / 4;
-    return machine.code[index];
+void print_changes() {
+    machine_print_changes(&machine, stdout);
+}
+
+/*
+ * Return the slot of a machine's code that holds the instruction at an
+ * address, or SLOT_NONE if no section covers it. Most lookups land in the
+ * same section as the last one, which takes a single comparison.
+ */
+uint64_t machine_slot(struct machine_t *m, uint64_t address) {
+    uint64_t offset = address - m->section.start;
+    if (offset < m->section.bytes) {
+        return m->section.slot + offset / INSTRUCTION_SIZE;
+    }
+
+    // Code loaded without a program is one run of slots
+    if (m->sections == NULL) {
+        if (address < m->code_top || address > m->code_bot) {
+            return SLOT_NONE;
+        }
+        return (address - m->code_top) / INSTRUCTION_SIZE;
+    }
+    struct section_t *section = find_section(m->sections, m->num_sections, address);
+    if (section == NULL) {
+        return SLOT_NONE;
+    }
+    m->section = *section;
+    return section->slot + (address - section->start) / INSTRUCTION_SIZE;
+}
+
+/*
+ * Return the address of the instruction in a slot of a machine's code.
+ */
+uint64_t machine_address(struct machine_t *m, uint64_t slot) {
+    if (m->sections == NULL) {
+        return m->code_top + slot * INSTRUCTION_SIZE;
+    }
+    if (slot - m->section.slot < SECTION_SLOTS(m->section)) {
+        return m->section.start + (slot - m->section.slot) * INSTRUCTION_SIZE;
+    }
+    struct section_t *section = find_slot_section(m->sections, m->num_sections, slot);
+    return section->start + (slot - section->slot) * INSTRUCTION_SIZE;
+}
+
+/*
+ * Get the next instruction to execute; its operation is OPERATION_NULL if
+ * there is no instruction at the pc.
+ */
+struct instruction_t machine_fetch(struct machine_t *m) {
+    uint64_t slot = machine_slot(m, m->pc);
+    if (slot == SLOT_NONE) {
+        struct packed_t none = {OPERATION_NULL};
+        return unpack_instruction(none);
+    }
+    if (m->program != NULL) {
+        return program_fetch(m->program, slot);
+    }
+    return unpack_instruction(m->code[slot]);
 }
 
 /*
  * Get the value associated with a constant or register operand.
  */
-uint64_t get_value(struct operand_t operand) {
+uint64_t machine_get_value(struct machine_t *m, struct operand_t operand) {
     assert(operand.type == OPERAND_constant || operand.type == OPERAND_address || operand.type == OPERAND_register);
     // TODO
     switch (operand.type){
@@ -154,35 +368,135 @@ uint64_t get_value(struct operand_t operand) {
         case OPERAND_register:
             switch (operand.reg_type){
                 case REGISTER_x:
-                    return machine.registers[operand.reg_num];
+                    return m->registers[operand.reg_num];
                 case REGISTER_w:
-                    return (uint32_t)machine.registers[operand.reg_num]; 
+                    return (uint32_t)m->registers[operand.reg_num]; 
                 case REGISTER_sp:
-                    return machine.sp;
+                    return m->sp;
                 case REGISTER_pc:
-                    return machine.pc;
+                    return m->pc;
             }
     }
     return 0;
 }
 
+/*
+ * Note that a register is about to change, if the new value differs.
+ */
+static void mark_register(struct machine_t *m, uint8_t reg_num, uint64_t value) {
+    if (m->registers[reg_num] != value) {
+        m->dirty.registers |= (uint64_t)1 << reg_num;
+    }
+}
+
+/*
+ * Note a store of size bytes at a simulated address in a machine.
+ */
+void machine_mark_store(struct machine_t *m, uint64_t address, uint8_t size) {
+    if (m->dirty.count < DIRTY_STORES) {
+        m->dirty.stores[m->dirty.count] = address;
+        m->dirty.sizes[m->dirty.count] = size;
+    }
+    if (m->dirty.count <= DIRTY_STORES) {
+        m->dirty.count++;
+    }
+}
+
+/*
+ * Forget what has changed so far.
+ */
+void machine_clear_dirty(struct machine_t *m) {
+    m->dirty.registers = 0;
+    m->dirty.count = 0;
+    m->dirty.stack_top = m->stack_top;
+    m->dirty.stack_bot = m->stack_bot;
+}
+
+/*
+ * Forget what has changed in the global machine.
+ */
+void clear_dirty() {
+    machine_clear_dirty(&machine);
+}
+
+/*
+ * List the words shown as the stack that may have changed since the last
+ * clear_dirty(), as ranges of indices from stack_top: the words stored to,
+ * and the words the stack grew to cover. Return how many ranges there are,
+ * at most CHANGED_RANGES; if the changes cannot be listed, the one range
+ * returned covers every word.
+ */
+int machine_changed_words(struct machine_t *m, uint64_t *first, uint64_t *last) {
+    struct dirty_t *dirty = &m->dirty;
+    uint64_t words = STACK_WORDS(m->stack_top, m->stack_bot);
+    uint64_t shift = dirty->stack_top - m->stack_top;
+    uint64_t old_first = shift / WORD_SIZE_BYTES;
+    uint64_t old_end = old_first + STACK_WORDS(dirty->stack_top, dirty->stack_bot);
+    if (words == 0) {
+        return 0;
+    }
+    // The stack only grows, so the old words stay in place unless growing
+    // upwards moved the word boundaries
+    if (dirty->count > DIRTY_STORES || dirty->stack_top < m->stack_top
+            || shift % WORD_SIZE_BYTES != 0 || old_end > words) {
+        first[0] = 0;
+        last[0] = words - 1;
+        return 1;
+    }
+
+    int count = 0;
+    if (old_first > 0) {
+        first[count] = 0;
+        last[count++] = old_first - 1;
+    }
+    for (int i = 0; i < dirty->count; i++) {
+        // Words the stack grew to cover are already listed
+        uint64_t address = dirty->stores[i];
+        uint64_t end = address + dirty->sizes[i] - 1;
+        uint64_t low = m->stack_top + old_first * WORD_SIZE_BYTES;
+        uint64_t high = m->stack_top + old_end * WORD_SIZE_BYTES;
+        if (end >= low && address < high) {
+            first[count] = address < low ? old_first : (address - m->stack_top) / WORD_SIZE_BYTES;
+            last[count] = end >= high ? old_end - 1 : (end - m->stack_top) / WORD_SIZE_BYTES;
+            count++;
+        }
+    }
+    if (old_end < words) {
+        first[count] = old_end;
+        last[count++] = words - 1;
+    }
+    return count;
+}
+
+/*
+ * List the words of the global machine's stack that may have changed.
+ */
+int changed_words(uint64_t *first, uint64_t *last) {
+    return machine_changed_words(&machine, first, last);
+}
+
 /*
  * Put a value in a register specified by an operand.
  */
-void put_value(struct operand_t operand, uint64_t value) {
+void machine_put_value(struct machine_t *m, struct operand_t operand, uint64_t value) {
     assert(operand.type == OPERAND_register);
     switch (operand.reg_type) {
         case REGISTER_x:
-            machine.registers[operand.reg_num] = value;  
+            mark_register(m, operand.reg_num, value);
+            m->registers[operand.reg_num] = value;  
             break;
         case REGISTER_w:
-            machine.registers[operand.reg_num] = (uint32_t)value; 
+            mark_register(m, operand.reg_num, (uint32_t)value);
+            m->registers[operand.reg_num] = (uint32_t)value; 
             break;
         case REGISTER_sp:
-            machine.sp = value; 
+            if (m->sp != value) {
+                m->dirty.registers |= DIRTY_sp;
+            }
+            m->sp = value; 
             break;
         case REGISTER_pc:
-            machine.pc = value;  
+            m->pc = value;  
             break;
     }
 }
@@ -190,36 +504,64 @@ void put_value(struct operand_t operand, uint64_t value) {
 /*
  * Get the memory address associated with a memory operand.
  */
-uint64_t get_memory_address(struct operand_t operand) {
+uint64_t machine_get_memory_address(struct machine_t *m, struct operand_t operand) {
     assert(operand.type == OPERAND_memory);
     uint64_t base = 0;
 
     switch (operand.reg_type) {
         case REGISTER_x:
-            base = machine.registers[operand.reg_num];
+            base = m->registers[operand.reg_num];
             break;
         case REGISTER_sp:
-            base = machine.sp;
+            base = m->sp;
             break;
         case REGISTER_pc:
-            base = machine.pc;
+            base = m->pc;
             break;
     }
     return base + operand.constant;
 }
 
+/*
+ * Record a flag-setting operation; the flags themselves are derived later by
+ * get_nzcv() or condition_holds().
+ */
+static void set_flags(struct machine_t *m, uint8_t operation, struct operand_t operand, uint64_t first, uint64_t second) {
+    m->flags.operation = operation;
+    m->flags.wide = operand.reg_type != REGISTER_w;
+    m->flags.first = first;
+    m->flags.second = second;
+    m->dirty.registers |= DIRTY_flags;
+}
+
+/*
+ * Show a load or store to the machine's timing model, if it has one.
+ */
+static void time_access(struct machine_t *m, uint64_t address, int size, int store) {
+    if (m->timing != NULL) {
+        timing_access(m->timing, address, size, store);
+    }
+}
+
 //executes fundamental math operations
-void execute_arithmetic(struct instruction_t instruction) {
-    uint64_t op1 = get_value(instruction.operands[1]);
-    uint64_t op2 = get_value(instruction.operands[2]);
+static void execute_arithmetic(struct machine_t *m, struct instruction_t instruction) {
+    uint64_t op1 = machine_get_value(m, instruction.operands[1]);
+    uint64_t op2 = machine_get_value(m, instruction.operands[2]);
     uint64_t result;
     switch(instruction.operation) {
     case OPERATION_add:
         result = op1 + op2;
         break;
+    case OPERATION_adds:
+        result = op1 + op2;
+        set_flags(m, FLAGS_add, instruction.operands[1], op1, op2);
+        break;
     case OPERATION_sub:
+        result = op1 - op2;
+        break;
     case OPERATION_subs:
         result = op1 - op2;
+        set_flags(m, FLAGS_sub, instruction.operands[1], op1, op2);
         break;
     case OPERATION_mul:
         result = op1 * op2;
@@ -230,12 +572,12 @@ void execute_arithmetic(struct instruction_t instruction) {
         break;
     }
 
-    put_value(instruction.operands[0], result);
+    machine_put_value(m, instruction.operands[0], result);
 }
 //executes bitwise math operators using basic bitwise logic on operands
-void execute_bitwise(struct instruction_t instruction) {
-    uint64_t op1 = get_value(instruction.operands[1]);
-    uint64_t op2 = get_value(instruction.operands[2]);
+static void execute_bitwise(struct machine_t *m, struct instruction_t instruction) {
+    uint64_t op1 = machine_get_value(m, instruction.operands[1]);
+    uint64_t op2 = machine_get_value(m, instruction.operands[2]);
     uint64_t result;
     switch(instruction.operation) {
         case OPERATION_lsl:
@@ -254,46 +596,49 @@ void execute_bitwise(struct instruction_t instruction) {
         result = op1 ^ op2;
         break;
     }
-    put_value(instruction.operands[0], result);
+    machine_put_value(m, instruction.operands[0], result);
 }
 
 //executes the mov instruction by storing the desired value into the register
-void execute_mov(struct instruction_t instruction) {
-    put_value(instruction.operands[0],get_value(instruction.operands[1]));
+static void execute_mov(struct machine_t *m, struct instruction_t instruction) {
+    machine_put_value(m, instruction.operands[0],machine_get_value(m, instruction.operands[1]));
 }
 
-//executes the load instructions finds the real address and adds the appropriate offset and then loads the desired value in the appropriate register type
+//executes the load instructions finds the simulated address and adds the appropriate offset and then loads the desired value in the appropriate register type
 //ChatGPT was used to help with stack adress implementation and casting
 //ChatGPT. OpenAI GPT-4. OpenAI, 17 Apr. 2025.
 
 /*
 We are supposed to load the value at the second operand's address into the first operand's address.
 
-We get the simulated address from the second operand using get_memory_address, and we use that to calculate
-the real stack address. Since machine.stack_top is the sim address of first byte of data, simaddress - machine.stack_top
-is the space between the byte we are looking for and the first byte ot data, and we add this to the real address of 
-the first byte of data, or machine.stack, to get the real address of the second operand.
+We get the simulated address from the second operand using get_memory_address, and we load from the paged
+simulated memory at that address with memory_load, which finds (or reads as zero) the page holding it.
 
-Now that we have the real address, we cast it to get the value and then we put that value into the first operand. 
+If the access faults, the first operand is left alone; otherwise we put that value into the first operand.
 We assume we read/write it as 64-bits unless the register is w, when we read/write it as 32-bits.
 */
 
-void execute_ldr(struct instruction_t instruction) {
+static void execute_ldr(struct machine_t *m, struct instruction_t instruction) {
     switch(instruction.operation){
         case OPERATION_ldr: 
-            uint64_t simaddress = get_memory_address(instruction.operands[1]);
-            uint64_t realaddress = (uint64_t)machine.stack + simaddress - machine.stack_top; 
+            uint64_t simaddress = machine_get_memory_address(m, instruction.operands[1]);
             switch (instruction.operands[0].reg_type) {
                 case REGISTER_sp:
                 case REGISTER_pc:
                 case REGISTER_x: {
-                    uint64_t value = *(uint64_t *)realaddress; 
-                    put_value(instruction.operands[0], value);
+                    uint64_t value;
+                    time_access(m, simaddress, 8, 0);
+                    if (memory_load(m->memory, simaddress, 8, &value)) {
+                        machine_put_value(m, instruction.operands[0], value);
+                    }
                     break;
                 }
                 case REGISTER_w: {
-                    uint32_t value = *(uint32_t *)realaddress;
-                    put_value(instruction.operands[0], value);
+                    uint64_t value;
+                    time_access(m, simaddress, 4, 0);
+                    if (memory_load(m->memory, simaddress, 4, &value)) {
+                        machine_put_value(m, instruction.operands[0], value);
+                    }
                     break;
                 }
             
@@ -302,107 +647,95 @@ void execute_ldr(struct instruction_t instruction) {
     }
 }
 
-//executes the instructions of str by finding the real address, adding the appropriate offset, and then storing thee value based on the appropriate register
+//executes the instructions of str by finding the simulated address, adding the appropriate offset, and then storing thee value based on the appropriate register
 //ChatGPT was used to help with stack address implementation
 //ChatGPT. OpenAI GPT-4. OpenAI, 17 Apr. 2025.
 
 /*
 We are supposed to store the value of the first operand into the second operand's address. We use get_value to get the
 value of the first operand. To find the real address of the second operand which we store the value at, we 
-get the simulated address using get_memory_address and calculate the real address, exactly as we did it for ldr. 
+get the simulated address using get_memory_address, exactly as we did it for ldr.
 
-We then change the value of the stack pointer at that real address, and if it's register w we read/write it as 32-bits.
+We then store the value at that address with memory_store, and if it's register w we read/write it as 32-bits.
 */
 
-void execute_str(struct instruction_t instruction) {
+static void execute_str(struct machine_t *m, struct instruction_t instruction) {
     switch(instruction.operation){
     case OPERATION_str: 
-        uint64_t value = get_value(instruction.operands[0]);  
-        uint64_t simaddress = get_memory_address(instruction.operands[1]);
-        uint64_t realaddress = (uint64_t)machine.stack + simaddress - machine.stack_top;
+        uint64_t value = machine_get_value(m, instruction.operands[0]);  
+        uint64_t simaddress = machine_get_memory_address(m, instruction.operands[1]);
         switch (instruction.operands[0].reg_type) {
             case REGISTER_w:
-                *(uint32_t *)realaddress = (uint32_t)value; 
+                time_access(m, simaddress, 4, 1);
+                if (memory_store(m->memory, simaddress, 4, value)) {
+                    machine_mark_store(m, simaddress, 4);
+                }
                 break;
             case REGISTER_x:
-                *(uint64_t *)realaddress = value;
+                time_access(m, simaddress, 8, 1);
+                if (memory_store(m->memory, simaddress, 8, value)) {
+                    machine_mark_store(m, simaddress, 8);
+                }
                 break;
     }
     break;
     }
 }
 
-//executes the cmp instruction by checking the values of operands and setting appropriate flags
-void execute_cmp(struct instruction_t instruction){
+//executes the cmp and tst instructions by recording their operands for the flags
+static void execute_cmp(struct machine_t *m, struct instruction_t instruction) {
+    uint64_t op1 = machine_get_value(m, instruction.operands[0]);
+    uint64_t op2 = machine_get_value(m, instruction.operands[1]);
     switch(instruction.operation){
         case OPERATION_cmp:
-            uint64_t op1 = get_value(instruction.operands[0]);
-            uint64_t op2 = get_value(instruction.operands[1]);
-            if(op1 > op2){
-                machine.conditions = CONDITION_POSITIVE;
-            }
-            else if(op1 == op2){
-                machine.conditions = CONDITION_ZERO;
-            }
-            else{
-                machine.conditions = CONDITION_NEGATIVE;
-            }
-            break; 
+            set_flags(m, FLAGS_sub, instruction.operands[0], op1, op2);
+            break;
+        case OPERATION_tst:
+            set_flags(m, FLAGS_and, instruction.operands[0], op1, op2);
+            break;
+    }
+}
+
+/*
+ * Show a branch about to execute to the machine's predictor, if it has one,
+ * and charge the timing model if the predictor got it wrong.
+ */
+static void predict(struct machine_t *m, int kind, int taken, uint64_t target) {
+    if (m->predictor != NULL && !predictor_branch(m->predictor, machine_slot(m, m->pc), m->pc, kind, taken, target)
+            && m->timing != NULL) {
+        m->timing->cycles += TIMING_MISPREDICT_CYCLES;
     }
 }
 
 //executes branching instruction by setting program counter equal to the value of current operand
-void execute_b(struct instruction_t instruction){
-    uint64_t next = get_value(instruction.operands[0]);
-    machine.pc = next;
+static void execute_b(struct machine_t *m, struct instruction_t instruction) {
+    uint64_t next = machine_get_value(m, instruction.operands[0]);
+    predict(m, BRANCH_jump, 1, next);
+    m->pc = next;
 }
 
 //executes the return instruction by setting program counter equal to return register value
-void execute_ret(struct instruction_t instruction){
-    machine.pc = machine.registers[30];
+static void execute_ret(struct machine_t *m, struct instruction_t instruction) {
+    predict(m, BRANCH_return, 1, m->registers[30]);
+    m->pc = m->registers[30];
 }
 
 //executes branch linking instruction by storing next instruction in link register and then branching
-void execute_bl(struct instruction_t instruction){
-    machine.registers[30] = machine.pc + 4;
-    execute_b(instruction);
-
+static void execute_bl(struct machine_t *m, struct instruction_t instruction) {
+    uint64_t next = machine_get_value(m, instruction.operands[0]);
+    predict(m, BRANCH_call, 1, next);
+    mark_register(m, 30, m->pc + 4);
+    m->registers[30] = m->pc + 4;
+    m->pc = next;
 }
 
-//executes branching instructions by checking the flags set by cmp and branching accordingly
-void execute_branch_equality(struct instruction_t instruction){
-    switch(instruction.operation){
-        case OPERATION_bne:
-            if(machine.conditions != CONDITION_ZERO){
-                // branch
-                execute_b(instruction);
-            }
-            break;
-        case OPERATION_beq:
-            if(machine.conditions == CONDITION_ZERO){
-                execute_b(instruction);
-            }
-            break;
-        case OPERATION_blt:
-            if(machine.conditions == CONDITION_NEGATIVE){
-                execute_b(instruction);
-            }
-            break;
-        case OPERATION_bgt:
-            if(machine.conditions == CONDITION_POSITIVE){\
-                execute_b(instruction);
-            }
-            break;
-        case OPERATION_bge:
-            if(machine.conditions == CONDITION_POSITIVE || machine.conditions == CONDITION_ZERO){
-                execute_b(instruction);
-            }
-            break;
-        case OPERATION_ble:
-            if(machine.conditions == CONDITION_NEGATIVE || machine.conditions == CONDITION_ZERO){
-                execute_b(instruction);
-            }
-            break;
+//executes conditional branches by checking the flags set by the last cmp, subs, adds or tst
+static void execute_branch_equality(struct machine_t *m, struct instruction_t instruction) {
+    int taken = condition_holds(&m->flags, instruction.operation);
+    uint64_t next = machine_get_value(m, instruction.operands[0]);
+    predict(m, BRANCH_conditional, taken, next);
+    if(taken){
+        m->pc = next;
     }
 }
 
@@ -414,11 +747,11 @@ void execute_branch_equality(struct instruction_t instruction){
 //ChatGPT used for number iteration feature 
 //"Explanation of iteration system in CLZ (Count Leading Zeros) Operation in C." 
 // ChatGPT. OpenAI GPT-4. OpenAI, 17 Apr. 2025.
-void execute_clz(struct instruction_t instruction){
+static void execute_clz(struct machine_t *m, struct instruction_t instruction) {
     uint64_t ret = 0;
     switch (instruction.operands[1].reg_type) {
         case REGISTER_x: {
-            uint64_t value = get_value(instruction.operands[1]);
+            uint64_t value = machine_get_value(m, instruction.operands[1]);
             for(int i = 63; i >= 0; i--){ 
                 if((value >> i ) & 1){
                     break;
@@ -428,7 +761,7 @@ void execute_clz(struct instruction_t instruction){
             break;
         }
         case REGISTER_w: {
-            uint32_t value = get_value(instruction.operands[1]);
+            uint32_t value = machine_get_value(m, instruction.operands[1]);
             for(int i = 31; i >= 0; i--){ 
                 if((value >> i ) & 1){
                     break;
@@ -438,68 +771,93 @@ void execute_clz(struct instruction_t instruction){
             break;
         }
     }
-    put_value(instruction.operands[0],ret);
+    machine_put_value(m, instruction.operands[0],ret);
 }
 
 //executes ldrb instruction by performing a normal load but with only one byte from the original address using type casting
 //Casting implementation inspired by ChatGPT
 //ChatGPT. OpenAI GPT-4. OpenAI, 17 Apr. 2025.
-void execute_ldrb(struct instruction_t instruction){
+static void execute_ldrb(struct machine_t *m, struct instruction_t instruction) {
     switch (instruction.operation){
         case OPERATION_ldrb:
-            uint64_t simaddress = get_memory_address(instruction.operands[1]);
-            uint64_t realaddress = (uint64_t)machine.stack + simaddress - machine.stack_top;
-            uint64_t byteaddr = *(uint8_t *)realaddress;
-            put_value(instruction.operands[0],byteaddr);
+            uint64_t simaddress = machine_get_memory_address(m, instruction.operands[1]);
+            uint64_t byteaddr;
+            time_access(m, simaddress, 1, 0);
+            if (memory_load(m->memory, simaddress, 1, &byteaddr)) {
+                machine_put_value(m, instruction.operands[0],byteaddr);
+            }
             break;
     }
 }
 //executes strb instruction by carrying out a normal store but with modifying amount of bytes with type casting
 //Casting implementation inspired by ChatGPT
 //ChatGPT. OpenAI GPT-4. OpenAI, 17 Apr. 2025.
-void execute_strb(struct instruction_t instruction ){
+static void execute_strb(struct machine_t *m, struct instruction_t instruction) {
     switch (instruction.operation){
         case OPERATION_strb:
-            uint64_t value = get_value(instruction.operands[0]);  
-            uint64_t sim_address = get_memory_address(instruction.operands[1]);
-            uint64_t realaddress = (uint64_t)machine.stack + sim_address - machine.stack_top;
-            *(uint8_t *)realaddress = (uint8_t)value;
+            uint64_t value = machine_get_value(m, instruction.operands[0]);  
+            uint64_t sim_address = machine_get_memory_address(m, instruction.operands[1]);
+            time_access(m, sim_address, 1, 1);
+            if (memory_store(m->memory, sim_address, 1, value)) {
+                machine_mark_store(m, sim_address, 1);
+            }
             break;
     }
 }
 
+/*
+ * Report a fault raised by the last instruction a machine executed.
+ */
+void machine_print_fault(struct machine_t *m, FILE *out) {
+    struct fault_t fault = m->memory->fault;
+    fprintf(out, "Fault: %s 0x%lX at pc 0x%lX\n", fault_name(fault.kind), fault.address, fault.pc);
+}
+
+/*
+ * Report the fault of the global machine.
+ */
+void print_fault() {
+    machine_print_fault(&machine, stdout);
+}
+
 /*
  * Execute an instruction
  */
  
-void execute(struct instruction_t instruction) {
+void machine_execute(struct machine_t *m, struct instruction_t instruction) {
+    uint8_t faulted = m->memory->fault.kind != FAULT_none;
+    if (m->timing != NULL) {
+        timing_instruction(m->timing, instruction.operation);
+    }
     switch(instruction.operation) {
     case OPERATION_add:
+    case OPERATION_adds:
     case OPERATION_sub:
     case OPERATION_subs:
     case OPERATION_mul:
     case OPERATION_sdiv:
     case OPERATION_udiv:
-        execute_arithmetic(instruction);
+        execute_arithmetic(m, instruction);
         break;
     case OPERATION_lsl:
     case OPERATION_lsr:
     case OPERATION_and:
     case OPERATION_orr:
     case OPERATION_eor:
-        execute_bitwise(instruction);
+        execute_bitwise(m, instruction);
         break;
     case OPERATION_mov:
-        execute_mov(instruction);
+        execute_mov(m, instruction);
         break;
     case OPERATION_ldr:
-        execute_ldr(instruction);
+        execute_ldr(m, instruction);
         break;
     case OPERATION_str:
-        execute_str(instruction);
+        execute_str(m, instruction);
         break;
     case OPERATION_cmp:
-        execute_cmp(instruction);
+    case OPERATION_tst:
+        execute_cmp(m, instruction);
         break;
     case OPERATION_beq:
     case OPERATION_bne:
@@ -507,30 +865,70 @@ void execute(struct instruction_t instruction) {
     case OPERATION_bgt:
     case OPERATION_ble:
     case OPERATION_bge:
-        execute_branch_equality(instruction);
+        execute_branch_equality(m, instruction);
         break;
     case OPERATION_b:
-        execute_b(instruction);
+        execute_b(m, instruction);
         break;
     case OPERATION_bl:
-        execute_bl(instruction);
+        execute_bl(m, instruction);
         break;
     case OPERATION_ret:
-        execute_ret(instruction);
+        execute_ret(m, instruction);
         break;
     case OPERATION_nop:
         //do nothing
         break;
     case OPERATION_clz:
-        execute_clz(instruction);
+        execute_clz(m, instruction);
         break;
     case OPERATION_strb:
-        execute_strb(instruction);
+        execute_strb(m, instruction);
         break;
     case OPERATION_ldrb:
-        execute_ldrb(instruction);
+        execute_ldrb(m, instruction);
         break;
     default:
         printf("!!Instruction not implemented!!\n");
     }
+
+    // A faulting load or store stops at its own pc
+    if (!faulted && m->memory->fault.kind != FAULT_none) {
+        m->memory->fault.pc = m->pc;
+    }
+}
+
+/*
+ * Get the next instruction the global machine executes.
+ */
+struct instruction_t fetch() {
+    return machine_fetch(&machine);
+}
+
+/*
+ * Get the value of an operand in the global machine.
+ */
+uint64_t get_value(struct operand_t operand) {
+    return machine_get_value(&machine, operand);
+}
+
+/*
+ * Put a value in a register of the global machine.
+ */
+void put_value(struct operand_t operand, uint64_t value) {
+    machine_put_value(&machine, operand, value);
+}
+
+/*
+ * Get the memory address of an operand in the global machine.
+ */
+uint64_t get_memory_address(struct operand_t operand) {
+    return machine_get_memory_address(&machine, operand);
+}
+
+/*
+ * Execute an instruction on the global machine.
+ */
+void execute(struct instruction_t instruction) {
+    machine_execute(&machine, instruction);
 }
@@ -1,8 +1,13 @@
 #ifndef __MACHINE_H__
 #define __MACHINE_H__
 
+#include <stdio.h>
 #include <stdint.h>
 #include "code.h"
+#include "memory.h"
+#include "program.h"
+#include "timing.h"
+#include "predict.h"
 
 #define WORD_SIZE_BYTES 8
 #define WORD_SIZE_BITS (WORD_SIZE_BYTES * 8)
@@ -10,9 +15,52 @@
 
 #define REGISTER_NULL   0x0123456789ABCDEF
 
-#define CONDITION_ZERO      0b00000001
-#define CONDITION_NEGATIVE  0b00000010
-#define CONDITION_POSITIVE  0b00000100
+// Words in a range of addresses shown as the stack
+#define STACK_WORDS(top, bot) (((bot) - (top) + WORD_SIZE_BYTES - 1) / WORD_SIZE_BYTES)
+
+#define FLAG_N  0b00001000
+#define FLAG_Z  0b00000100
+#define FLAG_C  0b00000010
+#define FLAG_V  0b00000001
+
+#define FLAGS_none  0   // No flag-setting instruction has executed yet
+#define FLAGS_sub   1   // cmp, subs: first - second
+#define FLAGS_add   2   // adds: first + second
+#define FLAGS_and   3   // tst: first & second
+
+/*
+ * The NZCV flags are evaluated lazily: a flag-setting instruction only
+ * records its operation and source values, and the flags are derived when a
+ * conditional branch or print_memory() reads them.
+ */
+struct flags_t {
+    uint64_t first;
+    uint64_t second;
+    uint8_t operation;      // FLAGS_* constants above
+    uint8_t wide;           // 1 for 64-bit sources, 0 for 32-bit sources
+};
+
+#define DIRTY_STORES    8
+#define DIRTY_sp        ((uint64_t)1 << 31)
+#define DIRTY_flags     ((uint64_t)1 << 32)
+
+// Most ranges of words changed_words() returns
+#define CHANGED_RANGES  (DIRTY_STORES + 2)
+
+/*
+ * What the instructions executed since the last clear_dirty() changed: a bit
+ * per register (bit i for w/x i, plus DIRTY_sp and DIRTY_flags), and the
+ * address and size of each store. If there were more stores than fit, count
+ * exceeds DIRTY_STORES and any word may have been written.
+ */
+struct dirty_t {
+    uint64_t registers;
+    uint64_t stores[DIRTY_STORES];
+    uint8_t sizes[DIRTY_STORES];
+    uint32_t count;
+    uint64_t stack_top;     // Range shown as the stack when last cleared
+    uint64_t stack_bot;
+};
 
 struct machine_t {
     uint64_t registers[32]; // 31 general purpose registers, plus an extra for the zero register
@@ -20,21 +68,131 @@ struct machine_t {
     uint64_t pc;
     uint64_t code_top;
     uint64_t code_bot;
-    struct instruction_t *code;
-    void *stack;
-    uint64_t stack_top;
+    struct packed_t *code;
+    struct program_t *program;  // Where code came from; shared with other machines
+    struct section_t *sections; // Where the slots of code are; NULL if it is one dense run
+    uint64_t num_sections;
+    struct section_t section;   // The section the last lookup of a slot found
+    struct memory_t *memory;
+    uint64_t stack_top;     // Range of addresses print_memory() shows as the stack
     uint64_t stack_bot;
-    uint8_t conditions;
+    struct flags_t flags;
+    struct dirty_t dirty;
+    struct timing_t *timing;    // Charged for every instruction executed; NULL unless estimating cycles
+    struct predictor_t *predictor;  // Shown every branch executed; NULL unless predicting branches
 };
 
+// The machine the functions without a machine_ prefix operate on
 extern struct machine_t machine;
 
+struct machine_t *machine_create(void);
+int machine_load(struct machine_t *m, char *code_filepath, uint64_t pc, uint64_t sp);
+void machine_load_program(struct machine_t *m, struct program_t *program, uint64_t pc, uint64_t sp);
+int machine_step(struct machine_t *m);
+uint64_t machine_run(struct machine_t *m, uint64_t max_steps);
+void machine_destroy(struct machine_t *m);
+uint64_t machine_slot(struct machine_t *m, uint64_t address);
+uint64_t machine_address(struct machine_t *m, uint64_t slot);
+struct instruction_t machine_fetch(struct machine_t *m);
+uint64_t machine_get_value(struct machine_t *m, struct operand_t operand);
+void machine_put_value(struct machine_t *m, struct operand_t operand, uint64_t value);
+uint64_t machine_get_memory_address(struct machine_t *m, struct operand_t operand);
+void machine_execute(struct machine_t *m, struct instruction_t instruction);
+void machine_grow_stack(struct machine_t *m, uint64_t new_sp);
+void machine_print_memory(struct machine_t *m, FILE *out);
+void machine_print_changes(struct machine_t *m, FILE *out);
+void machine_print_fault(struct machine_t *m, FILE *out);
+void machine_mark_store(struct machine_t *m, uint64_t address, uint8_t size);
+void machine_clear_dirty(struct machine_t *m);
+int machine_changed_words(struct machine_t *m, uint64_t *first, uint64_t *last);
+void grow_stack(uint64_t new_sp);
 void init_machine(uint64_t sp, uint64_t pc, char *code_filepath);
 void print_memory();
+void print_fault();
+void print_changes();
+void clear_dirty();
+int changed_words(uint64_t *first, uint64_t *last);
 struct instruction_t fetch();
 uint64_t get_value(struct operand_t operand);
 void put_value(struct operand_t operand, uint64_t value);
 uint64_t get_memory_address(struct operand_t operand);
 void execute(struct instruction_t instruction);
 
+/*
+ * Derive the NZCV flags (FLAG_* bits) from the last flag-setting instruction.
+ */
+static inline uint8_t get_nzcv(const struct flags_t *flags) {
+    uint64_t sign = flags->wide ? (uint64_t)1 << 63 : (uint64_t)1 << 31;
+    uint64_t mask = flags->wide ? UINT64_MAX : UINT32_MAX;
+    uint64_t a = flags->first & mask;
+    uint64_t b = flags->second & mask;
+    uint64_t result;
+    uint8_t nzcv = 0;
+    switch (flags->operation) {
+    case FLAGS_sub:
+        result = (a - b) & mask;
+        nzcv |= (a >= b) ? FLAG_C : 0;
+        nzcv |= ((a ^ b) & (a ^ result) & sign) ? FLAG_V : 0;
+        break;
+    case FLAGS_add:
+        result = (a + b) & mask;
+        nzcv |= (result < a) ? FLAG_C : 0;
+        nzcv |= (~(a ^ b) & (a ^ result) & sign) ? FLAG_V : 0;
+        break;
+    case FLAGS_and:
+        result = a & b;
+        break;
+    default:
+        return 0;
+    }
+    nzcv |= (result & sign) ? FLAG_N : 0;
+    nzcv |= (result == 0) ? FLAG_Z : 0;
+    return nzcv;
+}
+
+/*
+ * Check whether a conditional branch (OPERATION_b.cond) is taken. After a
+ * compare the condition is a direct signed comparison of the two sources, so
+ * NZCV is only materialized for the other flag-setting operations.
+ */
+static inline int condition_holds(const struct flags_t *flags, unsigned int operation) {
+    if (flags->operation == FLAGS_sub) {
+        int64_t a = flags->wide ? (int64_t)flags->first : (int32_t)flags->first;
+        int64_t b = flags->wide ? (int64_t)flags->second : (int32_t)flags->second;
+        switch (operation) {
+        case OPERATION_bne:
+            return a != b;
+        case OPERATION_beq:
+            return a == b;
+        case OPERATION_blt:
+            return a < b;
+        case OPERATION_bgt:
+            return a > b;
+        case OPERATION_ble:
+            return a <= b;
+        case OPERATION_bge:
+            return a >= b;
+        }
+        return 0;
+    }
+    uint8_t nzcv = get_nzcv(flags);
+    int z = (nzcv & FLAG_Z) != 0;
+    int less = ((nzcv & FLAG_N) != 0) != ((nzcv & FLAG_V) != 0);
+    switch (operation) {
+    case OPERATION_bne:
+        return !z;
+    case OPERATION_beq:
+        return z;
+    case OPERATION_blt:
+        return less;
+    case OPERATION_bgt:
+        return !z && !less;
+    case OPERATION_ble:
+        return z || less;
+    case OPERATION_bge:
+        return !less;
+    }
+    return 0;
+}
+
 #endif // __MACHINE_H__
@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "memory.h"
+
+#define INITIAL_CAPACITY 64
+#define WORD_BYTES 8
+
+// Backs every page that has only been read, through read-only TLB entries
+static const uint8_t zero_page[PAGE_SIZE_BYTES];
+
+/*
+ * Spread page numbers over the table; neighbouring pages are the common case.
+ */
+static uint64_t hash_page(uint64_t number, uint64_t capacity) {
+    return (number * 0x9E3779B97F4A7C15) & (capacity - 1);
+}
+
+/*
+ * Create an empty memory.
+ */
+struct memory_t *memory_create(void) {
+    struct memory_t *memory = malloc(sizeof(struct memory_t));
+    memory->capacity = INITIAL_CAPACITY;
+    memory->count = 0;
+    memory->numbers = calloc(memory->capacity, sizeof(uint64_t));
+    memory->pages = calloc(memory->capacity, sizeof(uint8_t *));
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        memory->tlb[i].tag = TLB_INVALID;
+    }
+    memory->fault.kind = FAULT_none;
+    memory->check_alignment = 0;
+    memory->arena = NULL;
+    return memory;
+}
+
+/*
+ * Release a memory and all of its pages.
+ */
+void memory_destroy(struct memory_t *memory) {
+    for (uint64_t i = 0; i < memory->capacity; i++) {
+        free(memory->pages[i]);
+    }
+    free(memory->numbers);
+    free(memory->pages);
+    if (memory->arena != NULL) {
+        munmap(memory->arena, memory->arena_size);
+    }
+    free(memory);
+}
+
+/*
+ * Double the size of the page table, keeping every page.
+ */
+static void grow_table(struct memory_t *memory) {
+    uint64_t old_capacity = memory->capacity;
+    uint64_t *old_numbers = memory->numbers;
+    uint8_t **old_pages = memory->pages;
+
+    memory->capacity *= 2;
+    memory->numbers = calloc(memory->capacity, sizeof(uint64_t));
+    memory->pages = calloc(memory->capacity, sizeof(uint8_t *));
+    for (uint64_t i = 0; i < old_capacity; i++) {
+        if (old_pages[i] != NULL) {
+            uint64_t j = hash_page(old_numbers[i], memory->capacity);
+            while (memory->pages[j] != NULL) {
+                j = (j + 1) & (memory->capacity - 1);
+            }
+            memory->numbers[j] = old_numbers[i];
+            memory->pages[j] = old_pages[i];
+        }
+    }
+    free(old_numbers);
+    free(old_pages);
+}
+
+/*
+ * Check whether a simulated address is in the stack arena.
+ */
+static int in_arena(struct memory_t *memory, uint64_t address) {
+    return memory->arena != NULL && address - memory->arena_base < memory->arena_size;
+}
+
+/*
+ * Check whether a simulated address is in one of the arena's guard pages.
+ */
+static int in_guard(struct memory_t *memory, uint64_t address) {
+    if (!in_arena(memory, address)) {
+        return 0;
+    }
+    uint64_t offset = address - memory->arena_base;
+    return offset < PAGE_SIZE_BYTES || offset >= memory->arena_size - PAGE_SIZE_BYTES;
+}
+
+/*
+ * Commit the arena's pages from the one holding a simulated address up to
+ * the part already committed.
+ */
+static void commit_arena(struct memory_t *memory, uint64_t address) {
+    uint64_t low = PAGE_NUMBER(address) << PAGE_SIZE_BITS;
+    if (low < memory->arena_committed) {
+        mprotect(memory->arena + (low - memory->arena_base), memory->arena_committed - low,
+                 PROT_READ | PROT_WRITE);
+        memory->arena_committed = low;
+    }
+}
+
+/*
+ * Drop a page from the TLB, where it may be mapped to the zero page, once it
+ * is given a page of its own.
+ */
+static void forget_page(struct memory_t *memory, uint64_t address) {
+    memory->tlb[PAGE_NUMBER(address) % TLB_ENTRIES].tag = TLB_INVALID;
+}
+
+/*
+ * Find the host page holding a simulated address. If the page has never
+ * been written, allocate a zeroed page when allocate is set, otherwise
+ * return NULL. Pages in the arena are committed instead of allocated.
+ */
+uint8_t *memory_page(struct memory_t *memory, uint64_t address, int allocate) {
+    if (in_arena(memory, address)) {
+        if (in_guard(memory, address) || (address < memory->arena_committed && !allocate)) {
+            return NULL;
+        }
+        if (address < memory->arena_committed) {
+            forget_page(memory, address);
+        }
+        commit_arena(memory, address);
+        return memory->arena + ((PAGE_NUMBER(address) << PAGE_SIZE_BITS) - memory->arena_base);
+    }
+
+    uint64_t number = PAGE_NUMBER(address);
+    uint64_t i = hash_page(number, memory->capacity);
+    while (memory->pages[i] != NULL) {
+        if (memory->numbers[i] == number) {
+            return memory->pages[i];
+        }
+        i = (i + 1) & (memory->capacity - 1);
+    }
+    if (!allocate) {
+        return NULL;
+    }
+
+    // Keep the table at most half full so probe sequences stay short
+    if ((memory->count + 1) * 2 > memory->capacity) {
+        grow_table(memory);
+        i = hash_page(number, memory->capacity);
+        while (memory->pages[i] != NULL) {
+            i = (i + 1) & (memory->capacity - 1);
+        }
+    }
+    forget_page(memory, address);
+    memory->numbers[i] = number;
+    memory->pages[i] = calloc(1, PAGE_SIZE_BYTES);
+    memory->count++;
+    return memory->pages[i];
+}
+
+/*
+ * Check whether an access of size bytes at a simulated address is allowed;
+ * return the kind of fault it raises, if any.
+ */
+static uint8_t check_access(struct memory_t *memory, uint64_t address, int size) {
+    if (address >= MEMORY_LIMIT || MEMORY_LIMIT - address < (uint64_t)size) {
+        return FAULT_range;
+    }
+    if (address < MEMORY_NULL_GUARD) {
+        return FAULT_unmapped;
+    }
+    if (memory->check_alignment && (address & (size - 1)) != 0) {
+        return FAULT_misaligned;
+    }
+    if (in_guard(memory, address) || in_guard(memory, address + size - 1)) {
+        return FAULT_overflow;
+    }
+    return FAULT_none;
+}
+
+/*
+ * Get the host address of an access of size bytes within one page, and load
+ * the page into the TLB. Writes allocate the page; reads of a page that was
+ * never written see the zero page. Return NULL if the access would fault,
+ * without recording the fault.
+ */
+uint8_t *memory_translate(struct memory_t *memory, uint64_t address, int size, int write) {
+    if (check_access(memory, address, size) != FAULT_none
+            || PAGE_OFFSET(address) + size > PAGE_SIZE_BYTES) {
+        return NULL;
+    }
+
+    uint64_t number = PAGE_NUMBER(address);
+    uint64_t base = number << PAGE_SIZE_BITS;
+    struct tlb_entry_t *entry = &memory->tlb[number % TLB_ENTRIES];
+    uint8_t *page = memory_page(memory, address, write);
+    uint64_t tag = (number << 1) | TLB_WRITABLE;
+    if (page == NULL) {
+        page = (uint8_t *)zero_page;
+        tag = number << 1;
+    }
+    // Every access to the page holding the null guard takes the checked path
+    if (number != PAGE_NUMBER(MEMORY_NULL_GUARD - 1)) {
+        entry->tag = tag;
+        entry->addend = (uint64_t)page - base;
+    }
+    return page + PAGE_OFFSET(address);
+}
+
+/*
+ * Record the first fault raised; return 0.
+ */
+int memory_raise_fault(struct memory_t *memory, uint8_t kind, uint64_t address) {
+    if (memory->fault.kind == FAULT_none) {
+        memory->fault.kind = kind;
+        memory->fault.address = address;
+    }
+    return 0;
+}
+
+/*
+ * Load size bytes from a simulated address, which may span two pages; return
+ * 0 and record a fault if the access is not allowed.
+ */
+int memory_read(struct memory_t *memory, uint64_t address, int size, uint64_t *value) {
+    uint8_t kind = check_access(memory, address, size);
+    if (kind != FAULT_none) {
+        return memory_raise_fault(memory, kind, address);
+    }
+
+    *value = 0;
+    for (int i = 0; i < size; i++) {
+        if (i == 0 || PAGE_OFFSET(address + i) == 0) {
+            // Copy as much as fits in this page
+            int length = size - i;
+            if (PAGE_OFFSET(address + i) + length > PAGE_SIZE_BYTES) {
+                length = PAGE_SIZE_BYTES - PAGE_OFFSET(address + i);
+            }
+            memcpy((uint8_t *)value + i, memory_translate(memory, address + i, length, 0), length);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Store the low size bytes of a value at a simulated address, which may span
+ * two pages; return 0 and record a fault if the access is not allowed.
+ */
+int memory_write(struct memory_t *memory, uint64_t address, int size, uint64_t value) {
+    uint8_t kind = check_access(memory, address, size);
+    if (kind != FAULT_none) {
+        return memory_raise_fault(memory, kind, address);
+    }
+
+    for (int i = 0; i < size; i++) {
+        if (i == 0 || PAGE_OFFSET(address + i) == 0) {
+            int length = size - i;
+            if (PAGE_OFFSET(address + i) + length > PAGE_SIZE_BYTES) {
+                length = PAGE_SIZE_BYTES - PAGE_OFFSET(address + i);
+            }
+            memcpy(memory_translate(memory, address + i, length, 1), (uint8_t *)&value + i, length);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Read the 8 bytes at a simulated address without checking the access or
+ * loading the TLB, as a debugger would; bytes never written read as zero.
+ */
+uint64_t memory_peek(struct memory_t *memory, uint64_t address) {
+    uint8_t bytes[WORD_BYTES];
+    uint8_t *page = NULL;
+    for (int i = 0; i < WORD_BYTES; i++) {
+        if (i == 0 || PAGE_OFFSET(address + i) == 0) {
+            page = memory_page(memory, address + i, 0);
+        }
+        bytes[i] = page != NULL ? page[PAGE_OFFSET(address + i)] : 0;
+    }
+    uint64_t value;
+    memcpy(&value, bytes, WORD_BYTES);
+    return value;
+}
+
+/*
+ * Write 8 bytes at a simulated address without checking the access.
+ */
+void memory_poke(struct memory_t *memory, uint64_t address, uint64_t value) {
+    uint8_t *page = NULL;
+    for (int i = 0; i < WORD_BYTES; i++) {
+        if (i == 0 || PAGE_OFFSET(address + i) == 0) {
+            page = memory_page(memory, address + i, 1);
+        }
+        page[PAGE_OFFSET(address + i)] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+/*
+ * Describe a kind of fault.
+ */
+const char *fault_name(uint8_t kind) {
+    switch (kind) {
+    case FAULT_unmapped:
+        return "unmapped address";
+    case FAULT_range:
+        return "address out of range";
+    case FAULT_misaligned:
+        return "misaligned address";
+    case FAULT_overflow:
+        return "guard page address";
+    case FAULT_code:
+        return "address with no instruction";
+    }
+    return "no fault";
+}
+
+/*
+ * Back the addresses around the stack with an arena of size bytes, reserved
+ * up front and committed from sp upwards. Call this before the first access;
+ * return 0 if the arena could not be reserved.
+ */
+int memory_reserve_stack(struct memory_t *memory, uint64_t sp, uint64_t size) {
+    // Leave room above sp (a sixteenth of a small arena), then a guard page
+    uint64_t above = size / 16 < ARENA_ABOVE_BYTES ? size / 16 : ARENA_ABOVE_BYTES;
+    uint64_t top = ((PAGE_NUMBER(sp + above - 1) + 2) << PAGE_SIZE_BITS);
+
+    // Shrink an arena that would reach down to the page holding the null
+    // guard, so that it keeps its lower guard page above it
+    uint64_t lowest = (PAGE_NUMBER(MEMORY_NULL_GUARD - 1) + 1) << PAGE_SIZE_BITS;
+    uint64_t base = top - lowest > size ? top - size : lowest;
+    if (top > MEMORY_LIMIT || top < base + 3 * PAGE_SIZE_BYTES || memory->arena != NULL) {
+        return 0;
+    }
+    void *arena = mmap(NULL, top - base, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        return 0;
+    }
+
+    memory->arena = arena;
+    memory->arena_base = base;
+    memory->arena_size = top - base;
+    memory->arena_committed = top - PAGE_SIZE_BYTES;
+    memory_commit_stack(memory, sp);
+    for (int i = 0; i < TLB_ENTRIES; i++) {
+        memory->tlb[i].tag = TLB_INVALID;
+    }
+    return 1;
+}
+
+/*
+ * Commit the arena down to a new sp. Nothing is copied, and an sp in a guard
+ * page or below the arena commits nothing.
+ */
+void memory_commit_stack(struct memory_t *memory, uint64_t sp) {
+    if (in_arena(memory, sp) && !in_guard(memory, sp)) {
+        commit_arena(memory, sp);
+    }
+}
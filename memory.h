@@ -0,0 +1,141 @@
+#ifndef __MEMORY_H__
+#define __MEMORY_H__
+
+#include <stdint.h>
+
+#define PAGE_SIZE_BITS  12
+#define PAGE_SIZE_BYTES (1 << PAGE_SIZE_BITS)
+
+#define PAGE_NUMBER(address) ((uint64_t)(address) >> PAGE_SIZE_BITS)
+#define PAGE_OFFSET(address) ((uint64_t)(address) & (PAGE_SIZE_BYTES - 1))
+
+// Simulated addresses at or above this limit are out of range
+#define MEMORY_ADDRESS_BITS 48
+#define MEMORY_LIMIT ((uint64_t)1 << MEMORY_ADDRESS_BITS)
+
+// Addresses below this are left unmapped to catch null pointers; the rest of
+// their page is usable (and is never put in the TLB)
+#define MEMORY_NULL_GUARD 0x100
+
+#define FAULT_none          0
+#define FAULT_unmapped      1   // Below MEMORY_NULL_GUARD
+#define FAULT_range         2   // At or above MEMORY_LIMIT
+#define FAULT_misaligned    3   // Not a multiple of the access size, when alignment is checked
+#define FAULT_overflow      4   // A guard page of the stack arena
+#define FAULT_code          5   // Executing a pc among the code with no instruction there
+
+// Host address space reserved for the stack arena, including its guard pages
+#define ARENA_SIZE_BYTES    ((uint64_t)256 << 20)
+// Most room the arena leaves above the initial sp
+#define ARENA_ABOVE_BYTES   ((uint64_t)1 << 20)
+
+/*
+ * A simulated exception raised by a load or store. The memory records the
+ * kind and address; whoever executed the access fills in the pc.
+ */
+struct fault_t {
+    uint8_t kind;           // FAULT_* constants above
+    uint64_t address;
+    uint64_t pc;
+};
+
+#define TLB_ENTRIES     64
+#define TLB_WRITABLE    1
+#define TLB_INVALID     UINT64_MAX
+
+/*
+ * A direct-mapped TLB entry caching where a page lives in host memory. The
+ * tag is the page number shifted left by one, with TLB_WRITABLE set if the
+ * page may be written; pages that were never written are mapped read-only to
+ * a shared zero page.
+ */
+struct tlb_entry_t {
+    uint64_t tag;
+    uint64_t addend;        // Host address of the page minus its simulated address
+};
+
+/*
+ * Sparse simulated memory: 4 KiB pages allocated the first time they are
+ * written, found through a hash table keyed by page number.
+ *
+ * Optionally, the addresses around the stack are instead backed by an arena:
+ * one contiguous host reservation, made PROT_NONE up front and committed
+ * downwards as sp descends, so the stack never moves or gets copied. The
+ * lowest and highest pages of the arena are guard pages that are never
+ * committed; accessing them raises FAULT_overflow.
+ */
+struct memory_t {
+    uint64_t *numbers;      // Page number held by each table entry
+    uint8_t **pages;        // Host page of each table entry; NULL if the entry is empty
+    uint64_t capacity;      // Table entries, a power of two
+    uint64_t count;         // Pages allocated
+    struct tlb_entry_t tlb[TLB_ENTRIES];
+    struct fault_t fault;   // First fault raised; kind is FAULT_none if there was none
+    uint8_t check_alignment;
+    uint8_t *arena;         // Host reservation for the stack arena; NULL if there is none
+    uint64_t arena_base;    // Simulated address of the arena's first byte
+    uint64_t arena_size;
+    uint64_t arena_committed;   // Lowest committed simulated address
+};
+
+struct memory_t *memory_create(void);
+void memory_destroy(struct memory_t *memory);
+uint8_t *memory_page(struct memory_t *memory, uint64_t address, int allocate);
+uint8_t *memory_translate(struct memory_t *memory, uint64_t address, int size, int write);
+int memory_read(struct memory_t *memory, uint64_t address, int size, uint64_t *value);
+int memory_write(struct memory_t *memory, uint64_t address, int size, uint64_t value);
+uint64_t memory_peek(struct memory_t *memory, uint64_t address);
+void memory_poke(struct memory_t *memory, uint64_t address, uint64_t value);
+int memory_raise_fault(struct memory_t *memory, uint8_t kind, uint64_t address);
+const char *fault_name(uint8_t kind);
+int memory_reserve_stack(struct memory_t *memory, uint64_t sp, uint64_t size);
+void memory_commit_stack(struct memory_t *memory, uint64_t sp);
+
+/*
+ * Load size (1, 4 or 8) bytes from a simulated address; return 0 and record
+ * a fault if the access is not allowed. An aligned access whose page is in
+ * the TLB takes one compare and one add.
+ */
+static inline int memory_load(struct memory_t *memory, uint64_t address, int size, uint64_t *value) {
+    struct tlb_entry_t *entry = &memory->tlb[PAGE_NUMBER(address) % TLB_ENTRIES];
+    if ((entry->tag >> 1) == PAGE_NUMBER(address) && (address & (size - 1)) == 0) {
+        uint8_t *host = (uint8_t *)(address + entry->addend);
+        switch (size) {
+        case 8:
+            *value = *(uint64_t *)host;
+            break;
+        case 4:
+            *value = *(uint32_t *)host;
+            break;
+        default:
+            *value = *host;
+        }
+        return 1;
+    }
+    return memory_read(memory, address, size, value);
+}
+
+/*
+ * Store the low size (1, 4 or 8) bytes of a value at a simulated address;
+ * return 0 and record a fault if the access is not allowed.
+ */
+static inline int memory_store(struct memory_t *memory, uint64_t address, int size, uint64_t value) {
+    struct tlb_entry_t *entry = &memory->tlb[PAGE_NUMBER(address) % TLB_ENTRIES];
+    if (entry->tag == ((PAGE_NUMBER(address) << 1) | TLB_WRITABLE) && (address & (size - 1)) == 0) {
+        uint8_t *host = (uint8_t *)(address + entry->addend);
+        switch (size) {
+        case 8:
+            *(uint64_t *)host = value;
+            break;
+        case 4:
+            *(uint32_t *)host = (uint32_t)value;
+            break;
+        default:
+            *host = (uint8_t)value;
+        }
+        return 1;
+    }
+    return memory_write(memory, address, size, value);
+}
+
+#endif // __MEMORY_H__
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include "pool.h"
+
+/*
+ * What each worker thread is started with.
+ */
+struct pool_worker_t {
+    struct pool_t *pool;
+    int index;
+};
+
+/*
+ * Return the number of workers to use when none was asked for: one per
+ * online processor.
+ */
+int pool_default_workers(void) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return processors > 0 ? (int)processors : 1;
+}
+
+/*
+ * Take the next item from the front of a worker's own queue; return 0 if it
+ * is empty.
+ */
+static int pool_take(struct pool_queue_t *queue, uint64_t *item) {
+    pthread_mutex_lock(&queue->lock);
+    int found = queue->first < queue->last;
+    if (found) {
+        *item = queue->first++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+/*
+ * Move the back half (rounded up) of another worker's queue into an empty
+ * queue; return 0 if the other queue was empty too.
+ */
+static int pool_steal(struct pool_queue_t *victim, struct pool_queue_t *queue) {
+    pthread_mutex_lock(&victim->lock);
+    uint64_t left = victim->last - victim->first;
+    uint64_t split = victim->last - (left + 1) / 2;
+    uint64_t last = victim->last;
+    victim->last = split;
+    pthread_mutex_unlock(&victim->lock);
+    if (left == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->first = split;
+    queue->last = last;
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+/*
+ * Body of each worker: run the items in its own queue, then steal from the
+ * others until a full pass over them finds nothing. Items are never added,
+ * so once every queue has been seen empty there is nothing left to start.
+ */
+static void *pool_work(void *argument) {
+    struct pool_worker_t *worker = argument;
+    struct pool_t *pool = worker->pool;
+    struct pool_queue_t *queue = &pool->queues[worker->index];
+    uint64_t item;
+    while (1) {
+        while (pool_take(queue, &item)) {
+            pool->function(pool->context, item);
+        }
+
+        // Look for work starting from the next worker along
+        int stolen = 0;
+        for (int i = 1; i < pool->workers && !stolen; i++) {
+            stolen = pool_steal(&pool->queues[(worker->index + i) % pool->workers], queue);
+        }
+        if (!stolen) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Call function(context, item) for every item from 0 up to count on workers
+ * threads, returning once every call has returned. Calls may run in any
+ * order and at the same time as each other.
+ */
+void pool_run(int workers, uint64_t count, void (*function)(void *context, uint64_t item), void *context) {
+    if (workers < 1) {
+        workers = 1;
+    }
+    struct pool_t pool = {workers, NULL, function, context};
+    pool.queues = aligned_alloc(CACHE_LINE_BYTES, workers * sizeof(struct pool_queue_t));
+    struct pool_worker_t *arguments = malloc(workers * sizeof(struct pool_worker_t));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].first = count * i / workers;
+        pool.queues[i].last = count * (i + 1) / workers;
+        arguments[i].pool = &pool;
+        arguments[i].index = i;
+    }
+
+    // The calling thread is the first worker
+    for (int i = 1; i < workers; i++) {
+        pthread_create(&threads[i], NULL, pool_work, &arguments[i]);
+    }
+    pool_work(&arguments[0]);
+    for (int i = 1; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+    free(threads);
+    free(arguments);
+    free(pool.queues);
+}
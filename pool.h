@@ -0,0 +1,34 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "ring.h"
+
+/*
+ * The items a worker has left to run: indices first up to, but excluding,
+ * last. The worker takes items from the front one at a time; a worker that
+ * has run out steals the back half from another.
+ */
+struct pool_queue_t {
+    _Alignas(CACHE_LINE_BYTES) pthread_mutex_t lock;
+    uint64_t first;
+    uint64_t last;
+};
+
+/*
+ * A pool of threads running a function once for every item from 0 up to a
+ * count. Items start out split evenly between the workers, so they only
+ * touch each other's queues once their own is empty.
+ */
+struct pool_t {
+    int workers;
+    struct pool_queue_t *queues;
+    void (*function)(void *context, uint64_t item);
+    void *context;
+};
+
+int pool_default_workers(void);
+void pool_run(int workers, uint64_t count, void (*function)(void *context, uint64_t item), void *context);
+
+#endif // __POOL_H__
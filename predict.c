@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "predict.h"
+
+/*
+ * Check whether a number is a power of two.
+ */
+static int is_power_of_two(uint64_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+/*
+ * Read the next colon-separated number of a part of a predictor, keeping
+ * the value it had if there is none; return 0 if the text is not a number.
+ */
+static int parse_field(char **text, uint64_t *value) {
+    if (**text != ':') {
+        return 1;
+    }
+    char *start = *text + 1;
+    *value = strtoull(start, text, 0);
+    return *text != start;
+}
+
+/*
+ * Parse one comma-separated part of a predictor into it: a scheme, as in
+ * "static", "bimodal:4096" or "gshare:4096:12", or a return address stack,
+ * as in "ras:16". Return 0 if the part is not valid.
+ */
+static int parse_part(struct predictor_t *predictor, char *part) {
+    char *end = part + strcspn(part, ":");
+    uint64_t entries = PREDICT_DEFAULT_ENTRIES;
+    uint64_t history = PREDICT_DEFAULT_HISTORY;
+    uint64_t depth = PREDICT_DEFAULT_DEPTH;
+    if (end - part == 3 && strncmp(part, "ras", 3) == 0) {
+        if (!parse_field(&end, &depth) || *end != '\0' || depth == 0 || depth > UINT32_MAX) {
+            return 0;
+        }
+        predictor->depth = depth;
+        return 1;
+    }
+    if (end - part == 6 && strncmp(part, "static", 6) == 0) {
+        predictor->scheme = PREDICT_static;
+        return *end == '\0';
+    }
+    if (end - part == 7 && strncmp(part, "bimodal", 7) == 0) {
+        predictor->scheme = PREDICT_bimodal;
+        history = 0;
+        if (!parse_field(&end, &entries)) {
+            return 0;
+        }
+    }
+    else if (end - part == 6 && strncmp(part, "gshare", 6) == 0) {
+        predictor->scheme = PREDICT_gshare;
+        if (!parse_field(&end, &entries) || !parse_field(&end, &history)) {
+            return 0;
+        }
+    }
+    else {
+        return 0;
+    }
+    if (*end != '\0' || !is_power_of_two(entries) || history > 63) {
+        return 0;
+    }
+    predictor->entries = entries;
+    predictor->history_bits = history;
+    return 1;
+}
+
+/*
+ * Create a predictor for code with num_sites slots, from a comma-separated
+ * list of its parts: a scheme, then optionally a return address stack, as in
+ * "gshare:4096:12,ras:16". Return NULL if the predictor is not valid.
+ */
+struct predictor_t *predictor_create(char *spec, uint64_t num_sites) {
+    struct predictor_t *predictor = calloc(1, sizeof(struct predictor_t));
+    char *list = strdup(spec);
+    char *next = list;
+    int parts = 0;
+    int valid = 1;
+    while (next != NULL && valid) {
+        char *part = strsep(&next, ",");
+        // The scheme comes first, and a return address stack may follow it
+        int stack = strncmp(part, "ras", 3) == 0;
+        valid = (parts++ == 0 ? !stack : stack && parts == 2) && parse_part(predictor, part);
+        if (!valid) {
+            fprintf(stderr, "Invalid branch predictor: %s\n", part);
+        }
+    }
+    free(list);
+    if (!valid) {
+        predictor_destroy(predictor);
+        return NULL;
+    }
+
+    // Counters start weakly not taken
+    if (predictor->scheme != PREDICT_static) {
+        predictor->counters = malloc(predictor->entries);
+        memset(predictor->counters, 1, predictor->entries);
+    }
+    predictor->stack = calloc(predictor->depth, sizeof(uint64_t));
+    predictor->sites = calloc(num_sites, sizeof(struct branch_site_t));
+    predictor->num_sites = num_sites;
+    return predictor;
+}
+
+/*
+ * Predict whether a conditional branch is taken, and train the predictor on
+ * what it did.
+ */
+static int predict_direction(struct predictor_t *predictor, uint64_t pc, int taken, uint64_t target) {
+    if (predictor->scheme == PREDICT_static) {
+        return target <= pc;
+    }
+    uint64_t index = pc >> 2;
+    if (predictor->scheme == PREDICT_gshare) {
+        index ^= predictor->history;
+        predictor->history = ((predictor->history << 1) | (taken != 0)) & (((uint64_t)1 << predictor->history_bits) - 1);
+    }
+    uint8_t *counter = &predictor->counters[index & (predictor->entries - 1)];
+    int predicted = *counter >= 2;
+    if (taken && *counter < 3) {
+        (*counter)++;
+    }
+    else if (!taken && *counter > 0) {
+        (*counter)--;
+    }
+    return predicted;
+}
+
+/*
+ * Show a branch at pc, in a slot of the code, to a predictor before it
+ * executes: its kind (BRANCH_* constants), whether it is taken, and where it
+ * goes if it is. Return 1 if the predictor got it right, or 0 if the branch
+ * was mispredicted and the core would have had to flush its pipeline.
+ */
+int predictor_branch(struct predictor_t *predictor, uint64_t slot, uint64_t pc, int kind, int taken, uint64_t target) {
+    struct branch_site_t *site = slot < predictor->num_sites ? &predictor->sites[slot] : NULL;
+    int correct = 1;
+    switch (kind) {
+    case BRANCH_conditional:
+        correct = predict_direction(predictor, pc, taken, target) == (taken != 0);
+        break;
+    case BRANCH_call:
+        if (predictor->depth > 0) {
+            predictor->top = (predictor->top + 1) % predictor->depth;
+            predictor->stack[predictor->top] = pc + 4;
+            predictor->used += predictor->used < predictor->depth;
+        }
+        break;
+    case BRANCH_return:
+        if (predictor->depth > 0) {
+            correct = predictor->used > 0 && predictor->stack[predictor->top] == target;
+            if (predictor->used > 0) {
+                predictor->top = (predictor->top + predictor->depth - 1) % predictor->depth;
+                predictor->used--;
+            }
+        }
+        else {
+            correct = site != NULL && site->executed > 0 && site->target == target;
+        }
+        break;
+    }
+
+    predictor->executed[kind]++;
+    predictor->mispredicted[kind] += !correct;
+    if (site != NULL) {
+        site->executed++;
+        site->taken += taken != 0;
+        site->mispredicted += !correct;
+        site->target = target;
+    }
+    return correct;
+}
+
+/*
+ * Print how many branches of each kind a predictor saw, and how many of
+ * them it mispredicted.
+ */
+void predictor_print(struct predictor_t *predictor, FILE *out) {
+    static char *names[BRANCH_KINDS] = {"conditional", "b", "bl", "ret"};
+    uint64_t executed = 0;
+    uint64_t mispredicted = 0;
+    for (int kind = 0; kind < BRANCH_KINDS; kind++) {
+        executed += predictor->executed[kind];
+        mispredicted += predictor->mispredicted[kind];
+    }
+    fprintf(out, "Branches: %lu, mispredicted %lu (%.2f%%)", executed, mispredicted,
+            executed == 0 ? 0 : 100.0 * mispredicted / executed);
+    for (int kind = 0; kind < BRANCH_KINDS; kind++) {
+        fprintf(out, "%s%s %lu/%lu", kind == 0 ? ": " : ", ", names[kind],
+                predictor->mispredicted[kind], predictor->executed[kind]);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * Free a predictor.
+ */
+void predictor_destroy(struct predictor_t *predictor) {
+    free(predictor->counters);
+    free(predictor->stack);
+    free(predictor->sites);
+    free(predictor);
+}
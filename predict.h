@@ -0,0 +1,63 @@
+#ifndef __PREDICT_H__
+#define __PREDICT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+// How the direction of a conditional branch is predicted
+#define PREDICT_static      0   // Backward taken, forward not taken
+#define PREDICT_bimodal     1   // A 2-bit counter per branch, indexed by its address
+#define PREDICT_gshare      2   // 2-bit counters indexed by the address xor the global history
+
+// Kinds of branch a predictor is shown
+#define BRANCH_conditional  0   // b.cond
+#define BRANCH_jump         1   // b
+#define BRANCH_call         2   // bl
+#define BRANCH_return       3   // ret
+#define BRANCH_KINDS        4
+
+// Shape of the tables when the predictor does not give one
+#define PREDICT_DEFAULT_ENTRIES     4096
+#define PREDICT_DEFAULT_HISTORY     12
+#define PREDICT_DEFAULT_DEPTH       16
+
+/*
+ * What happened at one branch site.
+ */
+struct branch_site_t {
+    uint64_t executed;
+    uint64_t taken;
+    uint64_t mispredicted;
+    uint64_t target;        // Where it went last; a ret's prediction without a return address stack
+};
+
+/*
+ * A model of the branch prediction of a core, and how well it did at each
+ * slot of a machine's code. The direction of a conditional branch is
+ * predicted by one of the PREDICT_* schemes; b and bl always go where they
+ * are predicted to, their target being in the instruction. A ret is
+ * predicted by a return address stack that bl pushes onto, or, if the
+ * predictor has none, to go where it went last time.
+ */
+struct predictor_t {
+    uint8_t scheme;         // PREDICT_* constants above
+    uint8_t *counters;      // 0 and 1 predict not taken, 2 and 3 taken
+    uint64_t entries;
+    uint64_t history;       // PREDICT_gshare: the outcomes of the latest conditional branches, newest in bit 0
+    int history_bits;
+    uint64_t *stack;        // Return address stack, circular: a deep stack overwrites its oldest entries
+    uint32_t depth;
+    uint32_t top;
+    uint32_t used;
+    struct branch_site_t *sites;    // Per slot
+    uint64_t num_sites;
+    uint64_t executed[BRANCH_KINDS];
+    uint64_t mispredicted[BRANCH_KINDS];
+};
+
+struct predictor_t *predictor_create(char *spec, uint64_t num_sites);
+int predictor_branch(struct predictor_t *predictor, uint64_t slot, uint64_t pc, int kind, int taken, uint64_t target);
+void predictor_print(struct predictor_t *predictor, FILE *out);
+void predictor_destroy(struct predictor_t *predictor);
+
+#endif // __PREDICT_H__
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE    // qsort_r()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+
+/*
+ * A caller and a callee, and what the calls between them cost
+ */
+struct call_edge_t {
+    uint64_t caller;
+    uint64_t callee;
+    uint64_t calls;
+    uint64_t inclusive;
+};
+
+/*
+ * Return the name of one of a profile's functions.
+ */
+static char *function_name(struct profile_t *profile, uint64_t function) {
+    struct symbol_table_t *symbols = &profile->program->symbols;
+    if (function == 0) {
+        return PROFILE_UNKNOWN;
+    }
+    return SYMBOL_NAME(symbols, &symbols->symbols[function - 1]);
+}
+
+/*
+ * Return the function of the code at an address, or 0 if it is not code.
+ */
+static uint64_t function_at(struct profile_t *profile, uint64_t address) {
+    uint64_t slot = machine_slot(profile->machine, address);
+    return slot == SLOT_NONE ? 0 : profile->functions[slot];
+}
+
+/*
+ * Return the node for a call to a function from the stack of a node,
+ * adding it if the call has not been made before.
+ */
+static uint64_t call_node(struct profile_t *profile, uint64_t parent, uint64_t function) {
+    uint64_t *link = &profile->nodes[parent].child;
+    while (*link != PROFILE_NO_NODE) {
+        if (profile->nodes[*link].function == function) {
+            return *link;
+        }
+        link = &profile->nodes[*link].sibling;
+    }
+
+    uint64_t node = profile->num_nodes++;
+    *link = node;
+    if (profile->num_nodes > profile->capacity) {
+        profile->capacity *= 2;
+        profile->nodes = realloc(profile->nodes, profile->capacity * sizeof(struct call_node_t));
+    }
+    struct call_node_t *added = &profile->nodes[node];
+    memset(added, 0, sizeof(*added));
+    added->function = function;
+    added->parent = parent;
+    added->child = PROFILE_NO_NODE;
+    added->sibling = PROFILE_NO_NODE;
+    return node;
+}
+
+/*
+ * Charge a slot with the cycles and misses of the timing model since the
+ * last time, if there is a model; SLOT_NONE only takes note of them.
+ */
+static void profile_charge(struct profile_t *profile, uint64_t index) {
+    struct timing_t *timing = profile->timing;
+    if (timing == NULL) {
+        return;
+    }
+    if (index != SLOT_NONE) {
+        profile->cycles[index] += timing->cycles - profile->seen[0];
+        for (int level = 0; level < timing->levels; level++) {
+            profile->misses[level][index] += timing->caches[level]->misses - profile->seen[level + 1];
+        }
+    }
+    profile->seen[0] = timing->cycles;
+    for (int level = 0; level < timing->levels; level++) {
+        profile->seen[level + 1] = timing->caches[level]->misses;
+    }
+}
+
+/*
+ * Start profiling a machine that has a program loaded, from its pc.
+ */
+struct profile_t *profile_create(struct machine_t *machine) {
+    struct profile_t *profile = calloc(1, sizeof(struct profile_t));
+    struct program_t *program = machine->program;
+    profile->machine = machine;
+    profile->program = program;
+    profile->retired = calloc(program->count, sizeof(uint64_t));
+    profile->loads = calloc(program->count, sizeof(uint64_t));
+    profile->stores = calloc(program->count, sizeof(uint64_t));
+    profile->taken = calloc(program->count, sizeof(uint64_t));
+    profile->timing = machine->timing;
+    if (profile->timing != NULL) {
+        profile->cycles = calloc(program->count, sizeof(uint64_t));
+        for (int level = 0; level < profile->timing->levels; level++) {
+            profile->misses[level] = calloc(program->count, sizeof(uint64_t));
+        }
+    }
+
+    // Find the function of every slot, including the empty one after each
+    // section
+    profile->num_functions = program->symbols.count + 1;
+    profile->functions = malloc(program->count * sizeof(uint64_t));
+    for (uint64_t i = 0; i < program->num_sections; i++) {
+        struct section_t *section = &program->sections[i];
+        for (uint64_t j = 0; j < SECTION_SLOTS(*section); j++) {
+            struct symbol_t *symbol = find_symbol(&program->symbols, section->start + j * INSTRUCTION_SIZE);
+            profile->functions[section->slot + j] = symbol == NULL ? 0 : symbol - program->symbols.symbols + 1;
+        }
+    }
+
+    profile->capacity = 64;
+    profile->nodes = malloc(profile->capacity * sizeof(struct call_node_t));
+    memset(&profile->nodes[0], 0, sizeof(struct call_node_t));
+    profile->nodes[0].child = PROFILE_NO_NODE;
+    profile->nodes[0].sibling = PROFILE_NO_NODE;
+    profile->num_nodes = 1;
+    profile->node = call_node(profile, 0, function_at(profile, machine->pc));
+    profile_charge(profile, SLOT_NONE);
+    return profile;
+}
+
+/*
+ * Count an instruction the machine just retired, from a slot of its code at
+ * pc, and follow it to the stack of the next one.
+ */
+void profile_step(struct profile_t *profile, uint64_t index, uint64_t pc) {
+    struct machine_t *m = profile->machine;
+    unsigned int operation = m->code[index].operation;
+    profile->retired[index]++;
+    profile->nodes[profile->node].self++;
+    profile_charge(profile, index);
+    if (operation == OPERATION_ldr || operation == OPERATION_ldrb) {
+        profile->loads[index]++;
+    }
+    else if (operation == OPERATION_str || operation == OPERATION_strb) {
+        profile->stores[index]++;
+    }
+
+    // Running on to the next slot stays in the same function, almost always
+    uint64_t function;
+    if (m->pc == pc + INSTRUCTION_SIZE) {
+        function = profile->functions[index + 1];
+    }
+    else {
+        profile->taken[index]++;
+        uint64_t slot = machine_slot(m, m->pc);
+        if (slot == SLOT_NONE) {
+            return;
+        }
+        function = profile->functions[slot];
+        if (operation == OPERATION_bl) {
+            profile->node = call_node(profile, profile->node, function);
+            profile->nodes[profile->node].calls++;
+        }
+        else if (operation == OPERATION_ret && profile->nodes[profile->node].parent != 0) {
+            profile->node = profile->nodes[profile->node].parent;
+        }
+    }
+    if (profile->nodes[profile->node].function != function) {
+        profile->node = call_node(profile, profile->nodes[profile->node].parent, function);
+    }
+}
+
+/*
+ * Return the node after one in a depth-first walk of the call tree, keeping
+ * track of its depth below the root's children; PROFILE_NO_NODE at the end.
+ */
+static uint64_t next_node(struct profile_t *profile, uint64_t node, uint64_t *depth) {
+    struct call_node_t *nodes = profile->nodes;
+    if (nodes[node].child != PROFILE_NO_NODE) {
+        (*depth)++;
+        return nodes[node].child;
+    }
+    while (node != 0 && nodes[node].sibling == PROFILE_NO_NODE) {
+        node = nodes[node].parent;
+        (*depth)--;
+    }
+    return node == 0 ? PROFILE_NO_NODE : nodes[node].sibling;
+}
+
+/*
+ * Sum the instructions retired in each node and the nodes below it.
+ */
+static void sum_nodes(struct profile_t *profile) {
+    for (uint64_t i = 0; i < profile->num_nodes; i++) {
+        profile->nodes[i].total = profile->nodes[i].self;
+    }
+    // Nodes are added after their parents
+    for (uint64_t i = profile->num_nodes - 1; i > 0; i--) {
+        profile->nodes[profile->nodes[i].parent].total += profile->nodes[i].total;
+    }
+}
+
+/*
+ * Order calls by caller, then callee.
+ */
+static int compare_calls(const void *first, const void *second) {
+    const struct call_edge_t *a = first;
+    const struct call_edge_t *b = second;
+    if (a->caller != b->caller) {
+        return a->caller < b->caller ? -1 : 1;
+    }
+    return (a->callee > b->callee) - (a->callee < b->callee);
+}
+
+/*
+ * Order calls by the instructions retired in them, most first.
+ */
+static int compare_call_costs(const void *first, const void *second) {
+    const struct call_edge_t *a = first;
+    const struct call_edge_t *b = second;
+    if (a->inclusive != b->inclusive) {
+        return a->inclusive > b->inclusive ? -1 : 1;
+    }
+    return compare_calls(first, second);
+}
+
+/*
+ * Order indices by their keys, largest first.
+ */
+static int compare_keys(const void *first, const void *second, void *keys) {
+    uint64_t a = *(const uint64_t *)first;
+    uint64_t b = *(const uint64_t *)second;
+    uint64_t *key = keys;
+    if (key[a] != key[b]) {
+        return key[a] > key[b] ? -1 : 1;
+    }
+    return (a > b) - (a < b);
+}
+
+/*
+ * Return the indices 0 to count - 1, sorted by keys, largest first.
+ */
+static uint64_t *sort_by(uint64_t *keys, uint64_t count) {
+    uint64_t *order = malloc(count * sizeof(uint64_t) + 1);
+    for (uint64_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, count, sizeof(uint64_t), compare_keys, keys);
+    return order;
+}
+
+/*
+ * Return a count as a percentage of a total.
+ */
+static double percent(uint64_t count, uint64_t total) {
+    return total == 0 ? 0 : 100.0 * count / total;
+}
+
+/*
+ * Write the cycles and cache misses of each function, given the
+ * instructions retired in each.
+ */
+static void write_cycles(struct profile_t *profile, FILE *out, uint64_t *retired) {
+    struct timing_t *timing = profile->timing;
+    uint64_t functions = profile->num_functions;
+    uint64_t *cycles = calloc(functions, sizeof(uint64_t));
+    uint64_t *misses[TIMING_LEVELS];
+    for (int level = 0; level < timing->levels; level++) {
+        misses[level] = calloc(functions, sizeof(uint64_t));
+    }
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < profile->program->count; i++) {
+        uint64_t function = profile->functions[i];
+        cycles[function] += profile->cycles[i];
+        total += profile->cycles[i];
+        for (int level = 0; level < timing->levels; level++) {
+            misses[level][function] += profile->misses[level][i];
+        }
+    }
+
+    fprintf(out, "\nCycles, by function:\n");
+    fprintf(out, "%12s %7s %7s %10s %10s  %s\n", "Cycles", "Cycles%", "CPI", "L1D miss", "L2 miss", "Function");
+    uint64_t *order = sort_by(cycles, functions);
+    for (uint64_t i = 0; i < functions; i++) {
+        uint64_t f = order[i];
+        if (retired[f] == 0) {
+            continue;
+        }
+        fprintf(out, "%12lu %6.2f%% %7.2f", cycles[f], percent(cycles[f], total), (double)cycles[f] / retired[f]);
+        for (int level = 0; level < TIMING_LEVELS; level++) {
+            if (level < timing->levels) {
+                fprintf(out, " %10lu", misses[level][f]);
+            }
+            else {
+                fprintf(out, " %10s", "-");
+            }
+        }
+        fprintf(out, "  %s\n", function_name(profile, f));
+    }
+    free(order);
+    free(cycles);
+    for (int level = 0; level < timing->levels; level++) {
+        free(misses[level]);
+    }
+}
+
+/*
+ * Write the address of the code in a slot as an offset into its function.
+ */
+static void write_location(struct profile_t *profile, FILE *out, uint64_t slot) {
+    struct program_t *program = profile->program;
+    uint64_t address = machine_address(profile->machine, slot);
+    uint64_t function = profile->functions[slot];
+    uint64_t start = function == 0 ? program->code_top : program->symbols.symbols[function - 1].address;
+    fprintf(out, "%s+0x%lx: ", function_name(profile, function), address - start);
+}
+
+/*
+ * Write the branch sites the machine's predictor got wrong most often, with
+ * how often each was taken and predicted right.
+ */
+static void write_branches(struct profile_t *profile, FILE *out) {
+    struct predictor_t *predictor = profile->machine->predictor;
+    uint64_t count = predictor->num_sites;
+    uint64_t *mispredicted = malloc(count * sizeof(uint64_t) + 1);
+    for (uint64_t i = 0; i < count; i++) {
+        mispredicted[i] = predictor->sites[i].mispredicted;
+    }
+
+    fprintf(out, "\nBranches mispredicted most often:\n");
+    fprintf(out, "%18s %12s %7s %12s %9s  %s\n", "Address", "Executed", "Taken%", "Mispredicted", "Accuracy", "Instruction");
+    uint64_t *order = sort_by(mispredicted, count);
+    for (uint64_t i = 0; i < count && i < PROFILE_HOT_INSTRUCTIONS; i++) {
+        struct branch_site_t *site = &predictor->sites[order[i]];
+        if (site->mispredicted == 0) {
+            break;
+        }
+        fprintf(out, "%#18lx %12lu %6.2f%% %12lu %8.2f%%  ", machine_address(profile->machine, order[i]),
+                site->executed, percent(site->taken, site->executed), site->mispredicted,
+                percent(site->executed - site->mispredicted, site->executed));
+        write_location(profile, out, order[i]);
+        fprint_instruction(out, program_fetch(profile->program, order[i]));
+    }
+    free(order);
+    free(mispredicted);
+}
+
+/*
+ * Write a report of where a profiled machine's instructions went: totals,
+ * a flat profile of functions with the instructions retired in each one
+ * (self) and in it and everything it called (inclusive), the calls between
+ * functions, the cycles of each function if there is a timing model, and
+ * the branches mispredicted most often if there is a branch predictor, and
+ * the instructions retired most often.
+ */
+void profile_write_report(struct profile_t *profile, FILE *out) {
+    struct program_t *program = profile->program;
+    uint64_t functions = profile->num_functions;
+    uint64_t *self = calloc(functions, sizeof(uint64_t));
+    uint64_t *inclusive = calloc(functions, sizeof(uint64_t));
+    uint64_t *loads = calloc(functions, sizeof(uint64_t));
+    uint64_t *stores = calloc(functions, sizeof(uint64_t));
+    uint64_t *taken = calloc(functions, sizeof(uint64_t));
+    uint64_t *calls = calloc(functions, sizeof(uint64_t));
+    uint64_t total[4] = {0, 0, 0, 0};
+    for (uint64_t i = 0; i < program->count; i++) {
+        uint64_t function = profile->functions[i];
+        self[function] += profile->retired[i];
+        loads[function] += profile->loads[i];
+        stores[function] += profile->stores[i];
+        taken[function] += profile->taken[i];
+        total[0] += profile->retired[i];
+        total[1] += profile->loads[i];
+        total[2] += profile->stores[i];
+        total[3] += profile->taken[i];
+    }
+
+    // Walk the call tree, counting each stack towards the inclusive cost of
+    // its function and of the call to it, unless the function is already
+    // lower down the stack, as it is in a recursive call
+    sum_nodes(profile);
+    uint64_t *on_stack = calloc(functions, sizeof(uint64_t));
+    uint64_t *path = malloc(profile->num_nodes * sizeof(uint64_t));
+    struct call_edge_t *edges = malloc(profile->num_nodes * sizeof(struct call_edge_t));
+    uint64_t num_edges = 0;
+    uint64_t depth = 0;
+    uint64_t path_length = 0;
+    for (uint64_t node = profile->nodes[0].child; node != PROFILE_NO_NODE; node = next_node(profile, node, &depth)) {
+        while (path_length > depth) {
+            on_stack[profile->nodes[path[--path_length]].function]--;
+        }
+        struct call_node_t *n = &profile->nodes[node];
+        uint64_t counted = on_stack[n->function] == 0 ? n->total : 0;
+        inclusive[n->function] += counted;
+        calls[n->function] += n->calls;
+        if (depth > 0) {
+            struct call_edge_t *edge = &edges[num_edges++];
+            edge->caller = profile->nodes[n->parent].function;
+            edge->callee = n->function;
+            edge->calls = n->calls;
+            edge->inclusive = counted;
+        }
+        on_stack[n->function]++;
+        path[path_length++] = node;
+    }
+
+    // Merge the calls between the same two functions
+    qsort(edges, num_edges, sizeof(struct call_edge_t), compare_calls);
+    uint64_t merged = 0;
+    for (uint64_t i = 0; i < num_edges; i++) {
+        if (merged > 0 && compare_calls(&edges[merged - 1], &edges[i]) == 0) {
+            edges[merged - 1].calls += edges[i].calls;
+            edges[merged - 1].inclusive += edges[i].inclusive;
+        }
+        else {
+            edges[merged++] = edges[i];
+        }
+    }
+    qsort(edges, merged, sizeof(struct call_edge_t), compare_call_costs);
+
+    fprintf(out, "Profile of %s\n", program->filepath);
+    fprintf(out, "Instructions retired: %lu\n", total[0]);
+    fprintf(out, "Loads: %lu, stores: %lu, taken branches: %lu\n", total[1], total[2], total[3]);
+    if (profile->timing != NULL) {
+        timing_print(profile->timing, out);
+    }
+    if (profile->machine->predictor != NULL) {
+        predictor_print(profile->machine->predictor, out);
+    }
+    fprintf(out, "\n");
+
+    fprintf(out, "Functions, by instructions retired in them:\n");
+    fprintf(out, "%12s %7s %12s %7s %10s %10s %10s %8s  %s\n",
+            "Self", "Self%", "Inclusive", "Incl%", "Loads", "Stores", "Taken", "Calls", "Function");
+    uint64_t *order = sort_by(self, functions);
+    for (uint64_t i = 0; i < functions; i++) {
+        uint64_t f = order[i];
+        if (self[f] == 0 && inclusive[f] == 0) {
+            continue;
+        }
+        fprintf(out, "%12lu %6.2f%% %12lu %6.2f%% %10lu %10lu %10lu %8lu  %s\n",
+                self[f], percent(self[f], total[0]), inclusive[f], percent(inclusive[f], total[0]),
+                loads[f], stores[f], taken[f], calls[f], function_name(profile, f));
+    }
+    free(order);
+
+    fprintf(out, "\nCalls, by instructions retired in them:\n");
+    fprintf(out, "%12s %12s %7s  %s\n", "Calls", "Inclusive", "Incl%", "Caller -> callee");
+    for (uint64_t i = 0; i < merged; i++) {
+        fprintf(out, "%12lu %12lu %6.2f%%  %s -> %s\n", edges[i].calls, edges[i].inclusive,
+                percent(edges[i].inclusive, total[0]), function_name(profile, edges[i].caller),
+                function_name(profile, edges[i].callee));
+    }
+
+    if (profile->timing != NULL) {
+        write_cycles(profile, out, self);
+    }
+
+    if (profile->machine->predictor != NULL) {
+        write_branches(profile, out);
+    }
+
+    fprintf(out, "\nInstructions retired most often:\n");
+    fprintf(out, "%18s %12s %10s %10s %10s  %s\n", "Address", "Retired", "Loads", "Stores", "Taken", "Instruction");
+    order = sort_by(profile->retired, program->count);
+    for (uint64_t i = 0; i < program->count && i < PROFILE_HOT_INSTRUCTIONS; i++) {
+        uint64_t slot = order[i];
+        if (profile->retired[slot] == 0) {
+            break;
+        }
+        fprintf(out, "%#18lx %12lu %10lu %10lu %10lu  ", machine_address(profile->machine, slot),
+                profile->retired[slot], profile->loads[slot], profile->stores[slot], profile->taken[slot]);
+        write_location(profile, out, slot);
+        fprint_instruction(out, program_fetch(program, slot));
+    }
+    free(order);
+
+    free(self);
+    free(inclusive);
+    free(loads);
+    free(stores);
+    free(taken);
+    free(calls);
+    free(on_stack);
+    free(path);
+    free(edges);
+}
+
+/*
+ * Write the stacks instructions were retired in as collapsed stacks, one
+ * line per stack: the functions from the outermost in, separated by
+ * semicolons, and the instructions retired with exactly that stack. This is
+ * what flame graph tools read.
+ */
+void profile_write_stacks(struct profile_t *profile, FILE *out) {
+    uint64_t *path = malloc(profile->num_nodes * sizeof(uint64_t));
+    uint64_t depth = 0;
+    for (uint64_t node = profile->nodes[0].child; node != PROFILE_NO_NODE; node = next_node(profile, node, &depth)) {
+        path[depth] = node;
+        if (profile->nodes[node].self == 0) {
+            continue;
+        }
+        for (uint64_t i = 0; i <= depth; i++) {
+            fprintf(out, "%s%s", i == 0 ? "" : ";", function_name(profile, profile->nodes[path[i]].function));
+        }
+        fprintf(out, " %lu\n", profile->nodes[node].self);
+    }
+    free(path);
+}
+
+/*
+ * Free a profile.
+ */
+void profile_destroy(struct profile_t *profile) {
+    free(profile->retired);
+    free(profile->loads);
+    free(profile->stores);
+    free(profile->taken);
+    free(profile->cycles);
+    for (int level = 0; level < TIMING_LEVELS; level++) {
+        free(profile->misses[level]);
+    }
+    free(profile->functions);
+    free(profile->nodes);
+    free(profile);
+}
@@ -0,0 +1,69 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "machine.h"
+
+// Node of the call tree that no node follows
+#define PROFILE_NO_NODE     UINT64_MAX
+
+// Instructions the report lists individually
+#define PROFILE_HOT_INSTRUCTIONS    20
+
+// Name of the function of code that no symbol names
+#define PROFILE_UNKNOWN     "[unknown]"
+
+/*
+ * One stack of calls that instructions were retired in: a function, called
+ * from the stack of the node's parent. Each distinct stack has one node, so
+ * a recursive function gets a node for every depth it reaches.
+ */
+struct call_node_t {
+    uint64_t function;      // Index into the profile's functions
+    uint64_t parent;
+    uint64_t child;         // First node for a call made from this stack
+    uint64_t sibling;       // Next node with the same parent
+    uint64_t calls;         // Times this stack was entered with bl
+    uint64_t self;          // Instructions retired with exactly this stack
+    uint64_t total;         // Including calls made from it, once summed
+};
+
+/*
+ * What a machine spent its instructions on: how many were retired, and how
+ * many of them loaded, stored and took a branch, at each slot of its code,
+ * and the stacks of calls they were retired in. If the machine has a timing
+ * model, the cycles and cache misses of each slot are counted too.
+ *
+ * The functions of a program are its symbols: function 0 is code before the
+ * first symbol, and function i + 1 the code from symbol i up to the next.
+ * The call tree follows bl and ret. Reaching the code of another function
+ * any other way, by a tail call or by running on past the end of one,
+ * replaces the function at the top of the stack.
+ */
+struct profile_t {
+    struct machine_t *machine;
+    struct program_t *program;
+    uint64_t *retired;      // Per slot
+    uint64_t *loads;
+    uint64_t *stores;
+    uint64_t *taken;
+    struct timing_t *timing;    // The machine's timing model; NULL if it has none
+    uint64_t *cycles;       // Per slot, with a timing model
+    uint64_t *misses[TIMING_LEVELS];
+    uint64_t seen[TIMING_LEVELS + 1];   // Cycles and misses of each cache before the step
+    uint64_t *functions;    // Function of each slot
+    uint64_t num_functions;
+    struct call_node_t *nodes;  // Node 0 is the root, with no function
+    uint64_t num_nodes;
+    uint64_t capacity;
+    uint64_t node;          // Stack of the next instruction
+};
+
+struct profile_t *profile_create(struct machine_t *machine);
+void profile_step(struct profile_t *profile, uint64_t index, uint64_t pc);
+void profile_write_report(struct profile_t *profile, FILE *out);
+void profile_write_stacks(struct profile_t *profile, FILE *out);
+void profile_destroy(struct profile_t *profile);
+
+#endif // __PROFILE_H__
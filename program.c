@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "program.h"
+#include "decode.h"
+
+// Loaded programs by path; guarded by cache_lock
+static struct program_t *cache[PROGRAM_CACHE_BUCKETS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Hash a path to its cache bucket (FNV-1a).
+ */
+static uint64_t hash_path(char *filepath) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (char *c = filepath; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001B3;
+    }
+    return hash % PROGRAM_CACHE_BUCKETS;
+}
+
+/*
+ * Check whether a program was parsed from the file as it is now.
+ */
+static int program_is_current(struct program_t *program, struct stat *status) {
+    return program->device == status->st_dev && program->inode == status->st_ino
+        && program->size == status->st_size
+        && program->modified.tv_sec == status->st_mtim.tv_sec
+        && program->modified.tv_nsec == status->st_mtim.tv_nsec;
+}
+
+/*
+ * Find the program cached for a path and take it out of the cache if the
+ * file has changed since. Call with cache_lock held.
+ */
+static struct program_t *cache_find(char *filepath, struct stat *status) {
+    struct program_t **link = &cache[hash_path(filepath)];
+    while (*link != NULL && strcmp((*link)->filepath, filepath) != 0) {
+        link = &(*link)->next;
+    }
+    struct program_t *program = *link;
+    if (program != NULL && !program_is_current(program, status)) {
+        *link = program->next;
+        program_release(program);
+        program = NULL;
+    }
+    return program;
+}
+
+/*
+ * Map a program image into a program without copying or parsing it. Return
+ * 1 if it was mapped, 0 if the file is not an image, or -1 if it is an image
+ * this simulator cannot load.
+ */
+static int program_map_image(struct program_t *program, char *filepath) {
+    int descriptor = open(filepath, O_RDONLY);
+    if (descriptor < 0) {
+        return 0;
+    }
+    struct image_header_t header;
+    struct stat status;
+    if (read(descriptor, &header, sizeof(header)) != sizeof(header)
+            || memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0
+            || fstat(descriptor, &status) != 0) {
+        close(descriptor);
+        return 0;
+    }
+    if (header.version != IMAGE_VERSION || header.byte_order != IMAGE_BYTE_ORDER
+            || header.instruction_bytes != sizeof(struct packed_t)
+            || header.count > (status.st_size - sizeof(header)) / sizeof(struct packed_t)
+            || header.num_sections > (status.st_size - sizeof(header) - header.count * sizeof(struct packed_t))
+                                     / sizeof(struct section_t)
+            || header.num_symbols > (status.st_size - sizeof(header) - header.count * sizeof(struct packed_t)
+                                     - header.num_sections * sizeof(struct section_t)) / sizeof(struct symbol_t)
+            || header.names_bytes != status.st_size - sizeof(header) - header.count * sizeof(struct packed_t)
+                                     - header.num_sections * sizeof(struct section_t)
+                                     - header.num_symbols * sizeof(struct symbol_t)) {
+        fprintf(stderr, "%s: image is from another version of the simulator or is truncated\n", filepath);
+        close(descriptor);
+        return -1;
+    }
+
+    void *image = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (image == MAP_FAILED) {
+        perror("Failed to map image");
+        return -1;
+    }
+    program->image = image;
+    program->image_bytes = status.st_size;
+    program->code = (struct packed_t *)((uint8_t *)image + sizeof(header));
+    program->code_top = header.code_top;
+    program->code_bot = header.code_bot;
+    program->count = header.count;
+    program->sections = (struct section_t *)&program->code[header.count];
+    program->num_sections = header.num_sections;
+    program->symbols.symbols = (struct symbol_t *)&program->sections[header.num_sections];
+    program->symbols.count = header.num_symbols;
+    program->symbols.names = (char *)&program->symbols.symbols[header.num_symbols];
+    program->symbols.names_bytes = header.names_bytes;
+    return 1;
+}
+
+/*
+ * Save a program as an image that program_load() maps instead of parsing;
+ * return 0 if it could not be written.
+ */
+int program_save_image(struct program_t *program, char *filepath) {
+    struct image_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.instruction_bytes = sizeof(struct packed_t);
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.code_top = program->code_top;
+    header.code_bot = program->code_bot;
+    header.count = program->count;
+    header.num_sections = program->num_sections;
+    header.num_symbols = program->symbols.count;
+    header.names_bytes = program->symbols.names_bytes;
+    for (uint64_t i = 0; i < program->count; i++) {
+        program_fetch(program, i);
+    }
+
+    FILE *file = fopen(filepath, "wb");
+    if (file == NULL) {
+        perror("Failed to save image");
+        return 0;
+    }
+    int saved = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(program->code, sizeof(struct packed_t), program->count, file) == program->count
+        && fwrite(program->sections, sizeof(struct section_t), program->num_sections, file) == program->num_sections
+        && (program->symbols.count == 0
+            || (fwrite(program->symbols.symbols, sizeof(struct symbol_t), program->symbols.count, file) == program->symbols.count
+                && fwrite(program->symbols.names, 1, program->symbols.names_bytes, file) == program->symbols.names_bytes));
+    saved = (fclose(file) == 0) && saved;
+    if (!saved) {
+        perror("Failed to save image");
+    }
+    return saved;
+}
+
+/*
+ * Return the program in a file, either objdump output, an ELF file or an
+ * image, with a reference for the caller to release; return NULL if the file
+ * cannot be read. Objdump output is decoded as PROGRAM_eager or PROGRAM_lazy
+ * asks. The file is only loaded if it is not cached or has changed; a cached
+ * program is returned however it was decoded.
+ */
+struct program_t *program_load(char *filepath, int decoding) {
+    struct stat status;
+    if (stat(filepath, &status) != 0) {
+        perror("Failed to load code");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    struct program_t *program = cache_find(filepath, &status);
+    if (program != NULL) {
+        program_retain(program);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (program != NULL) {
+        return program;
+    }
+
+    // Load without holding the lock, so other files load at the same time
+    program = malloc(sizeof(struct program_t));
+    program->image = NULL;
+    program->offsets = NULL;
+    program->text = NULL;
+    int loaded = program_map_image(program, filepath);
+    struct code_map_t map;
+    if (loaded == 0) {
+        loaded = load_elf(filepath, &program->code, &map);
+    }
+    if (loaded == 0 && decoding == PROGRAM_lazy) {
+        program->offsets = index_file(filepath, &program->text, &program->text_bytes, &map);
+        program->code = program->offsets == NULL ? NULL : calloc(map.count, sizeof(struct packed_t));
+    }
+    else if (loaded == 0) {
+        program->code = parse_file(filepath, &map);
+    }
+    if (loaded < 0 || program->code == NULL) {
+        free(program);
+        return NULL;
+    }
+    if (program->image == NULL) {
+        program->code_top = map.code_start;
+        program->code_bot = map.code_end;
+        program->count = map.count;
+        program->sections = map.sections;
+        program->num_sections = map.num_sections;
+        program->symbols = map.symbols;
+    }
+    pthread_mutex_init(&program->decode_lock, NULL);
+    program->filepath = strdup(filepath);
+    program->device = status.st_dev;
+    program->inode = status.st_ino;
+    program->size = status.st_size;
+    program->modified = status.st_mtim;
+    atomic_init(&program->references, 2);   // The caller's and the cache's
+
+    // Another thread may have parsed the same file meanwhile; keep the first
+    pthread_mutex_lock(&cache_lock);
+    struct program_t *cached = cache_find(filepath, &status);
+    if (cached != NULL) {
+        program_retain(cached);
+    }
+    else {
+        uint64_t bucket = hash_path(filepath);
+        program->next = cache[bucket];
+        cache[bucket] = program;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (cached != NULL) {
+        atomic_store(&program->references, 1);
+        program_release(program);
+        program = cached;
+    }
+    return program;
+}
+
+/*
+ * Return the instruction at an index into a program's code, parsing it first
+ * if the program is decoded lazily and nothing has fetched it yet. Machines
+ * on other threads may be fetching from the same program.
+ */
+struct instruction_t program_fetch(struct program_t *program, uint64_t index) {
+    struct packed_t *slot = &program->code[index];
+    if (program->offsets == NULL || __atomic_load_n(&slot->operation, __ATOMIC_ACQUIRE) != OPERATION_NULL
+            || program->offsets[index] == 0) {
+        return unpack_instruction(*slot);
+    }
+
+    // Publish the operands before the operation that marks them as decoded
+    pthread_mutex_lock(&program->decode_lock);
+    if (slot->operation == OPERATION_NULL) {
+        struct packed_t packed;
+        pack_instruction(decode_line(program->text + program->offsets[index] - 1), &packed);
+        slot->kinds = packed.kinds;
+        slot->regs = packed.regs;
+        memcpy(slot->constants, packed.constants, sizeof(slot->constants));
+        __atomic_store_n(&slot->operation, packed.operation, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&program->decode_lock);
+    return unpack_instruction(*slot);
+}
+
+/*
+ * Take another reference to a program.
+ */
+void program_retain(struct program_t *program) {
+    atomic_fetch_add_explicit(&program->references, 1, memory_order_relaxed);
+}
+
+/*
+ * Drop a reference to a program, freeing it once no machine or cache holds
+ * one.
+ */
+void program_release(struct program_t *program) {
+    if (atomic_fetch_sub_explicit(&program->references, 1, memory_order_acq_rel) == 1) {
+        if (program->image != NULL) {
+            munmap(program->image, program->image_bytes);
+        }
+        else {
+            free(program->code);
+            free(program->sections);
+            free_symbols(&program->symbols);
+        }
+        if (program->text != NULL) {
+            munmap(program->text, program->text_bytes + 1);
+            free(program->offsets);
+        }
+        pthread_mutex_destroy(&program->decode_lock);
+        free(program->filepath);
+        free(program);
+    }
+}
+
+/*
+ * Drop the cache's reference to every program, so each is freed once the
+ * machines using it are done with it.
+ */
+void program_cache_clear(void) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < PROGRAM_CACHE_BUCKETS; i++) {
+        while (cache[i] != NULL) {
+            struct program_t *program = cache[i];
+            cache[i] = program->next;
+            program_release(program);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
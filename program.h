@@ -0,0 +1,91 @@
+#ifndef __PROGRAM_H__
+#define __PROGRAM_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "code.h"
+
+// Hash table buckets of the program cache
+#define PROGRAM_CACHE_BUCKETS 1024
+
+// How a program's instructions are parsed
+#define PROGRAM_eager   0   // All of them as it is loaded
+#define PROGRAM_lazy    1   // Each one the first time it is fetched
+
+#define IMAGE_MAGIC     "ARMIMAGE"
+#define IMAGE_VERSION   4
+
+/*
+ * The start of a program image: a program saved as it is held in memory, so
+ * that loading it only maps the file. The instructions follow the header
+ * directly, then come the sections, the symbols and the symbols' names. An
+ * image is only loaded by a simulator built with the same instruction layout
+ * and byte order.
+ */
+struct image_header_t {
+    char magic[8];              // IMAGE_MAGIC, without its terminator
+    uint32_t version;           // IMAGE_VERSION
+    uint32_t instruction_bytes; // sizeof(struct packed_t)
+    uint64_t byte_order;        // IMAGE_BYTE_ORDER, as the saving machine stores it
+    uint64_t code_top;
+    uint64_t code_bot;
+    uint64_t count;             // Slots, including the OPERATION_NULL after each section
+    uint64_t num_sections;
+    uint64_t num_symbols;
+    uint64_t names_bytes;
+    uint8_t reserved[56];       // Keeps the instructions 64-byte aligned
+};
+
+#define IMAGE_BYTE_ORDER 0x0102030405060708
+
+/*
+ * The parsed code of one file. Any number of machines, on any threads, can
+ * share a program; it is freed when the last of them releases it. Only the
+ * slots of a lazily decoded program change after it is loaded, each being
+ * written once, under decode_lock, and published by storing its operation
+ * last.
+ *
+ * A program is parsed from objdump output, decoded from the code section of
+ * an ELF file, or mapped from an image saved by program_save_image(). Objdump
+ * output can also be decoded lazily: loading it then only finds where each
+ * instruction's text is, and an instruction is parsed the first time it is
+ * fetched, so the time and memory a program takes follow the code that runs
+ * rather than its size. Loaded programs are cached by path, and reused as
+ * long as the file's device, inode, size and modification time are
+ * unchanged. The cache holds a reference of its own, so a program outlives
+ * the machines using it until the file changes or program_cache_clear() is
+ * called.
+ */
+struct program_t {
+    char *filepath;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    struct packed_t *code;
+    uint64_t code_top;
+    uint64_t code_bot;
+    uint64_t count;             // Slots in code, including the OPERATION_NULL after each section
+    struct section_t *sections; // Where the slots of code are
+    uint64_t num_sections;
+    struct symbol_table_t symbols;  // Names of the code, in address order; may be empty
+    void *image;                // Mapping code lies in if loaded from an image; NULL if parsed
+    uint64_t image_bytes;
+    uint64_t *offsets;          // Where the line of each instruction is, plus one, if decoded lazily
+    char *text;                 // Mapped objdump output, if decoded lazily
+    uint64_t text_bytes;
+    pthread_mutex_t decode_lock;    // Taken to decode an instruction
+    _Atomic uint64_t references;
+    struct program_t *next;     // Next program in the same cache bucket
+};
+
+struct program_t *program_load(char *filepath, int decoding);
+struct instruction_t program_fetch(struct program_t *program, uint64_t index);
+int program_save_image(struct program_t *program, char *filepath);
+void program_retain(struct program_t *program);
+void program_release(struct program_t *program);
+void program_cache_clear(void);
+
+#endif // __PROGRAM_H__
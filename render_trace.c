@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "machine.h"
+#include "code.h"
+#include "trace.h"
+
+int main(int argc, char **argv) {
+    // Check for valid command line arguments
+    int format = TRACE_text;
+    int opt;
+    while ((opt = getopt(argc, argv, "d")) != -1) {
+        switch (opt) {
+        case 'd':
+            format = TRACE_changes;
+            break;
+        default:
+            printf("Usage: %s [-d] TRACE_FILEPATH CODE_FILEPATH\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        printf("Usage: %s [-d] TRACE_FILEPATH CODE_FILEPATH\n", argv[0]);
+        exit(1);
+    }
+
+    // Load the code the trace was made from
+    memset(&machine, 0, sizeof(machine));
+    machine.program = program_load(argv[optind + 1], PROGRAM_eager);
+    if (machine.program == NULL) {
+        exit(1);
+    }
+    machine.code = machine.program->code;
+    machine.code_top = machine.program->code_top;
+    machine.code_bot = machine.program->code_bot;
+    machine.sections = machine.program->sections;
+    machine.num_sections = machine.program->num_sections;
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (file == NULL) {
+        perror("Failed to open trace");
+        exit(1);
+    }
+
+    // Replay the trace, printing what the simulator would have printed
+    setvbuf(stdout, NULL, _IOFBF, TRACE_OUTPUT_BYTES);
+    int fault = trace_render(file, stdout, &machine, format);
+    if (fault < 0) {
+        fflush(stdout);
+        fprintf(stderr, "%s is not a complete trace of %s\n", argv[optind], argv[optind + 1]);
+    }
+
+    // Clean-up
+    fclose(file);
+    program_release(machine.program);
+    program_cache_clear();
+    return fault != FAULT_none;
+}
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include "ring.h"
+
+// Times to poll before giving up the processor while waiting
+#define RING_SPINS 128
+// How long to sleep once polling has not helped
+#define RING_SLEEP_NS 50000
+
+/*
+ * Create an empty ring holding capacity bytes, which must be a power of two.
+ */
+struct ring_t *ring_create(uint64_t capacity) {
+    struct ring_t *ring = aligned_alloc(CACHE_LINE_BYTES, sizeof(struct ring_t));
+    ring->data = malloc(capacity);
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    ring->stalls = 0;
+    return ring;
+}
+
+/*
+ * Release a ring; neither side may use it any more.
+ */
+void ring_destroy(struct ring_t *ring) {
+    free(ring->data);
+    free(ring);
+}
+
+/*
+ * Wait a little longer each time the other side has not caught up.
+ */
+static void ring_wait(int *spins) {
+    if (*spins < RING_SPINS) {
+        (*spins)++;
+        sched_yield();
+    }
+    else {
+        struct timespec pause = {0, RING_SLEEP_NS};
+        nanosleep(&pause, NULL);
+    }
+}
+
+/*
+ * Append length bytes, waiting for the consumer whenever the ring is full.
+ * Only the producer may call this.
+ */
+void ring_push(struct ring_t *ring, const void *data, uint64_t length) {
+    const uint8_t *bytes = data;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int spins = 0;
+    while (length > 0) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        uint64_t room = ring->capacity - (head - tail);
+        if (room == 0) {
+            if (spins == 0) {
+                ring->stalls++;
+            }
+            ring_wait(&spins);
+            continue;
+        }
+        spins = 0;
+
+        // Copy up to the end of the buffer, then wrap around
+        uint64_t count = length < room ? length : room;
+        uint64_t offset = head & (ring->capacity - 1);
+        uint64_t first = ring->capacity - offset < count ? ring->capacity - offset : count;
+        memcpy(ring->data + offset, bytes, first);
+        memcpy(ring->data, bytes + first, count - first);
+        head += count;
+        bytes += count;
+        length -= count;
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+    }
+}
+
+/*
+ * Take up to length bytes, waiting while the ring is empty; return how many
+ * were taken, or 0 once the ring is closed and empty. Only the consumer may
+ * call this.
+ */
+uint64_t ring_pop(struct ring_t *ring, void *data, uint64_t length) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int spins = 0;
+    for (;;) {
+        // Check closed before head, so nothing written before closing is missed
+        int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t available = head - tail;
+        if (available > 0) {
+            uint64_t count = length < available ? length : available;
+            uint64_t offset = tail & (ring->capacity - 1);
+            uint64_t first = ring->capacity - offset < count ? ring->capacity - offset : count;
+            memcpy(data, ring->data + offset, first);
+            memcpy((uint8_t *)data + first, ring->data, count - first);
+            atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+            return count;
+        }
+        if (closed) {
+            return 0;
+        }
+        ring_wait(&spins);
+    }
+}
+
+/*
+ * Mark the end of what the producer writes.
+ */
+void ring_close(struct ring_t *ring) {
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
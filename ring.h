@@ -0,0 +1,31 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE_BYTES 64
+
+/*
+ * A single-producer, single-consumer ring of bytes. The producer only
+ * advances head and the consumer only advances tail, so neither side takes a
+ * lock; each waits (spinning briefly, then sleeping) while the ring is full
+ * or empty. head and tail count every byte ever written and read, and live on
+ * separate cache lines so the two sides do not contend.
+ */
+struct ring_t {
+    uint8_t *data;
+    uint64_t capacity;      // Bytes the ring holds, a power of two
+    _Alignas(CACHE_LINE_BYTES) _Atomic uint64_t head;
+    _Alignas(CACHE_LINE_BYTES) _Atomic uint64_t tail;
+    _Atomic int closed;     // Set by the producer once it has written everything
+    uint64_t stalls;        // Times the producer waited for room; producer only
+};
+
+struct ring_t *ring_create(uint64_t capacity);
+void ring_destroy(struct ring_t *ring);
+void ring_push(struct ring_t *ring, const void *data, uint64_t length);
+uint64_t ring_pop(struct ring_t *ring, void *data, uint64_t length);
+void ring_close(struct ring_t *ring);
+
+#endif // __RING_H__
@@ -1,40 +1,299 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
 #include "machine.h"
 #include "code.h"
+#include "engine.h"
+#include "jit.h"
+#include "trace.h"
+#include "profile.h"
+#include "breakpoint.h"
 
 int main(int argc, char **argv) {
     // Check for valid command line arguments
-    if (argc != 4) {
-        printf("Usage: %s CODE_FILEPATH PC SP\n", argv[0]);
+    int fast = 0;
+    int jit = 0;
+    int check_alignment = 0;
+    int arena = 0;
+    int diff = 0;
+    int decoding = PROGRAM_eager;
+    char *trace_filepath = NULL;
+    char *image_filepath = NULL;
+    char *report_filepath = NULL;
+    char *stacks_filepath = NULL;
+    char *caches = NULL;
+    char *predictor = NULL;
+    char *until = NULL;
+    uint64_t every = 0;
+    int valid_every = 1;
+    char *end;
+    int opt;
+    while ((opt = getopt(argc, argv, "fjasdlt:o:p:c:em:b:u:n:")) != -1) {
+        switch (opt) {
+        case 'f':
+            fast = 1;
+            break;
+        case 'j':
+            fast = 1;
+            jit = 1;
+            break;
+        case 'a':
+            check_alignment = 1;
+            break;
+        case 's':
+            arena = 1;
+            break;
+        case 'd':
+            diff = 1;
+            break;
+        case 'l':
+            decoding = PROGRAM_lazy;
+            break;
+        case 't':
+            trace_filepath = optarg;
+            break;
+        case 'o':
+            image_filepath = optarg;
+            break;
+        case 'p':
+            report_filepath = optarg;
+            break;
+        case 'c':
+            stacks_filepath = optarg;
+            break;
+        case 'e':
+            caches = caches != NULL ? caches : TIMING_DEFAULT_CACHES;
+            break;
+        case 'm':
+            caches = optarg;
+            break;
+        case 'b':
+            predictor = optarg;
+            break;
+        case 'u':
+            until = optarg;
+            break;
+        case 'n':
+            // Only a positive number of steps, with nothing after it
+            every = strtoull(optarg, &end, 0);
+            valid_every = isdigit((unsigned char)*optarg) && *end == '\0' && every != 0;
+            break;
+        default:
+            printf("Usage: %s [-f] [-j] [-a] [-s] [-d] [-l] [-t TRACE_FILEPATH] [-p REPORT_FILEPATH] [-c STACKS_FILEPATH]\n"
+                   "           [-e] [-m CACHES] [-b PREDICTOR] [-u UNTIL] [-n EVERY] CODE_FILEPATH PC SP\n"
+                   "       %s -o IMAGE_FILEPATH CODE_FILEPATH\n", argv[0], argv[0]);
+            exit(1);
+        }
+    }
+
+    // Save the code as an image instead of running it
+    if (image_filepath != NULL) {
+        if (argc - optind != 1) {
+            printf("Usage: %s -o IMAGE_FILEPATH CODE_FILEPATH\n", argv[0]);
+            exit(1);
+        }
+        struct program_t *program = program_load(argv[optind], decoding);
+        int saved = program != NULL && program_save_image(program, image_filepath);
+        if (program != NULL) {
+            program_release(program);
+        }
+        program_cache_clear();
+        return !saved;
+    }
+
+    // Traces, profiles, timing, branch prediction, breakpoints and samples
+    // see every step, so they cannot be combined with -f; a sample is a whole
+    // state, so it cannot go into a trace
+    int profiling = report_filepath != NULL || stacks_filepath != NULL;
+    int counting = profiling || caches != NULL || predictor != NULL;
+    if (argc - optind != 3 || !valid_every || ((trace_filepath != NULL || diff || counting || until != NULL || every != 0) && fast)
+            || (trace_filepath != NULL && diff) || (every != 0 && (trace_filepath != NULL || diff))) {
+        printf("Usage: %s [-f] [-j] [-a] [-s] [-d] [-l] [-t TRACE_FILEPATH] [-p REPORT_FILEPATH] [-c STACKS_FILEPATH]\n"
+               "           [-e] [-m CACHES] [-b PREDICTOR] [-u UNTIL] [-n EVERY] CODE_FILEPATH PC SP\n"
+               "       %s -o IMAGE_FILEPATH CODE_FILEPATH\n", argv[0], argv[0]);
         exit(1);
     }
 
     // Get command line arguments
-    char *code_filepath = argv[1];
-    uint64_t pc = strtol(argv[2], NULL, 0);
-    uint64_t sp = strtol(argv[3], NULL, 0);
+    char *code_filepath = argv[optind];
+    uint64_t pc = strtol(argv[optind + 1], NULL, 0);
+    uint64_t sp = strtol(argv[optind + 2], NULL, 0);
 
     // Initialize machine
-    init_machine(sp, pc, code_filepath);
+    struct program_t *program = program_load(code_filepath, decoding);
+    if (program == NULL) {
+        exit(1);
+    }
+    machine_load_program(&machine, program, pc, sp);
+    program_release(program);
+    machine.memory->check_alignment = check_alignment;
+    if (arena && !memory_reserve_stack(machine.memory, sp, ARENA_SIZE_BYTES)) {
+        printf("Could not reserve a stack arena\n");
+        exit(1);
+    }
+
+    // Run silently up to the breakpoint; tracing, sampling and counting all
+    // start from there. If the machine stops first, only its final state is
+    // printed
+    int reached = 1;
+    if (until != NULL) {
+        struct breakpoint_t *breakpoint = breakpoint_create(until);
+        if (breakpoint == NULL) {
+            exit(1);
+        }
+        breakpoint_run(breakpoint, &machine);
+        reached = breakpoint->reached;
+        if (reached) {
+            fprintf(stderr, "Reached %s after %lu steps\n", until, breakpoint->executed);
+        }
+        else {
+            fprintf(stderr, "Stopped after %lu steps without reaching %s\n", breakpoint->executed, until);
+        }
+        breakpoint_destroy(breakpoint);
+        if (machine.sp < machine.stack_top || machine.sp > machine.stack_bot) {
+            machine_grow_stack(&machine, machine.sp);
+        }
+    }
+
+    if (caches != NULL) {
+        machine.timing = timing_create(caches);
+        if (machine.timing == NULL) {
+            exit(1);
+        }
+    }
+    if (predictor != NULL) {
+        machine.predictor = predictor_create(predictor, machine.program->count);
+        if (machine.predictor == NULL) {
+            exit(1);
+        }
+    }
+
+    // Unless running fast, profiling, timing or predicting branches, every
+    // step is traced: encoded on this thread, and written out as a binary
+    // trace or rendered as text by a writer thread
+    struct trace_t *trace = NULL;
+    FILE *trace_file = stdout;
+    if (trace_filepath != NULL && reached) {
+        trace_file = fopen(trace_filepath, "wb");
+        if (trace_file == NULL) {
+            perror("Failed to open trace");
+            exit(1);
+        }
+        trace = trace_create(trace_file, &machine, TRACE_binary);
+    }
+    else if (!fast && (!counting || diff) && every == 0 && reached) {
+        trace = trace_create(stdout, &machine, diff ? TRACE_changes : TRACE_text);
+    }
+    else if (reached) {
+        print_memory();
+        printf("\n\n");
+    }
+
+    struct profile_t *profile = profiling ? profile_create(&machine) : NULL;
 
     // Fetch and execute instructions
-    print_memory();
-    printf("\n\n");
-    while (machine.pc <= machine.code_bot) {
-        struct instruction_t instruction = fetch();
-        print_instruction(instruction);
-        uint64_t pc_before = machine.pc;
-        execute(instruction);
-        if (machine.pc == pc_before) {
-            machine.pc += 4;
+    if (fast) {
+        // Run the predecoded code without tracing; only print the final state
+        struct engine_t *engine = engine_create(&machine);
+        if (jit) {
+            engine_enable_jit(engine, JIT_THRESHOLD);
+        }
+        engine_run(engine, ENGINE_UNBOUNDED);
+        engine_destroy(engine);
+        if (machine.memory->fault.kind != FAULT_none) {
+            print_fault();
         }
         print_memory();
         printf("\n\n");
     }
+    else {
+        uint64_t steps = 0;
+        while (1) {
+            uint64_t pc = machine.pc;
+            uint64_t index = machine_slot(&machine, pc);
+            if (!machine_step(&machine)) {
+                if (trace == NULL) {
+                    break;
+                }
+                if (machine.memory->fault.kind == FAULT_code) {
+                    // There was no instruction to run
+                    trace_fault(trace, TRACE_NO_INSTRUCTION);
+                }
+                else if (machine.memory->fault.kind != FAULT_none) {
+                    // The faulting instruction did not complete; stop at it
+                    trace_fault(trace, index);
+                }
+                break;
+            }
+            if (profile != NULL) {
+                profile_step(profile, index, pc);
+            }
+            if (trace != NULL) {
+                trace_step(trace, index);
+            }
+            else {
+                if (machine.sp < machine.stack_top || machine.sp > machine.stack_bot) {
+                    // Keep the range shown as the stack covering sp, as a trace does
+                    machine_grow_stack(&machine, machine.sp);
+                }
+                if (every != 0 && ++steps % every == 0) {
+                    print_memory();
+                    printf("\n\n");
+                }
+            }
+        }
+
+        // Without a trace, only the final state is printed, as with -f
+        if (trace == NULL) {
+            if (machine.memory->fault.kind != FAULT_none) {
+                print_fault();
+            }
+            print_memory();
+            printf("\n\n");
+        }
+    }
+
+    // Write out the profile
+    if (profile != NULL) {
+        char *filepaths[] = {report_filepath, stacks_filepath};
+        for (int i = 0; i < 2; i++) {
+            FILE *file = filepaths[i] != NULL ? fopen(filepaths[i], "w") : NULL;
+            if (filepaths[i] != NULL && file == NULL) {
+                perror("Failed to write profile");
+            }
+            else if (file != NULL) {
+                if (i == 0) {
+                    profile_write_report(profile, file);
+                }
+                else {
+                    profile_write_stacks(profile, file);
+                }
+                fclose(file);
+            }
+        }
+        profile_destroy(profile);
+    }
 
     // Clean-up
-    free(machine.stack);
-    free(machine.code);
+    if (trace != NULL) {
+        trace_destroy(trace);
+    }
+    if (trace_file != stdout) {
+        fclose(trace_file);
+    }
+    if (machine.timing != NULL) {
+        timing_print(machine.timing, stdout);
+        timing_destroy(machine.timing);
+    }
+    if (machine.predictor != NULL) {
+        predictor_print(machine.predictor, stdout);
+        predictor_destroy(machine.predictor);
+    }
+    int status = machine.memory->fault.kind != FAULT_none;
+    memory_destroy(machine.memory);
+    program_release(machine.program);
+    program_cache_clear();
+    return status;
 }
@@ -3,11 +3,73 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <elf.h>
+#include <sys/mman.h>
 #include "code.h"
+#include "decode.h"
 #include "machine.h"
+#include "ring.h"
+#include "pool.h"
+#include "profile.h"
+#include "breakpoint.h"
+#include "engine.h"
 
 bool ok = true;
 
+/*
+ * Count how many times each item is run by the pool test.
+ */
+static void count_item(void *context, uint64_t item) {
+    __atomic_fetch_add(&((uint8_t *)context)[item], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Write an AArch64 ELF file whose only section, besides the names of the
+ * sections, is code at an address.
+ */
+static void write_elf(char *filepath, uint64_t address, uint32_t *words, uint64_t count) {
+    char names[] = "\0.text\0.shstrtab";
+    Elf64_Ehdr header = {.e_type = ET_EXEC, .e_machine = EM_AARCH64, .e_version = EV_CURRENT,
+                         .e_ehsize = sizeof(Elf64_Ehdr), .e_shoff = sizeof(Elf64_Ehdr),
+                         .e_shentsize = sizeof(Elf64_Shdr), .e_shnum = 3, .e_shstrndx = 2};
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS64;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    uint64_t data = sizeof(Elf64_Ehdr) + 3 * sizeof(Elf64_Shdr);
+    Elf64_Shdr sections[3] = {
+        {0},
+        {.sh_name = 1, .sh_type = SHT_PROGBITS, .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+         .sh_addr = address, .sh_offset = data, .sh_size = count * INSTRUCTION_SIZE},
+        {.sh_name = 7, .sh_type = SHT_STRTAB, .sh_offset = data + count * INSTRUCTION_SIZE,
+         .sh_size = sizeof(names)},
+    };
+    FILE *file = fopen(filepath, "wb");
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(sections, sizeof(sections), 1, file);
+    fwrite(words, INSTRUCTION_SIZE, count, file);
+    fwrite(names, sizeof(names), 1, file);
+    fclose(file);
+}
+
+/*
+ * Check whether two machines stopped in the same state: registers, sp, pc,
+ * any fault and the words from low up to high.
+ */
+static int same_state(struct machine_t *a, struct machine_t *b, uint64_t low, uint64_t high) {
+    if (memcmp(a->registers, b->registers, sizeof(a->registers)) != 0 || a->sp != b->sp || a->pc != b->pc
+            || a->memory->fault.kind != b->memory->fault.kind
+            || (a->memory->fault.kind != FAULT_none && a->memory->fault.pc != b->memory->fault.pc)) {
+        return 0;
+    }
+    for (uint64_t address = low; address < high; address += 8) {
+        if (memory_peek(a->memory, address) != memory_peek(b->memory, address)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
 #define XTEST(expr, errmsg)                                                    \
   if (!expr) {                                                                 \
     printf("Failure: %s on line %d of %s\n", errmsg, __LINE__, __FILE__);      \
@@ -18,8 +80,7 @@ int main() {
     // Initial machine state
     machine.stack_top = 0xFFD0;
     machine.stack_bot = 0xFFF7;
-    machine.stack = malloc(machine.stack_bot - machine.stack_top + 1);
-    memset(machine.stack, 0, machine.stack_bot - machine.stack_top + 1);
+    machine.memory = memory_create();
     memset(machine.registers, 0, sizeof(machine.registers));
     machine.sp = machine.stack_top;
     machine.pc = 0xDEADC0DE;
@@ -70,7 +131,446 @@ int main() {
     machine.registers[9] = 0xFFE8;
     uint64_t deref_address = get_memory_address(deref);
     XTEST((deref_address == 0xFFE8), "get_memory_address returned incorrect value for [x9]"); 
-    XTEST((machine.registers[9] == 0xFFE8), "get_memory_address should not change value in x9"); 
+    XTEST((machine.registers[9] == 0xFFE8), "get_memory_address should not change value in x9");
+
+    // Test paged memory
+    uint64_t value = 1;
+    XTEST((memory_read(machine.memory, 0x12345678, 8, &value) && value == 0), "memory_read should return zeros for an untouched page");
+    XTEST((machine.memory->count == 0), "memory_read should not allocate pages");
+    memory_write(machine.memory, 0x1FFC, 8, 0x1122334455667788);
+    XTEST((memory_read(machine.memory, 0x1FFC, 8, &value) && value == 0x1122334455667788), "memory_read returned incorrect value across a page boundary");
+    XTEST((memory_load(machine.memory, 0x2000, 4, &value) && value == 0x11223344), "memory_write put incorrect value in the second page");
+    XTEST((machine.memory->count == 2), "memory_write should allocate the two pages it touches");
+    XTEST((memory_store(machine.memory, 0x12345678, 4, 0x55) && memory_load(machine.memory, 0x12345678, 4, &value) && value == 0x55), "memory_store should replace a read-only zero page mapping");
+    memory_poke(machine.memory, 0x2FFC, 0xAABBCCDD00112233);
+    XTEST((memory_peek(machine.memory, 0x2FFC) == 0xAABBCCDD00112233), "memory_peek returned incorrect value across a page boundary");
+    XTEST((memory_load(machine.memory, 0x50000, 8, &value) && value == 0), "a page never written should read as zero");
+    memory_poke(machine.memory, 0x50000, 42);
+    XTEST((memory_load(machine.memory, 0x50000, 8, &value) && value == 42 && memory_peek(machine.memory, 0x50000) == 42), "memory_load should see a value poked into a page it read as zero");
+
+    // Test dirty tracking
+    clear_dirty();
+    put_value(w13, 0x12345678);
+    put_value(pc, 0xFEEDC0DE);
+    XTEST((machine.dirty.registers == 0), "put_value should not mark a register whose value is unchanged");
+    put_value(w13, 0x1234);
+    XTEST((machine.dirty.registers == ((uint64_t)1 << 13)), "put_value should mark only the register it changed");
+    struct instruction_t str_stack = {OPERATION_str, {w13, stack}};
+    execute(str_stack);
+    uint64_t first[CHANGED_RANGES], last[CHANGED_RANGES];
+    XTEST((changed_words(first, last) == 1 && first[0] == 2 && last[0] == 2), "changed_words should list the stack word str wrote");
+    clear_dirty();
+
+    // Test memory faults
+    struct instruction_t ldr_null = {OPERATION_ldr, {w13, deref}};
+    machine.registers[9] = 0x10;
+    machine.registers[13] = 0x1234;
+    execute(ldr_null);
+    XTEST((machine.memory->fault.kind == FAULT_unmapped), "ldr from the null page should raise an unmapped fault");
+    XTEST((machine.memory->fault.address == 0x10 && machine.memory->fault.pc == machine.pc), "fault should record the address and pc of the ldr");
+    XTEST((machine.registers[13] == 0x1234), "faulting ldr should not change its destination");
+    machine.memory->fault.kind = FAULT_none;
+
+    XTEST(!memory_store(machine.memory, MEMORY_LIMIT - 4, 8, 0), "store past the end of memory should fail");
+    XTEST((machine.memory->fault.kind == FAULT_range), "store past the end of memory should raise an out of range fault");
+    machine.memory->fault.kind = FAULT_none;
+
+    machine.memory->check_alignment = 1;
+    XTEST(!memory_load(machine.memory, 0x1FFC, 8, &value), "misaligned load should fail when alignment is checked");
+    XTEST((machine.memory->fault.kind == FAULT_misaligned), "misaligned load should raise a misaligned fault");
+    machine.memory->fault.kind = FAULT_none;
+    machine.memory->check_alignment = 0;
+
+    // Test the stack arena
+    struct memory_t *arena = memory_create();
+    XTEST(memory_reserve_stack(arena, 0x100000, 0x10000), "memory_reserve_stack should reserve an arena");
+    XTEST((memory_store(arena, 0x100000 - 8, 8, 0x42) && memory_load(arena, 0x100000 - 8, 8, &value) && value == 0x42), "arena should hold values stored just below sp");
+    XTEST((arena->count == 0), "arena pages should not be allocated in the page table");
+    XTEST(!memory_store(arena, arena->arena_base, 8, 0), "store to the arena's lowest page should fail");
+    XTEST((arena->fault.kind == FAULT_overflow), "store to a guard page should raise an overflow fault");
+    memory_destroy(arena);
+    arena = memory_create();
+    XTEST((memory_reserve_stack(arena, 0xFFF0, ARENA_SIZE_BYTES) && arena->arena_base == PAGE_SIZE_BYTES), "an arena should not reach down to the null guard");
+    XTEST((!memory_store(arena, PAGE_SIZE_BYTES + 8, 8, 0) && arena->fault.kind == FAULT_overflow), "an arena shrunk above the null guard should keep its lower guard page");
+    memory_destroy(arena);
+
+    // Test the trace ring
+    struct ring_t *ring = ring_create(4);
+    uint8_t bytes[4];
+    ring_push(ring, "abc", 3);
+    XTEST((ring_pop(ring, bytes, 2) == 2 && memcmp(bytes, "ab", 2) == 0), "ring_pop returned incorrect bytes");
+    ring_push(ring, "def", 3);
+    ring_close(ring);
+    XTEST((ring_pop(ring, bytes, 4) == 4 && memcmp(bytes, "cdef", 4) == 0), "ring_pop returned incorrect bytes after wrapping around");
+    XTEST((ring_pop(ring, bytes, 4) == 0), "ring_pop should return 0 once the ring is closed and empty");
+    ring_destroy(ring);
+
+    // Test the worker pool
+    uint8_t runs[1000] = {0};
+    pool_run(4, 1000, count_item, runs);
+    uint8_t once = 1;
+    for (int i = 0; i < 1000; i++) {
+        once &= runs[i] == 1;
+    }
+    XTEST(once, "pool_run should run every item exactly once");
+
+    // Test independent machines
+    struct machine_t *first_machine = machine_create();
+    struct machine_t *second_machine = machine_create();
+    XTEST((machine_load(first_machine, "examples/initvars.txt", 0x71c, 0xFFF0) && machine_load(second_machine, "examples/initvars.txt", 0x71c, 0xFFF0)), "machine_load should load examples/initvars.txt");
+    uint64_t steps = machine_run(first_machine, UINT64_MAX);
+    XTEST((steps > 0 && first_machine->pc > first_machine->code_bot), "machine_run should run a machine off the end of its code");
+    XTEST((second_machine->pc == 0x71c && second_machine->sp == 0xFFF0), "running one machine should not change another");
+    XTEST((machine_run(second_machine, UINT64_MAX) == steps && memcmp(first_machine->registers, second_machine->registers, sizeof(first_machine->registers)) == 0), "machines running the same code should end in the same state");
+    XTEST(!machine_step(first_machine), "machine_step should not step a machine that has stopped");
+    XTEST((first_machine->program == second_machine->program && first_machine->code == second_machine->code), "machines loading the same file should share its program");
+    XTEST((machine_load(first_machine, "examples/initvars.txt", 0x71c, 0xFFE0) && first_machine->sp == 0xFFE0 && first_machine->program == second_machine->program), "reloading a machine should reuse the cached program");
+    machine_destroy(first_machine);
+    machine_destroy(second_machine);
+    program_cache_clear();
+
+    // Test packing instructions
+    struct instruction_t post_index = {OPERATION_ldr, {{OPERAND_register, REGISTER_x, 30, 0}, {OPERAND_memory, REGISTER_sp, 0, 0}, {OPERAND_constant, '\0', 0, 48}}};
+    struct packed_t packed;
+    XTEST(pack_instruction(post_index, &packed), "pack_instruction should pack a memory operand and a constant");
+    struct instruction_t unpacked = unpack_instruction(packed);
+    XTEST((unpacked.operation == OPERATION_ldr && unpacked.operands[0].reg_num == 30 && unpacked.operands[1].reg_type == REGISTER_sp && unpacked.operands[1].constant == 0 && unpacked.operands[2].constant == 48), "unpack_instruction should restore a packed instruction");
+    struct instruction_t constants = {OPERATION_add, {{OPERAND_constant, '\0', 0, 1}, {OPERAND_constant, '\0', 0, 2}, {OPERAND_constant, '\0', 0, 3}}};
+    XTEST((!pack_instruction(constants, &packed) && unpack_instruction(packed).operands[2].type == OPERAND_NULL), "pack_instruction should leave out a third constant");
+
+    // Test the objdump loader
+    FILE *source = fopen("test_operands.txt", "w");
+    fprintf(source, "0000000000000700 <long>:\n 700:\t52800000 \tmov\tw0, #0x0\n 708:\t17fffffe \tb\t700 <long>  // %0300d\n 70c:\td65f03c0 \tret", 0);
+    fclose(source);
+    struct code_map_t map;
+    struct packed_t *loaded = parse_file("test_operands.txt", &map);
+    XTEST((loaded != NULL && map.code_start == 0x700 && map.code_end == 0x70c), "parse_file returned incorrect code range");
+    XTEST((loaded != NULL && map.symbols.count == 1 && map.symbols.symbols[0].address == 0x700 && strcmp(SYMBOL_NAME(&map.symbols, &map.symbols.symbols[0]), "long") == 0), "parse_file should keep the symbol naming the code");
+    XTEST((loaded != NULL && loaded[1].operation == OPERATION_NULL && loaded[2].operation == OPERATION_b && loaded[2].constants[0] == 0x700), "parse_file should parse a long line and leave a skipped address empty");
+    XTEST((loaded != NULL && loaded[3].operation == OPERATION_ret && loaded[4].operation == OPERATION_NULL), "parse_file should parse a last line without a newline");
+    if (loaded != NULL) {
+        free(loaded);
+        free(map.sections);
+        free_symbols(&map.symbols);
+    }
+    source = fopen("test_operands.txt", "w");
+    fprintf(source, " 700:\t52800000 \tmov\tw0, #0x0\n 6fc:\t52800000 \tmov\tw0, #0x0\n");
+    fclose(source);
+    XTEST((parse_file("test_operands.txt", &map) == NULL), "parse_file should reject addresses that go backwards");
+
+    // Test code in sections far apart
+    source = fopen("test_operands.txt", "w");
+    fprintf(source, " 700:\t52800020 \tmov\tw0, #0x1\n 704:\t14040000 \tb\t100704 <far>\n");
+    fprintf(source, " 100704:\t11000400 \tadd\tw0, w0, #0x1\n 100708:\t17fc0000 \tb\t708 <near>\n");
+    fclose(source);
+    loaded = parse_file("test_operands.txt", &map);
+    XTEST((loaded != NULL && map.num_sections == 2 && map.count == 6 && map.sections[1].start == 0x100704 && map.sections[1].slot == 3), "parse_file should put code far apart in separate sections");
+    XTEST((loaded != NULL && loaded[3].operation == OPERATION_add && loaded[2].operation == OPERATION_NULL), "parse_file should number the slots of each section after the last");
+    if (loaded != NULL) {
+        free(loaded);
+        free(map.sections);
+        free_symbols(&map.symbols);
+    }
+    struct machine_t *sparse = machine_create();
+    XTEST(machine_load(sparse, "test_operands.txt", 0x700, 0x1000), "machine_load should load code in sections far apart");
+    XTEST((machine_slot(sparse, 0x100708) == 4 && machine_address(sparse, 4) == 0x100708 && machine_slot(sparse, 0x800) == SLOT_NONE), "machine_slot should find the slot of an address in either section");
+    XTEST((machine_run(sparse, 10) == 4 && sparse->memory->fault.kind == FAULT_code && sparse->memory->fault.pc == 0x708), "branching between sections should fault at an address with no instruction");
+    machine_destroy(sparse);
+    program_cache_clear();
+
+    // Test a file parsed in several chunks, with sections and symbols on
+    // both sides of each chunk boundary
+    source = fopen("test_operands.txt", "w");
+    for (uint64_t i = 0; i < 80000; i++) {
+        uint64_t address = 0x100000 * (i / 1000) + 0x700 + 4 * (i % 1000);
+        if (i % 1000 == 0) {
+            fprintf(source, "\n%016lx <f%lu>:\n", address, i / 1000);
+        }
+        fprintf(source, " %lx:\t%08lx \tadd\tw0, w0, #0x%lx\n", address, 0x11000000 | (i % 1000) << 10, i % 1000);
+    }
+    fclose(source);
+    loaded = parse_file("test_operands.txt", &map);
+    int chunked = loaded != NULL && map.num_sections == 80 && map.count == 80 * 1001 && map.symbols.count == 80;
+    for (uint64_t i = 0; i < 80000 && chunked; i++) {
+        uint64_t slot = 1001 * (i / 1000) + i % 1000;
+        chunked = map.sections[i / 1000].start == 0x100000 * (i / 1000) + 0x700 && loaded[slot].operation == OPERATION_add
+                && unpack_instruction(loaded[slot]).operands[2].constant == i % 1000 && loaded[1001 * (i / 1000) + 1000].operation == OPERATION_NULL;
+    }
+    XTEST(chunked, "parse_file should join the sections and symbols of a file parsed in chunks");
+    if (loaded != NULL) {
+        free(loaded);
+        free(map.sections);
+        free_symbols(&map.symbols);
+    }
+    char *indexed_text;
+    uint64_t indexed_length;
+    uint64_t *offsets = index_file("test_operands.txt", &indexed_text, &indexed_length, &map);
+    XTEST((offsets != NULL && map.count == 80 * 1001 && offsets[1001 * 40] != 0 && offsets[1001 * 40 + 1000] == 0 && strtoul(indexed_text + offsets[1001 * 40] - 1, NULL, 16) == 0x100000 * 40 + 0x700), "index_file should find each line of a file indexed in chunks");
+    if (offsets != NULL) {
+        free(offsets);
+        free(map.sections);
+        free_symbols(&map.symbols);
+        munmap(indexed_text, indexed_length + 1);
+    }
+    remove("test_operands.txt");
+
+    // Test lazy decoding
+    struct program_t *eager = program_load("examples/strlen.txt", PROGRAM_eager);
+    program_cache_clear();
+    struct program_t *lazy = program_load("examples/strlen.txt", PROGRAM_lazy);
+    XTEST((lazy != NULL && lazy->code[3].operation == OPERATION_NULL), "program_load should not decode a lazy program's instructions");
+    XTEST((lazy != NULL && program_fetch(lazy, 3).operation == eager->code[3].operation && lazy->code[3].constants[0] == eager->code[3].constants[0]), "program_fetch should decode an instruction of a lazy program");
+    XTEST((lazy != NULL && lazy->code[4].operation == OPERATION_NULL), "program_fetch should only decode the instruction fetched");
+    program_release(eager);
+    if (lazy != NULL) {
+        program_release(lazy);
+    }
+    program_cache_clear();
+
+    // Test decoding instructions from their encodings
+    struct instruction_t decoded;
+    XTEST((decode_instruction(0xB9400FE0, 0x720, &decoded) && decoded.operation == OPERATION_ldr && decoded.operands[0].reg_type == REGISTER_w && decoded.operands[1].type == OPERAND_memory && decoded.operands[1].reg_type == REGISTER_sp && decoded.operands[1].constant == 12), "decode_instruction should decode ldr w0, [sp, #12]");
+    XTEST((decode_instruction(0x54FFFF41, 0x780, &decoded) && decoded.operation == OPERATION_bne && decoded.operands[0].constant == 0x768), "decode_instruction should decode b.ne backwards");
+    XTEST((decode_instruction(0xAA0103E0, 0x748, &decoded) && decoded.operation == OPERATION_mov && decoded.operands[1].reg_num == 1), "decode_instruction should decode orr from the zero register as mov");
+    XTEST((!decode_instruction(0xF81D0FFE, 0x7AC, &decoded)), "decode_instruction should leave pre-indexed stores to the text");
+    uint32_t words[] = {0x528000E0, 0x11001400, 0xD65F03C0};
+    write_elf("test_operands.elf", 0x1000, words, 3);
+    struct program_t *elf = program_load("test_operands.elf", PROGRAM_eager);
+    XTEST((elf != NULL && elf->code_top == 0x1000 && elf->code_bot == 0x1008), "program_load should load the code range of an ELF file");
+    XTEST((elf != NULL && elf->code[1].operation == OPERATION_add && elf->code[1].constants[0] == 5 && elf->code[2].operation == OPERATION_ret && elf->code[3].operation == OPERATION_NULL), "program_load should decode the code of an ELF file");
+    if (elf != NULL) {
+        program_release(elf);
+    }
+    program_cache_clear();
+    remove("test_operands.elf");
+
+    // Test program images
+    struct program_t *parsed = program_load("examples/strlen.txt", PROGRAM_eager);
+    XTEST(program_save_image(parsed, "test_operands.img"), "program_save_image should save an image");
+    struct program_t *mapped = program_load("test_operands.img", PROGRAM_eager);
+    XTEST((mapped != NULL && mapped->image != NULL), "program_load should map an image");
+    XTEST((mapped != NULL && mapped->code_top == parsed->code_top && mapped->code_bot == parsed->code_bot && mapped->count == parsed->count), "image should hold the code range of the program");
+    XTEST((mapped != NULL && mapped->code[3].operation == parsed->code[3].operation && mapped->code[3].constants[0] == parsed->code[3].constants[0]), "image should hold the instructions of the program");
+    XTEST((mapped != NULL && mapped->symbols.count == 2 && strcmp(SYMBOL_NAME(&mapped->symbols, &mapped->symbols.symbols[1]), "test_strlen") == 0), "image should hold the symbols of the program");
+    program_release(parsed);
+    if (mapped != NULL) {
+        program_release(mapped);
+    }
+    program_cache_clear();
+    remove("test_operands.img");
+
+    // Test the engine against stepping the machine, with and without
+    // compiling blocks
+    struct machine_t *stepped_strlen = machine_create();
+    machine_load(stepped_strlen, "examples/strlen.txt", 0x7ac, 0xFF0);
+    uint64_t strlen_steps = machine_run(stepped_strlen, UINT64_MAX);
+    struct machine_t *threaded;
+    struct engine_t *engine;
+    for (int compiled = 0; compiled <= 1; compiled++) {
+        threaded = machine_create();
+        machine_load(threaded, "examples/strlen.txt", 0x7ac, 0xFF0);
+        engine = engine_create(threaded);
+        if (compiled) {
+            engine_enable_jit(engine, 1);
+        }
+        XTEST((engine_run(engine, ENGINE_UNBOUNDED) == strlen_steps && same_state(threaded, stepped_strlen, 0xF00, 0xFF8)), compiled ? "compiled blocks should run like machine_run" : "the engine should run like machine_run");
+        uint64_t native = 0;
+        for (uint64_t b = 0; b < engine->num_blocks; b++) {
+            native += engine->blocks[b].native != NULL;
+        }
+        XTEST((native > 0) == (compiled && engine->jit != NULL), "blocks should be compiled only with the JIT enabled");
+        engine_destroy(engine);
+        machine_destroy(threaded);
+    }
+    machine_destroy(stepped_strlen);
+    program_cache_clear();
+
+    // Test that each operand shape of add gets its own handler, and that the
+    // w shapes clear the upper half of their result
+    uint32_t shape_words[] = {0x8b020023, 0x91000424, 0x0b020025, 0x11000426, 0x910043ff, 0xd65f03c0};
+    write_elf("test_operands.elf", 0x700, shape_words, 6);
+    struct machine_t *shaped = machine_create();
+    machine_load(shaped, "test_operands.elf", 0x700, 0x1000);
+    shaped->registers[1] = 0x1FFFFFFFF;
+    shaped->registers[2] = 2;
+    shaped->registers[5] = shaped->registers[6] = 0xDEADBEEFDEADBEEF;
+    engine = engine_create(shaped);
+    XTEST((engine->slots[0].kind == HANDLER_add_xxx && engine->slots[1].kind == HANDLER_add_xxi && engine->slots[2].kind == HANDLER_add_www
+           && engine->slots[3].kind == HANDLER_add_wwi && engine->slots[4].kind == HANDLER_add_ssi), "predecode should pick the handler for each shape of add");
+    XTEST((engine_run(engine, 5) == 5 && shaped->registers[3] == 0x200000001 && shaped->registers[4] == 0x200000000
+           && shaped->registers[5] == 1 && shaped->registers[6] == 0 && shaped->sp == 0x1010), "add should zero the upper half of a w result");
+    engine_destroy(engine);
+    machine_destroy(shaped);
+    program_cache_clear();
+    remove("test_operands.elf");
+
+    // mov/strb pairs at 0x700, and ldr/add/str of one word at 0x714, both fused
+    uint32_t fused_words[] = {0x52800020, 0x39000420, 0x52800040, 0x39000020, 0xd65f03c0,
+                              0xb9400c20, 0x11000400, 0xb9000c20, 0xd65f03c0};
+    write_elf("test_operands.elf", 0x700, fused_words, 9);
+    uint64_t fused_starts[] = {0x700, 0x714};
+    uint64_t fused_bases[] = {MEMORY_NULL_GUARD - 1, 0};
+    for (int i = 0; i < 2; i++) {
+        for (int compiled = 0; compiled <= 1; compiled++) {
+            struct machine_t *stepped_fault = machine_create();
+            threaded = machine_create();
+            machine_load(stepped_fault, "test_operands.elf", fused_starts[i], 0x1000);
+            machine_load(threaded, "test_operands.elf", fused_starts[i], 0x1000);
+            stepped_fault->registers[1] = threaded->registers[1] = fused_bases[i];
+            uint64_t fault_steps = machine_run(stepped_fault, UINT64_MAX);
+            engine = engine_create(threaded);
+            if (compiled) {
+                engine_enable_jit(engine, 1);
+            }
+            XTEST((engine->num_fused == 2 && engine_run(engine, ENGINE_UNBOUNDED) == fault_steps && fault_steps == (i == 0 ? 3 : 0)
+                   && threaded->memory->fault.kind == FAULT_unmapped && threaded->memory->fault.pc == fused_starts[i] + (i == 0 ? 12 : 0)
+                   && same_state(threaded, stepped_fault, 0xF00, 0x1000)), "a fault inside a superinstruction should stop at the faulting instruction");
+            engine_destroy(engine);
+            machine_destroy(stepped_fault);
+            machine_destroy(threaded);
+        }
+    }
+    program_cache_clear();
+    remove("test_operands.elf");
+
+    // Test caches and timing
+    struct cache_config_t shape = {0, 0, 0, CACHE_lru, 4};
+    XTEST((cache_parse_config("32k:8:64:plru:3", &shape) && shape.size_bytes == 32768 && shape.ways == 8 && shape.policy == CACHE_plru && shape.cycles == 3), "cache_parse_config should read a cache's shape");
+    XTEST((!cache_parse_config("48k:8:64", &shape) && !cache_parse_config("32k:3:64:plru", &shape)), "cache_parse_config should reject shapes a cache cannot have");
+    XTEST((!cache_parse_config("32k:8:64:lru:", &shape) && !cache_parse_config("32k:8:64:lru:x", &shape)), "cache_parse_config should reject a hit latency that is not a number");
+    struct cache_t *lru = cache_create((struct cache_config_t){32, 2, 16, CACHE_lru, 4});
+    int lru_hits = cache_access(lru, 0x0) + cache_access(lru, 0x10) + cache_access(lru, 0x8) + cache_access(lru, 0x20);
+    XTEST((lru_hits == 1 && cache_access(lru, 0x0) && !cache_access(lru, 0x10) && lru->misses == 4), "an LRU cache should evict the line used least recently");
+    cache_destroy(lru);
+    struct cache_t *plru = cache_create((struct cache_config_t){64, 4, 16, CACHE_plru, 4});
+    for (uint64_t line = 0; line < 4; line++) {
+        cache_access(plru, line * 16);
+    }
+    cache_access(plru, 0x0);
+    cache_access(plru, 0x40);
+    XTEST((cache_access(plru, 0x0) && plru->misses == 5), "a pseudo-LRU cache should not evict the line just used");
+    cache_destroy(plru);
+    XTEST((timing_create("32k:2:64,1m:16:64,2m:16:64") == NULL), "timing_create should reject more cache levels than it models");
+    struct machine_t *timed = machine_create();
+    machine_load(timed, "examples/strlen.txt", 0x7ac, 0xFF0);
+    timed->timing = timing_create(TIMING_DEFAULT_CACHES);
+    machine_run(timed, UINT64_MAX);
+    XTEST((timed->timing->instructions == 184 && timed->timing->cycles > 184 && timed->timing->caches[0]->hits + timed->timing->caches[0]->misses == 98), "timing should charge every instruction and see every load and store");
+    uint64_t unpredicted_cycles = timed->timing->cycles;
+    timing_destroy(timed->timing);
+    machine_destroy(timed);
+    program_cache_clear();
+
+    // Test branch prediction
+    XTEST((predictor_create("ras", 1) == NULL && predictor_create("bimodal:100", 1) == NULL && predictor_create("static,ras,ras", 1) == NULL), "predictor_create should reject predictors it cannot model");
+    struct predictor_t *bimodal = predictor_create("bimodal:16", 2);
+    struct predictor_t *gshare = predictor_create("gshare:16:4", 2);
+    for (int i = 0; i < 100; i++) {
+        predictor_branch(bimodal, 0, 0x100, BRANCH_conditional, i % 2, 0x80);
+        predictor_branch(gshare, 0, 0x100, BRANCH_conditional, i % 2, 0x80);
+    }
+    XTEST((bimodal->sites[0].executed == 100 && bimodal->sites[0].taken == 50 && bimodal->mispredicted[BRANCH_conditional] >= 50 && gshare->mispredicted[BRANCH_conditional] < 10), "gshare should learn a pattern a bimodal predictor cannot");
+    predictor_destroy(bimodal);
+    predictor_destroy(gshare);
+    struct predictor_t *returns = predictor_create("static,ras:2", 4);
+    predictor_branch(returns, 0, 0x100, BRANCH_call, 1, 0x200);
+    predictor_branch(returns, 1, 0x200, BRANCH_call, 1, 0x300);
+    predictor_branch(returns, 2, 0x300, BRANCH_call, 1, 0x400);
+    int returned = predictor_branch(returns, 3, 0x400, BRANCH_return, 1, 0x304) + predictor_branch(returns, 3, 0x400, BRANCH_return, 1, 0x204) + predictor_branch(returns, 3, 0x400, BRANCH_return, 1, 0x104);
+    XTEST((returned == 2 && returns->mispredicted[BRANCH_return] == 1), "a return address stack should predict returns until calls overflow it");
+    predictor_destroy(returns);
+    struct machine_t *predicted = machine_create();
+    machine_load(predicted, "examples/strlen.txt", 0x7ac, 0xFF0);
+    predicted->timing = timing_create(TIMING_DEFAULT_CACHES);
+    predicted->predictor = predictor_create("static", predicted->program->count);
+    machine_run(predicted, UINT64_MAX);
+    uint64_t mispredicted = 0;
+    for (int kind = 0; kind < BRANCH_KINDS; kind++) {
+        mispredicted += predicted->predictor->mispredicted[kind];
+    }
+    XTEST((mispredicted > 0 && predicted->timing->cycles == unpredicted_cycles + mispredicted * TIMING_MISPREDICT_CYCLES), "a mispredicted branch should cost cycles");
+    timing_destroy(predicted->timing);
+    predictor_destroy(predicted->predictor);
+    machine_destroy(predicted);
+    program_cache_clear();
+
+    // Test breakpoints
+    struct breakpoint_t *by_steps = breakpoint_create("100");
+    struct breakpoint_t *by_pc = breakpoint_create("0x7c4 == pc");
+    struct breakpoint_t *by_condition = breakpoint_create("[sp + 8] != 0 && (x0 > -1 || w1 == 2)");
+    XTEST((by_steps->kind == BREAKPOINT_steps && by_steps->target == 100 && by_pc->kind == BREAKPOINT_pc && by_pc->target == 0x7c4 && by_condition->kind == BREAKPOINT_condition && by_condition->num_ops == 14), "breakpoint_create should compile a breakpoint once");
+    XTEST((breakpoint_create("x31 == 0") == NULL && breakpoint_create("x0 ==") == NULL && breakpoint_create("(x0 == 1") == NULL && breakpoint_create("x0 = 1") == NULL), "breakpoint_create should reject conditions it cannot read");
+    struct machine_t *stepped = machine_create();
+    struct machine_t *skipped = machine_create();
+    machine_load(stepped, "examples/strlen.txt", 0x7ac, 0xFF0);
+    machine_load(skipped, "examples/strlen.txt", 0x7ac, 0xFF0);
+    machine_run(stepped, 100);
+    breakpoint_run(by_steps, skipped);
+    XTEST((by_steps->reached && by_steps->executed == 100 && skipped->pc == stepped->pc && memcmp(skipped->registers, stepped->registers, sizeof(stepped->registers)) == 0), "a breakpoint should run a number of steps silently");
+    machine_load(skipped, "examples/strlen.txt", 0x7ac, 0xFF0);
+    breakpoint_run(by_pc, skipped);
+    XTEST((by_pc->reached && by_pc->executed == 6 && skipped->pc == 0x7c4), "a breakpoint should run until the pc reaches an address");
+    machine_load(skipped, "examples/strlen.txt", 0x7ac, 0xFF0);
+    breakpoint_run(by_condition, skipped);
+    XTEST((by_condition->reached && memory_peek(skipped->memory, skipped->sp + 8) != 0 && breakpoint_holds(by_condition, skipped, by_condition->executed)), "a breakpoint should run until its condition holds");
+    struct breakpoint_t *never = breakpoint_create("x0 == 3");
+    breakpoint_run(never, skipped);
+    XTEST((!never->reached && never->executed > 0), "a breakpoint should report a machine that stopped before reaching it");
+    breakpoint_destroy(by_steps);
+    breakpoint_destroy(by_pc);
+    breakpoint_destroy(by_condition);
+    breakpoint_destroy(never);
+    machine_destroy(stepped);
+    machine_destroy(skipped);
+    program_cache_clear();
+
+    // Test profiling
+    struct machine_t *profiled = machine_create();
+    machine_load(profiled, "examples/function.txt", 0x40056c, 0xFFF0);
+    struct profile_t *profile = profile_create(profiled);
+    uint64_t profile_pc = profiled->pc;
+    uint64_t profile_slot = machine_slot(profiled, profile_pc);
+    while (machine_step(profiled)) {
+        profile_step(profile, profile_slot, profile_pc);
+        profile_pc = profiled->pc;
+        profile_slot = machine_slot(profiled, profile_pc);
+    }
+    struct call_node_t *callee = &profile->nodes[profile->nodes[profile->nodes[0].child].child];
+    XTEST((profile->num_nodes == 3 && callee->calls == 1 && callee->self == 10 && profile->nodes[callee->parent].self == 13), "profile should count the instructions retired in a call and around it");
+    XTEST((profile->loads[machine_slot(profiled, 0x400550)] == 1 && profile->taken[machine_slot(profiled, 0x40058c)] == 1), "profile should count loads and taken branches per instruction");
+    profile_destroy(profile);
+    machine_destroy(profiled);
+    program_cache_clear();
+
+    // Test condition flags
+    struct operand_t x2 = {OPERAND_register, REGISTER_x, 2, 0};
+    struct operand_t zero = {OPERAND_constant, 0, 0, 0};
+    struct instruction_t cmp = {OPERATION_cmp, {w13, constant}};
+    machine.registers[13] = 0xFFFFFFFB; // -5 as a w register
+    execute(cmp);
+    XTEST((get_nzcv(&machine.flags) == (FLAG_N | FLAG_C)), "cmp -5, #21 set incorrect NZCV flags");
+    XTEST(condition_holds(&machine.flags, OPERATION_blt), "b.lt should be taken after cmp -5, #21");
+    XTEST(!condition_holds(&machine.flags, OPERATION_bgt), "b.gt should not be taken after cmp -5, #21");
+
+    struct instruction_t cmp_x = {OPERATION_cmp, {x2, zero}};
+    machine.registers[2] = 0x8000000000000000;
+    execute(cmp_x);
+    XTEST(condition_holds(&machine.flags, OPERATION_ble), "b.le should be taken after cmp of the most negative x value with #0");
+
+    struct instruction_t subs = {OPERATION_subs, {w13, w13, w13}};
+    execute(subs);
+    XTEST((machine.registers[13] == 0), "subs put incorrect value in w13");
+    XTEST(condition_holds(&machine.flags, OPERATION_beq), "b.eq should be taken after subs with a zero result");
+
+    struct instruction_t adds = {OPERATION_adds, {w13, w13, constant}};
+    machine.registers[13] = 0x7FFFFFFF;
+    execute(adds);
+    XTEST((get_nzcv(&machine.flags) == (FLAG_N | FLAG_V)), "adds overflowing a w register set incorrect NZCV flags");
+
+    struct instruction_t tst = {OPERATION_tst, {w13, constant}};
+    machine.registers[13] = 0x2;
+    execute(tst);
+    XTEST(condition_holds(&machine.flags, OPERATION_beq), "b.eq should be taken after tst with no common bits");
 
     if (ok) {
         printf("All tests passed\n");
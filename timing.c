@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "timing.h"
+#include "code.h"
+
+/*
+ * Return the cycles an instruction costs before any memory access it makes.
+ */
+static uint32_t latency(unsigned int operation) {
+    switch (operation) {
+    case OPERATION_mul:
+        return 3;
+    case OPERATION_sdiv:
+    case OPERATION_udiv:
+        return 12;
+    case OPERATION_ldr:
+    case OPERATION_ldrb:
+        return 0;   // Charged by the cache level that hits
+    case OPERATION_bl:
+    case OPERATION_ret:
+        return 2;
+    }
+    return 1;
+}
+
+/*
+ * Create a timing model with caches described as a comma-separated list of
+ * shapes cache_parse_config() reads, L1D first; return NULL if the list is
+ * not valid.
+ */
+struct timing_t *timing_create(char *caches) {
+    struct timing_t *timing = calloc(1, sizeof(struct timing_t));
+    char *list = strdup(caches);
+    char *next = list;
+    int valid = 1;
+    while (next != NULL && valid) {
+        char *shape = strsep(&next, ",");
+        struct cache_config_t config = {0, 0, 0, CACHE_lru, timing->levels == 0 ? 4 : 12};
+        valid = timing->levels < TIMING_LEVELS && cache_parse_config(shape, &config);
+        if (valid) {
+            timing->caches[timing->levels++] = cache_create(config);
+        }
+        else {
+            fprintf(stderr, "Invalid cache: %s\n", shape);
+        }
+    }
+    free(list);
+    if (!valid) {
+        timing_destroy(timing);
+        return NULL;
+    }
+    return timing;
+}
+
+/*
+ * Charge an instruction that is about to execute.
+ */
+void timing_instruction(struct timing_t *timing, unsigned int operation) {
+    timing->instructions++;
+    timing->cycles += latency(operation);
+}
+
+/*
+ * Charge an access of size bytes at a simulated address. An access that
+ * spans two lines costs as much as the slower of them.
+ */
+void timing_access(struct timing_t *timing, uint64_t address, int size, int store) {
+    int line_bits = timing->caches[0]->line_bits;
+    uint64_t cost = 0;
+    for (uint64_t line = address >> line_bits; line <= (address + size - 1) >> line_bits; line++) {
+        uint64_t cycles = TIMING_MEMORY_CYCLES;
+        for (int level = 0; level < timing->levels; level++) {
+            struct cache_t *cache = timing->caches[level];
+            if (cache_access(cache, line << line_bits)) {
+                cycles = cache->config.cycles;
+                break;
+            }
+        }
+        cost = cycles > cost ? cycles : cost;
+    }
+    if (!store) {
+        timing->cycles += cost;
+    }
+}
+
+/*
+ * Print the estimated cycles and how each cache did.
+ */
+void timing_print(struct timing_t *timing, FILE *out) {
+    double cpi = timing->instructions == 0 ? 0 : (double)timing->cycles / timing->instructions;
+    fprintf(out, "Cycles: %lu for %lu instructions (%.2f per instruction)\n", timing->cycles, timing->instructions, cpi);
+    for (int level = 0; level < timing->levels; level++) {
+        struct cache_t *cache = timing->caches[level];
+        uint64_t accesses = cache->hits + cache->misses;
+        fprintf(out, "%s: %lu accesses, %lu misses (%.2f%%)\n", level == 0 ? "L1D" : "L2", accesses,
+                cache->misses, accesses == 0 ? 0 : 100.0 * cache->misses / accesses);
+    }
+}
+
+/*
+ * Free a timing model and its caches.
+ */
+void timing_destroy(struct timing_t *timing) {
+    for (int level = 0; level < timing->levels; level++) {
+        cache_destroy(timing->caches[level]);
+    }
+    free(timing);
+}
@@ -0,0 +1,42 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "cache.h"
+
+// Cache levels the model has at most: L1D, then L2
+#define TIMING_LEVELS           2
+
+// What a load that misses every cache costs
+#define TIMING_MEMORY_CYCLES    100
+
+// What a mispredicted branch costs, flushing the pipeline
+#define TIMING_MISPREDICT_CYCLES    15
+
+// Caches used when none are given, loosely those of a Cortex-A72
+#define TIMING_DEFAULT_CACHES   "32k:2:64:lru:4,1m:16:64:plru:12"
+
+/*
+ * An estimate of how many cycles a run takes on an in-order core that
+ * retires one instruction at a time. Each instruction costs its latency from
+ * a table, except loads, which cost the hit latency of the first cache level
+ * holding their data, or TIMING_MEMORY_CYCLES. Stores go through the caches,
+ * so their misses are counted and their lines allocated, but a store buffer
+ * hides their latency. A branch the machine's predictor got wrong costs
+ * TIMING_MISPREDICT_CYCLES more.
+ */
+struct timing_t {
+    struct cache_t *caches[TIMING_LEVELS];
+    int levels;
+    uint64_t cycles;
+    uint64_t instructions;
+};
+
+struct timing_t *timing_create(char *caches);
+void timing_instruction(struct timing_t *timing, unsigned int operation);
+void timing_access(struct timing_t *timing, uint64_t address, int size, int store);
+void timing_print(struct timing_t *timing, FILE *out);
+void timing_destroy(struct timing_t *timing);
+
+#endif // __TIMING_H__
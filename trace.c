@@ -0,0 +1,442 @@
+#define _GNU_SOURCE    // fopencookie()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+static void *write_trace(void *argument);
+
+
+/*
+ * Hand the buffered part of a trace to the writer thread.
+ */
+static void flush_trace(struct trace_t *trace) {
+    ring_push(trace->ring, trace->buffer, trace->length);
+    trace->length = 0;
+}
+
+/*
+ * Append a byte to a trace.
+ */
+static void write_byte(struct trace_t *trace, uint8_t byte) {
+    if (trace->length == TRACE_BUFFER_BYTES) {
+        flush_trace(trace);
+    }
+    trace->buffer[trace->length++] = byte;
+}
+
+/*
+ * Append an unsigned LEB128 varint: seven bits per byte, low bits first.
+ */
+static void write_varint(struct trace_t *trace, uint64_t value) {
+    if (trace->length + 10 > TRACE_BUFFER_BYTES) {
+        flush_trace(trace);
+    }
+    while (value >= 0x80) {
+        trace->buffer[trace->length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    trace->buffer[trace->length++] = value;
+}
+
+/*
+ * Read an unsigned LEB128 varint; return 0 at the end of the file.
+ */
+static int read_varint(FILE *file, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc_unlocked(file);
+        if (byte == EOF) {
+            return 0;
+        }
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Map signed deltas to unsigned values so that small ones stay short.
+ */
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/*
+ * Start a trace of a machine, written to a file in the given format by a
+ * new writer thread, and record the header and the machine's current state.
+ * The file must not have been used yet.
+ */
+struct trace_t *trace_create(FILE *file, struct machine_t *machine, int format) {
+    struct trace_t *trace = calloc(1, sizeof(struct trace_t));
+    trace->file = file;
+    trace->machine = machine;
+    trace->format = format;
+    trace->shadow = memory_create();
+    trace->buffer = malloc(TRACE_BUFFER_BYTES);
+    trace->ring = ring_create(TRACE_RING_BYTES);
+    setvbuf(file, NULL, _IOFBF, TRACE_OUTPUT_BYTES);
+    pthread_create(&trace->writer, NULL, write_trace, trace);
+
+    for (const char *c = TRACE_MAGIC; *c != '\0'; c++) {
+        write_byte(trace, *c);
+    }
+    write_varint(trace, TRACE_VERSION);
+    write_varint(trace, machine->code_top);
+    write_varint(trace, machine->code_bot);
+
+    write_byte(trace, TRACE_state);
+    trace_step(trace, TRACE_NO_INSTRUCTION);
+    return trace;
+}
+
+/*
+ * Append a word that changed to the scratch list.
+ */
+static void add_changed(struct trace_t *trace, uint64_t count, uint64_t index, uint64_t value) {
+    if (count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 64;
+        trace->changed = realloc(trace->changed, trace->capacity * 2 * sizeof(uint64_t));
+    }
+    trace->changed[2 * count] = index;
+    trace->changed[2 * count + 1] = value;
+}
+
+/*
+ * Write everything about the machine that changed since the last record,
+ * and remember it. Like print_memory(), grow the stack first if sp left it.
+ */
+static void write_changes(struct trace_t *trace) {
+    struct machine_t *m = trace->machine;
+    if (m->sp < m->stack_top || m->sp > m->stack_bot) {
+        machine_grow_stack(m, m->sp);
+    }
+
+    // Find the words on the stack that differ from what the trace says,
+    // among those the machine marked as possibly changed
+    uint64_t first[CHANGED_RANGES], last[CHANGED_RANGES];
+    uint64_t words = STACK_WORDS(m->stack_top, m->stack_bot);
+    int ranges = words != 0;
+    first[0] = 0;
+    last[0] = words - 1;
+    if (trace->started) {
+        ranges = machine_changed_words(m, first, last);
+    }
+    uint64_t count = 0;
+    for (int i = 0; i < ranges; i++) {
+        for (uint64_t j = first[i]; j <= last[i]; j++) {
+            uint64_t address = m->stack_top + j * WORD_SIZE_BYTES;
+            uint64_t value = memory_peek(m->memory, address);
+            uint64_t old = memory_peek(trace->shadow, address);
+            if (value != old) {
+                add_changed(trace, count++, j, value ^ old);
+                memory_poke(trace->shadow, address, value);
+            }
+        }
+    }
+    machine_clear_dirty(m);
+    trace->started = 1;
+
+    uint8_t changed = 0;
+    if (m->sp != trace->sp) {
+        changed |= CHANGED_sp;
+    }
+    if (m->flags.operation != trace->flags.operation || m->flags.wide != trace->flags.wide
+            || m->flags.first != trace->flags.first || m->flags.second != trace->flags.second) {
+        changed |= CHANGED_flags;
+    }
+    if (m->stack_top != trace->stack_top || m->stack_bot != trace->stack_bot) {
+        changed |= CHANGED_stack;
+    }
+    if (count != 0) {
+        changed |= CHANGED_words;
+    }
+    uint32_t registers = 0;
+    for (int i = 0; i <= 30; i++) {
+        if (m->registers[i] != trace->registers[i]) {
+            registers |= 1u << i;
+        }
+    }
+
+    write_byte(trace, changed);
+    write_varint(trace, zigzag(m->pc - trace->pc));
+    write_varint(trace, registers);
+    for (int i = 0; i <= 30; i++) {
+        if (registers & (1u << i)) {
+            write_varint(trace, m->registers[i] ^ trace->registers[i]);
+        }
+    }
+    if (changed & CHANGED_sp) {
+        write_varint(trace, zigzag(m->sp - trace->sp));
+    }
+    if (changed & CHANGED_flags) {
+        write_byte(trace, m->flags.operation);
+        write_byte(trace, m->flags.wide);
+        write_varint(trace, m->flags.first);
+        write_varint(trace, m->flags.second);
+    }
+    if (changed & CHANGED_stack) {
+        write_varint(trace, zigzag(m->stack_top - trace->stack_top));
+        write_varint(trace, zigzag(m->stack_bot - trace->stack_bot));
+    }
+    if (changed & CHANGED_words) {
+        // Word indices are written as signed gaps from the previous one
+        write_varint(trace, count);
+        uint64_t previous = 0;
+        for (uint64_t i = 0; i < count; i++) {
+            write_varint(trace, zigzag(trace->changed[2 * i] - previous));
+            write_varint(trace, trace->changed[2 * i + 1]);
+            previous = trace->changed[2 * i];
+        }
+    }
+
+    memcpy(trace->registers, m->registers, sizeof(trace->registers));
+    trace->sp = m->sp;
+    trace->pc = m->pc;
+    trace->flags = m->flags;
+    trace->stack_top = m->stack_top;
+    trace->stack_bot = m->stack_bot;
+}
+
+/*
+ * Record an instruction that completed, given its index in the code.
+ */
+void trace_step(struct trace_t *trace, uint64_t index) {
+    if (index != TRACE_NO_INSTRUCTION) {
+        write_byte(trace, TRACE_step);
+        write_varint(trace, index);
+    }
+    write_changes(trace);
+}
+
+/*
+ * Record the machine's fault, raised by the instruction with the given index
+ * (or TRACE_NO_INSTRUCTION), and the state it stopped in.
+ */
+void trace_fault(struct trace_t *trace, uint64_t index) {
+    struct fault_t fault = trace->machine->memory->fault;
+    write_byte(trace, TRACE_fault);
+    write_varint(trace, index + 1);     // Wraps TRACE_NO_INSTRUCTION to 0
+    write_byte(trace, fault.kind);
+    write_varint(trace, fault.address);
+    write_varint(trace, fault.pc);
+    write_changes(trace);
+}
+
+/*
+ * Finish a trace, waiting for the writer thread to write everything out;
+ * the file stays open.
+ */
+void trace_destroy(struct trace_t *trace) {
+    write_byte(trace, TRACE_end);
+    flush_trace(trace);
+    ring_close(trace->ring);
+    pthread_join(trace->writer, NULL);
+    fflush(trace->file);
+    ring_destroy(trace->ring);
+    memory_destroy(trace->shadow);
+    free(trace->buffer);
+    free(trace->changed);
+    free(trace);
+}
+
+/*
+ * Read the header of a trace and check that it was made from the machine's
+ * code; return 0 if it was not.
+ */
+int trace_check_header(FILE *file, struct machine_t *machine) {
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    uint64_t version, code_top, code_bot;
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+            || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0
+            || !read_varint(file, &version) || version != TRACE_VERSION
+            || !read_varint(file, &code_top) || !read_varint(file, &code_bot)) {
+        return 0;
+    }
+    return code_top == machine->code_top && code_bot == machine->code_bot;
+}
+
+/*
+ * Read the changes written by write_changes() and apply them to a machine,
+ * marking them as dirty as if the machine had executed the step itself.
+ */
+static int read_changes(FILE *file, struct machine_t *m) {
+    int changed = getc_unlocked(file);
+    uint64_t value, registers;
+    if (changed == EOF || !read_varint(file, &value) || !read_varint(file, &registers)) {
+        return 0;
+    }
+    m->pc += unzigzag(value);
+    m->dirty.registers |= registers;
+    for (int i = 0; i <= 30; i++) {
+        if (registers & (1u << i)) {
+            if (!read_varint(file, &value)) {
+                return 0;
+            }
+            m->registers[i] ^= value;
+        }
+    }
+    if (changed & CHANGED_sp) {
+        if (!read_varint(file, &value)) {
+            return 0;
+        }
+        m->sp += unzigzag(value);
+        m->dirty.registers |= DIRTY_sp;
+    }
+    if (changed & CHANGED_flags) {
+        m->flags.operation = getc_unlocked(file);
+        m->flags.wide = getc_unlocked(file);
+        if (!read_varint(file, &m->flags.first) || !read_varint(file, &m->flags.second)) {
+            return 0;
+        }
+        m->dirty.registers |= DIRTY_flags;
+    }
+    if (changed & CHANGED_stack) {
+        uint64_t top, bot;
+        if (!read_varint(file, &top) || !read_varint(file, &bot)) {
+            return 0;
+        }
+        m->stack_top += unzigzag(top);
+        m->stack_bot += unzigzag(bot);
+    }
+    if (changed & CHANGED_words) {
+        uint64_t count, index = 0;
+        if (!read_varint(file, &count)) {
+            return 0;
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t gap;
+            if (!read_varint(file, &gap) || !read_varint(file, &value)) {
+                return 0;
+            }
+            index += unzigzag(gap);
+            uint64_t address = m->stack_top + index * WORD_SIZE_BYTES;
+            memory_poke(m->memory, address, memory_peek(m->memory, address) ^ value);
+            machine_mark_store(m, address, WORD_SIZE_BYTES);
+        }
+    }
+    return 1;
+}
+
+/*
+ * Read the next record of a trace and apply it to a machine, which must
+ * start out zeroed with an empty memory. Return the kind of record, setting
+ * the index of the instruction it ran for steps and faults, or -1 if the
+ * trace is truncated.
+ */
+int trace_read(FILE *file, struct machine_t *machine, uint64_t *index) {
+    int kind = getc_unlocked(file);
+    *index = TRACE_NO_INSTRUCTION;
+    switch (kind) {
+    case TRACE_state:
+        break;
+    case TRACE_step:
+        if (!read_varint(file, index)) {
+            return -1;
+        }
+        break;
+    case TRACE_fault: {
+        struct fault_t *fault = &machine->memory->fault;
+        if (!read_varint(file, index)) {
+            return -1;
+        }
+        (*index)--;
+        fault->kind = getc_unlocked(file);
+        if (!read_varint(file, &fault->address) || !read_varint(file, &fault->pc)) {
+            return -1;
+        }
+        break;
+    }
+    case TRACE_end:
+        return TRACE_end;
+    default:
+        return -1;
+    }
+    return read_changes(file, machine) ? kind : -1;
+}
+
+/*
+ * Replay a trace against a machine holding the code it was made from,
+ * printing what the simulator would have printed: the state after every
+ * step for TRACE_text, or only what changed for TRACE_changes. Only the
+ * machine's code is used, so it may be running at the same time. Return the
+ * kind of fault the trace stopped at, or -1 if the trace does not match the
+ * code or is truncated.
+ */
+int trace_render(FILE *file, FILE *out, struct machine_t *machine, int format) {
+    if (!trace_check_header(file, machine)) {
+        return -1;
+    }
+
+    // The replayed state lives in its own machine and memory
+    struct machine_t view;
+    memset(&view, 0, sizeof(view));
+    view.code = machine->code;
+    view.code_top = machine->code_top;
+    view.code_bot = machine->code_bot;
+    view.memory = memory_create();
+
+    int kind;
+    uint64_t index;
+    while ((kind = trace_read(file, &view, &index)) != TRACE_end && kind >= 0) {
+        if (index != TRACE_NO_INSTRUCTION) {
+            fprint_instruction(out, unpack_instruction(view.code[index]));
+        }
+        if (kind == TRACE_fault) {
+            machine_print_fault(&view, out);
+        }
+        if (format == TRACE_changes && kind != TRACE_state) {
+            machine_print_changes(&view, out);
+            fprintf(out, "\n");
+        }
+        else {
+            machine_print_memory(&view, out);
+            fprintf(out, "\n\n");
+            machine_clear_dirty(&view);
+        }
+    }
+    int status = kind == TRACE_end ? view.memory->fault.kind : -1;
+    memory_destroy(view.memory);
+    return status;
+}
+
+/*
+ * Let the writer thread read the ring like a file.
+ */
+static ssize_t read_ring(void *cookie, char *buffer, size_t size) {
+    return ring_pop(cookie, buffer, size);
+}
+
+/*
+ * Body of the writer thread: take encoded records off the ring until the
+ * machine's thread closes it, and write them out in the trace's format.
+ */
+static void *write_trace(void *argument) {
+    struct trace_t *trace = argument;
+    if (trace->format == TRACE_binary) {
+        uint8_t *chunk = malloc(TRACE_OUTPUT_BYTES);
+        uint64_t length;
+        while ((length = ring_pop(trace->ring, chunk, TRACE_OUTPUT_BYTES)) > 0) {
+            fwrite(chunk, 1, length, trace->file);
+        }
+        free(chunk);
+    }
+    else {
+        cookie_io_functions_t functions = {read_ring, NULL, NULL, NULL};
+        FILE *records = fopencookie(trace->ring, "r", functions);
+        setvbuf(records, NULL, _IOFBF, TRACE_BUFFER_BYTES);
+        if (trace_render(records, trace->file, trace->machine, trace->format) < 0) {
+            // Keep draining the ring so the machine's thread never blocks
+            while (getc_unlocked(records) != EOF) {
+            }
+        }
+        fclose(records);
+    }
+    return NULL;
+}
@@ -0,0 +1,76 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "machine.h"
+#include "ring.h"
+
+#define TRACE_MAGIC     "ARMTRACE"
+#define TRACE_VERSION   2
+
+#define TRACE_BUFFER_BYTES  (64 << 10)
+#define TRACE_RING_BYTES    (16 << 20)
+#define TRACE_OUTPUT_BYTES  (1 << 20)
+
+// What the writer thread makes of a trace
+#define TRACE_binary    0   // Write it out as it is
+#define TRACE_text      1   // Render the state after every step, like print_memory()
+#define TRACE_changes   2   // Render only what changed, like print_changes()
+
+#define TRACE_state     0   // The state before the first instruction
+#define TRACE_step      1   // An instruction completed
+#define TRACE_fault     2   // An instruction faulted; the machine stopped at it
+#define TRACE_end       3   // The program ran off the end of its code
+
+// Index of a fault record that was not raised by an instruction
+#define TRACE_NO_INSTRUCTION UINT64_MAX
+
+// What a step record holds besides the instruction index and pc
+#define CHANGED_sp      0b00000001
+#define CHANGED_flags   0b00000010
+#define CHANGED_stack   0b00000100  // The range of addresses shown as the stack
+#define CHANGED_words   0b00001000  // Words within the stack range
+
+/*
+ * A binary execution trace. The file starts with a header and a snapshot of
+ * the initial state; after that every record only holds what changed since
+ * the previous one. Numbers are LEB128 varints, register and word values are
+ * XORed with their previous value first, and the pc is a signed delta.
+ *
+ * The machine's thread only encodes records, keeping a shadow of the last
+ * state it recorded to diff against and comparing only the stack words the
+ * machine marked as dirty. Encoded records go through a ring to a writer
+ * thread, which writes them out or renders them as text in large batches;
+ * the machine only waits when the ring is full.
+ */
+struct trace_t {
+    FILE *file;
+    struct machine_t *machine;
+    int format;             // TRACE_binary, TRACE_text or TRACE_changes
+    struct ring_t *ring;
+    pthread_t writer;
+    uint64_t registers[32];
+    uint64_t sp;
+    uint64_t pc;
+    struct flags_t flags;
+    uint64_t stack_top;
+    uint64_t stack_bot;
+    struct memory_t *shadow;    // Memory as the trace has described it so far
+    uint64_t *changed;      // Scratch list of changed words: index, value pairs
+    uint64_t capacity;      // Pairs the scratch list holds
+    uint8_t *buffer;        // Records not yet pushed into the ring
+    uint64_t length;
+    uint8_t started;        // Set once the initial state has been written
+};
+
+struct trace_t *trace_create(FILE *file, struct machine_t *machine, int format);
+void trace_step(struct trace_t *trace, uint64_t index);
+void trace_fault(struct trace_t *trace, uint64_t index);
+void trace_destroy(struct trace_t *trace);
+int trace_check_header(FILE *file, struct machine_t *machine);
+int trace_read(FILE *file, struct machine_t *machine, uint64_t *index);
+int trace_render(FILE *file, FILE *out, struct machine_t *machine, int format);
+
+#endif // __TRACE_H__